@@ -19,101 +19,212 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
 
-#define ALIGN8(a) (((size_t)(a) + 7) & ~(size_t)7)
+#include "allocate.h"
 
-static void ensure_space(int nbytes, bool aligned);
+/* Arena allocator
+ *
+ * Lots of small allocations which are all released together (the parsed
+ * test definitions, per-test scratch buffers) are bumped off chunks of
+ * memory instead of being malloc'ed individually.
+ *
+ * Chunks grow geometrically, from CHUNK_MIN up to CHUNK_MAX. Requests
+ * larger than a quarter of the next chunk size get a chunk of their own
+ * ('large' passthrough), so they neither waste the rest of the current
+ * chunk nor inflate the chunk sizes.
+ *
+ * All chunks are kept in one list, newest first. The chunk we currently
+ * bump from is never older than any chunk allocated after it, so a mark
+ * (head, current chunk and its fill level) is enough to undo everything
+ * allocated since: free the chunks in front of the marked head and reset
+ * the fill level. The chunk size goes back to what it was at the mark,
+ * and the largest chunk released is kept as a spare for the next chunk
+ * needed, so a scratch arena that is reset after every test doesn't
+ * malloc() a new chunk each time.
+ *
+ * Memory is not cleared unless ARENA_ZERO is given. Like malloc() failure
+ * in the rest of the program, running out of memory is fatal.
+ */
+
+#define CHUNK_MIN      ((size_t)16 * 1024)
+#define CHUNK_MAX      ((size_t)4 * 1024 * 1024)
+#define ARENA_ALIGN_TO _Alignof(max_align_t)
+#define ALIGN_UP(a)    (((size_t)(a) + ARENA_ALIGN_TO - 1) & ~(size_t)(ARENA_ALIGN_TO - 1))
 
-static const int size   = 8 * 1024; /* size of a single buffer      */
-static const int nmax   = 1000; /* max number of buffers        */
-static const int nincr  = 16; /* number of buffers to grow by */
-static int       nalloc = 0;
+struct ArenaChunk
+{
+	struct ArenaChunk *next;
+	size_t             size;
+	size_t             used;
+};
 
-static char *currbuffer = NULL;
-static int   used       = 0;
+#define CHUNK_HEADER   ALIGN_UP(sizeof(struct ArenaChunk))
+#define CHUNK_DATA(ch) ((unsigned char *)(ch) + CHUNK_HEADER)
 
-static int    idx     = 0;
-static char **buffers = NULL;
+static struct ArenaChunk *new_chunk(struct Arena *arena, size_t size);
+static struct ArenaChunk *reuse_spare(struct Arena *arena, size_t size);
 
-void *allocate(int size, bool align)
+/********************************************************
+ * 	arena_alloc
+ *
+ * 	flags: ARENA_ALIGN to align the returned memory
+ * 	for any type, ARENA_ZERO to clear it.
+ * 	Never returns NULL.
+ *******************************************************/
+
+void *arena_alloc(struct Arena *arena, size_t size, unsigned flags)
 {
-	char *ret;
+	struct ArenaChunk *chunk = arena->current;
+	unsigned char     *ret;
+	size_t             offs;
+
+	if (size == 0)
+		size = 1;
 
-	ensure_space(size, align);
+	if (!arena->nextsize)
+		arena->nextsize = CHUNK_MIN;
 
-	if (align)
+	if (size > arena->nextsize / 4)
 	{
-		ret  = currbuffer + ALIGN8(used);
-		used = ALIGN8(used) + size;
+		/* large passthrough, current chunk stays as it is */
+		chunk       = new_chunk(arena, size);
+		chunk->used = size;
+		ret         = CHUNK_DATA(chunk);
 	}
 	else
 	{
-		ret   = currbuffer + used;
-		used += size;
+		offs = chunk ? chunk->used : 0;
+		if (flags & ARENA_ALIGN)
+			offs = ALIGN_UP(offs);
+
+		if (!chunk || offs > chunk->size || size > chunk->size - offs)
+		{
+			if (!(chunk = reuse_spare(arena, arena->nextsize)))
+				chunk = new_chunk(arena, arena->nextsize);
+			arena->current  = chunk;
+			arena->nextsize = arena->nextsize < CHUNK_MAX ? 2 * arena->nextsize : CHUNK_MAX;
+			offs            = 0;
+		}
+		ret         = CHUNK_DATA(chunk) + offs;
+		chunk->used = offs + size;
 	}
 
+	if (flags & ARENA_ZERO)
+		memset(ret, 0, size);
+
 	return ret;
 }
 
-void free_all(void)
+/********************************************************
+ * 	arena_strndup
+ *
+ * 	Copy len chars of str into the arena, adding a
+ * 	terminating '\0'.
+ *******************************************************/
+
+char *arena_strndup(struct Arena *arena, const char *str, size_t len)
 {
-	for (int i = 0; i < idx; i++)
-		free(buffers[i]);
-	free(buffers);
-
-	currbuffer = NULL;
-	buffers    = NULL;
-	nalloc     = 0;
-	idx        = 0;
-	used       = 0;
+	char *ret = arena_alloc(arena, len + 1, 0);
+
+	memcpy(ret, str, len);
+	ret[len] = '\0';
+	return ret;
 }
 
-static void ensure_space(int nbytes, bool aligned)
+char *arena_strdup(struct Arena *arena, const char *str)
 {
-	if (nbytes > size)
-	{
-		printf("%s(): requested too large of a buffer: %d\n", __func__, nbytes);
-		exit(1);
-	}
-	if (nbytes < 1)
-	{
-		printf("%s(): requested invalid buffer size: %d\n", __func__, nbytes);
-		exit(1);
-	}
+	return arena_strndup(arena, str, strlen(str));
+}
 
-	int available = size - (aligned ? (int)ALIGN8(used) : used);
-	if (currbuffer && nbytes <= available)
-		return;
+/********************************************************
+ * 	arena_mark / arena_reset
+ *
+ * 	arena_reset() releases everything allocated since
+ * 	the corresponding arena_mark().
+ *******************************************************/
 
-	if (idx >= nalloc)
-	{
-		int newalloc = nalloc + nincr;
+struct ArenaMark arena_mark(const struct Arena *arena)
+{
+	return (struct ArenaMark){ .head     = arena->head,
+		                   .current  = arena->current,
+		                   .used     = arena->current ? arena->current->used : 0,
+		                   .nextsize = arena->nextsize };
+}
 
-		if (newalloc > nmax)
-		{
-			printf("%s(): exceeded max. number of pool buffers (%d)\n",
-			       __func__, newalloc);
-			exit(1);
-		}
+void arena_reset(struct Arena *arena, const struct ArenaMark *mark)
+{
+	struct ArenaChunk *chunk;
 
-		char **tmp = realloc(buffers, newalloc * sizeof *buffers);
-		if (!tmp)
+	while ((chunk = arena->head) && chunk != mark->head)
+	{
+		arena->head = chunk->next;
+		if (chunk->size <= CHUNK_MAX && (!arena->spare || chunk->size > arena->spare->size))
 		{
-			perror(__func__);
-			exit(1);
+			free(arena->spare);
+			arena->spare = chunk;
 		}
-		buffers = tmp;
-		nalloc  = newalloc;
+		else
+			free(chunk);
+	}
+	arena->current  = mark->current;
+	arena->nextsize = mark->nextsize;
+	if (arena->current)
+		arena->current->used = mark->used;
+}
+
+/********************************************************
+ * 	arena_free
+ *
+ * 	Release all memory. The arena can be used again
+ * 	afterwards.
+ *******************************************************/
+
+void arena_free(struct Arena *arena)
+{
+	struct ArenaChunk *chunk;
+
+	while ((chunk = arena->head))
+	{
+		arena->head = chunk->next;
+		free(chunk);
 	}
+	free(arena->spare);
+	arena->spare    = NULL;
+	arena->current  = NULL;
+	arena->nextsize = 0;
+}
+
+static struct ArenaChunk *new_chunk(struct Arena *arena, size_t size)
+{
+	struct ArenaChunk *chunk;
 
-	if (!(currbuffer = malloc(size)))
+	if (size > SIZE_MAX - CHUNK_HEADER || !(chunk = malloc(CHUNK_HEADER + size)))
 	{
 		perror(__func__);
 		exit(1);
 	}
-	memset(currbuffer, 0, size);
-	used           = 0;
-	buffers[idx++] = currbuffer;
+	chunk->size = size;
+	chunk->used = 0;
+	chunk->next = arena->head;
+	arena->head = chunk;
+	return chunk;
+}
+
+/* Put the spare chunk back in front of the list if it can hold size */
+static struct ArenaChunk *reuse_spare(struct Arena *arena, size_t size)
+{
+	struct ArenaChunk *chunk = arena->spare;
+
+	if (!chunk || chunk->size < size)
+		return NULL;
+
+	arena->spare = NULL;
+	chunk->used  = 0;
+	chunk->next  = arena->head;
+	arena->head  = chunk;
+	return chunk;
 }
@@ -17,5 +17,30 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
-void *allocate(int size, bool align);
-void  free_all(void);
+struct ArenaChunk;
+
+struct Arena
+{
+	struct ArenaChunk *head;     /* newest chunk            */
+	struct ArenaChunk *current;  /* chunk we allocate from  */
+	struct ArenaChunk *spare;    /* kept by arena_reset()   */
+	size_t             nextsize; /* size of the next chunk  */
+};
+
+struct ArenaMark
+{
+	struct ArenaChunk *head;
+	struct ArenaChunk *current;
+	size_t             used;
+	size_t             nextsize;
+};
+
+#define ARENA_ALIGN 0x01
+#define ARENA_ZERO  0x02
+
+void            *arena_alloc(struct Arena *arena, size_t size, unsigned flags);
+char            *arena_strdup(struct Arena *arena, const char *str);
+char            *arena_strndup(struct Arena *arena, const char *str, size_t len);
+struct ArenaMark arena_mark(const struct Arena *arena);
+void             arena_reset(struct Arena *arena, const struct ArenaMark *mark);
+void             arena_free(struct Arena *arena);
@@ -0,0 +1,306 @@
+/* bmplibtest - bufpool.c
+ *
+ * Copyright (c) 2025, Rupert Weber.
+ *
+ * This file is part of bmplibtest.
+ * bmplibtest is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <bmplib.h>
+
+#include "imgstack.h"
+#include "bufpool.h"
+
+/* Buffer pool
+ *
+ * Every test starts by clearing the image stack, and the next test
+ * usually allocates buffers of the same sizes again. Instead of going
+ * back to the system each time, released buffers are kept on free
+ * lists by size class and handed out again.
+ *
+ * Size classes: everything up to 4 KiB is one class, above that there
+ * are four classes per power of two (5K, 6K, 7K, 8K, 10K, 12K, ...),
+ * so at most 25% of a buffer is wasted.
+ *
+ * Each buffer is preceded by a header of IMG_ROW_ALIGN bytes, which
+ * keeps the buffer itself aligned. Buffers of HUGE_THRESHOLD and
+ * larger are mmap'ed and, where available, marked for transparent
+ * huge pages. For those, the buffer starts on a HUGE_PAGE boundary and
+ * the header sits at the end of the (normal) page before it, so the
+ * header doesn't shift the buffer off the huge pages.
+ *
+ * The pool never caches more than POOL_MAX_CACHED bytes. On top of
+ * that, bufpool_trim() (called between tests) releases cached buffers
+ * beyond the high-water mark of the previous test, so one huge test
+ * doesn't keep its memory for the rest of the run.
+ */
+
+#define POOL_MIN_SHIFT  12
+#define POOL_MIN_SIZE   ((size_t)1 << POOL_MIN_SHIFT)
+#define POOL_NCLASSES   ((64 - POOL_MIN_SHIFT) * 4 + 1)
+#define POOL_MAX_CACHED ((size_t)256 << 20)
+#define HUGE_PAGE       ((size_t)2 << 20)
+#define HUGE_THRESHOLD  HUGE_PAGE
+#define HEADER_SIZE     IMG_ROW_ALIGN
+
+#ifndef MAP_ANONYMOUS
+	#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+struct PoolBlock
+{
+	struct PoolBlock *next;
+	size_t            size; /* class size, without header */
+	int               cls;
+	bool              mapped;
+};
+
+_Static_assert(sizeof(struct PoolBlock) <= HEADER_SIZE, "pool header too large");
+
+static struct PoolBlock   *freelist[POOL_NCLASSES];
+static struct BufpoolStats stats;
+static size_t              trim_mark; /* high-water mark since last trim */
+
+static int               size_class(size_t size, size_t *classsize);
+static struct PoolBlock *huge_alloc(size_t size);
+static void              block_release(struct PoolBlock *blk);
+static size_t            page_size(void);
+
+/********************************************************
+ * 	bufpool_alloc
+ *
+ * 	Returns an IMG_ROW_ALIGN aligned, uninitialized
+ * 	buffer of at least size bytes, which must be
+ * 	released with bufpool_release().
+ *******************************************************/
+
+void *bufpool_alloc(size_t size)
+{
+	struct PoolBlock *blk;
+	size_t            classsize;
+	int               cls;
+
+	if (-1 == (cls = size_class(size, &classsize)))
+		return NULL;
+
+	stats.allocs++;
+
+	if ((blk = freelist[cls]))
+	{
+		freelist[cls] = blk->next;
+		stats.cached -= classsize;
+		stats.reused++;
+	}
+	else if (classsize >= HUGE_THRESHOLD)
+	{
+		if (!(blk = huge_alloc(classsize)))
+			return NULL;
+	}
+	else
+	{
+		if (!(blk = aligned_alloc(HEADER_SIZE, classsize + HEADER_SIZE)))
+			return NULL;
+		blk->mapped = false;
+	}
+
+	blk->next = NULL;
+	blk->size = classsize;
+	blk->cls  = cls;
+
+	stats.inuse += classsize;
+	if (stats.inuse > stats.peak)
+		stats.peak = stats.inuse;
+	if (stats.inuse > trim_mark)
+		trim_mark = stats.inuse;
+
+	return (unsigned char *)blk + HEADER_SIZE;
+}
+
+/********************************************************
+ * 	bufpool_release
+ *
+ * 	Give a buffer back to the pool. NULL is ignored.
+ *******************************************************/
+
+void bufpool_release(void *buf)
+{
+	struct PoolBlock *blk;
+
+	if (!buf)
+		return;
+
+	blk = (struct PoolBlock *)((unsigned char *)buf - HEADER_SIZE);
+	stats.inuse -= blk->size;
+
+	if (stats.cached + blk->size > POOL_MAX_CACHED)
+	{
+		block_release(blk);
+		return;
+	}
+
+	blk->next          = freelist[blk->cls];
+	freelist[blk->cls] = blk;
+	stats.cached += blk->size;
+}
+
+/********************************************************
+ * 	bufpool_trim
+ *
+ * 	Release cached buffers, largest first, until
+ * 	no more than the high-water mark since the last
+ * 	trim is cached.
+ *******************************************************/
+
+void bufpool_trim(void)
+{
+	struct PoolBlock *blk;
+
+	for (int cls = POOL_NCLASSES - 1; cls >= 0 && stats.cached > trim_mark; cls--)
+	{
+		while ((blk = freelist[cls]) && stats.cached > trim_mark)
+		{
+			freelist[cls] = blk->next;
+			stats.cached -= blk->size;
+			block_release(blk);
+		}
+	}
+	trim_mark = stats.inuse;
+}
+
+/********************************************************
+ * 	bufpool_destroy
+ *
+ * 	Release all cached buffers. Buffers still in use
+ * 	remain valid.
+ *******************************************************/
+
+void bufpool_destroy(void)
+{
+	struct PoolBlock *blk;
+
+	for (int cls = 0; cls < POOL_NCLASSES; cls++)
+	{
+		while ((blk = freelist[cls]))
+		{
+			freelist[cls] = blk->next;
+			block_release(blk);
+		}
+	}
+	stats.cached = 0;
+	trim_mark    = stats.inuse;
+}
+
+/********************************************************
+ * 	bufpool_get_stats
+ *******************************************************/
+
+void bufpool_get_stats(struct BufpoolStats *s)
+{
+	*s = stats;
+}
+
+/* Map one page plus size bytes, with the buffer (i.e. the end of that
+ * first page) on a huge page boundary. The mapping is made larger by
+ * HUGE_PAGE and the slack on either side unmapped again.
+ */
+
+static struct PoolBlock *huge_alloc(size_t size)
+{
+	struct PoolBlock *blk;
+	size_t            page = page_size();
+	size_t            len  = page + size + HUGE_PAGE;
+	unsigned char    *map, *buf, *end;
+
+	map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	buf = (unsigned char *)(((uintptr_t)map + page + HUGE_PAGE - 1) &
+	                       ~(uintptr_t)(HUGE_PAGE - 1));
+	end = buf + ((size + page - 1) & ~(page - 1));
+	if (buf - page > map)
+		munmap(map, (size_t)(buf - page - map));
+	if (map + len > end)
+		munmap(end, (size_t)(map + len - end));
+#ifdef MADV_HUGEPAGE
+	madvise(buf, size, MADV_HUGEPAGE);
+#endif
+	blk         = (struct PoolBlock *)(buf - HEADER_SIZE);
+	blk->mapped = true;
+	return blk;
+}
+
+static void block_release(struct PoolBlock *blk)
+{
+	size_t page;
+
+	if (blk->mapped)
+	{
+		page = page_size();
+		munmap((unsigned char *)blk + HEADER_SIZE - page,
+		       page + ((blk->size + page - 1) & ~(page - 1)));
+	}
+	else
+		free(blk);
+}
+
+static size_t page_size(void)
+{
+	static size_t page;
+
+	if (!page)
+	{
+		long ps = sysconf(_SC_PAGESIZE);
+
+		page = ps > 0 ? (size_t)ps : 4096;
+	}
+	return page;
+}
+
+/* returns the class index and sets classsize to the
+ * actual buffer size for that class, or returns -1
+ * if size is too large.
+ */
+
+static int size_class(size_t size, size_t *classsize)
+{
+	size_t step;
+	int    shift = POOL_MIN_SHIFT;
+
+	if (size <= POOL_MIN_SIZE)
+	{
+		*classsize = POOL_MIN_SIZE;
+		return 0;
+	}
+	if (size > SIZE_MAX / 2)
+		return -1;
+
+	/* 2^shift < size <= 2^(shift+1) */
+	while ((size - 1) >> (shift + 1))
+		shift++;
+
+	step       = (size_t)1 << (shift - 2);
+	*classsize = (size + step - 1) & ~(step - 1);
+
+	return (shift - POOL_MIN_SHIFT) * 4 + (int)((*classsize >> (shift - 2)) - 4);
+}
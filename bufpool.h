@@ -0,0 +1,33 @@
+/* bmplibtest - bufpool.h
+ *
+ * Copyright (c) 2025, Rupert Weber.
+ *
+ * This file is part of bmplibtest.
+ * bmplibtest is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+struct BufpoolStats
+{
+	uint64_t allocs; /* number of bufpool_alloc() calls */
+	uint64_t reused; /* ... served from the pool        */
+	size_t   inuse;  /* bytes currently handed out      */
+	size_t   cached; /* bytes kept for reuse            */
+	size_t   peak;   /* max. of inuse                   */
+};
+
+void *bufpool_alloc(size_t size);
+void  bufpool_release(void *buf);
+void  bufpool_trim(void);
+void  bufpool_destroy(void);
+void  bufpool_get_stats(struct BufpoolStats *s);
@@ -0,0 +1,291 @@
+/* bmplibtest - channels.c
+ *
+ * Copyright (c) 2025, Rupert Weber.
+ *
+ * This file is part of bmplibtest.
+ * bmplibtest is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <bmplib.h>
+
+#include "defs.h"
+#include "imgstack.h"
+#include "channels.h"
+
+/* Channel maps
+ *
+ * A map is a string of 1 to 4 characters, one per output channel:
+ *   r, g, b, a  source channel. For gray (+alpha) images, r, g, and b
+ *               all refer to the gray channel ('y' is accepted, too).
+ *   0, 1        constant 0 or 1.0 (max. value for int images)
+ * e.g. "rgb1" adds an opaque alpha channel, "rgb" drops alpha, "bgra"
+ * swaps red and blue, "ggg1" expands gray to RGBA.
+ *
+ * channel_spec_parse() only checks the syntax, so maps can be parsed
+ * before the image is known. channel_map_resolve() turns the letters into
+ * source channels of the actual image.
+ */
+
+bool channel_spec_parse(const char *str, struct ChannelSpec *spec)
+{
+	int n = (int)strlen(str);
+
+	memset(spec, 0, sizeof *spec);
+
+	if (n < 1 || n > 4 || strspn(str, "rgbya01") != (size_t)n)
+		return false;
+
+	memcpy(spec->src, str, n);
+	spec->channels = n;
+	return true;
+}
+
+bool channel_map_resolve(const struct ChannelSpec *spec, int inchannels, struct ChannelMap *map)
+{
+	bool gray  = inchannels < 3;
+	bool alpha = inchannels == 2 || inchannels == 4;
+
+	memset(map, 0, sizeof *map);
+
+	for (int c = 0; c < spec->channels; c++)
+	{
+		switch (spec->src[c])
+		{
+		case 'r':
+			map->src[c] = 0;
+			break;
+		case 'g':
+			map->src[c] = gray ? 0 : 1;
+			break;
+		case 'b':
+			map->src[c] = gray ? 0 : 2;
+			break;
+		case 'y':
+			if (!gray)
+			{
+				printf("channels: 'y' only applies to gray images\n");
+				return false;
+			}
+			map->src[c] = 0;
+			break;
+		case 'a':
+			if (!alpha)
+			{
+				printf("channels: image has no alpha channel\n");
+				return false;
+			}
+			map->src[c] = inchannels - 1;
+			break;
+		case '0':
+			map->src[c] = CHANNEL_ZERO;
+			break;
+		case '1':
+			map->src[c] = CHANNEL_ONE;
+			break;
+		default:
+			printf("channels: invalid channel '%c'\n", spec->src[c]);
+			return false;
+		}
+	}
+	map->channels = spec->channels;
+	return true;
+}
+
+/* Remap kernels
+ *
+ * One kernel per sample size, working on bit patterns only (the value of
+ * 'one' is supplied by the caller according to the number format). Each
+ * pixel is read into a small table which also holds the two constants,
+ * so an output channel is a plain table lookup without any branching.
+ * Each call remaps one run of pixels from src to dst, which may be the
+ * same memory: when the pixels grow, they are processed back to front,
+ * otherwise front to back, so the remap can be done in place.
+ *
+ * remap_pixels() instantiates the kernels with the common channel counts
+ * as literals, so the compiler can fully unroll the per-pixel loops into
+ * fixed shuffles.
+ */
+
+#define DEFINE_REMAP_KERNEL(name, type)                                               \
+	static inline void name(void *dstbuf, const void *srcbuf, size_t npixels,    \
+	                        int inch, int outch, const int *src, type one)        \
+	{                                                                             \
+		const type *in  = srcbuf;                                             \
+		type       *out = dstbuf;                                             \
+		type        px[6];                                                    \
+		size_t      p;                                                        \
+                                                                                      \
+		px[CHANNEL_ZERO] = 0;                                                 \
+		px[CHANNEL_ONE]  = one;                                               \
+                                                                                      \
+		if (outch > inch)                                                     \
+		{                                                                     \
+			for (p = npixels; p > 0; p--)                                 \
+			{                                                             \
+				for (int c = 0; c < inch; c++)                        \
+					px[c] = in[(p - 1) * inch + c];               \
+				for (int c = 0; c < outch; c++)                       \
+					out[(p - 1) * outch + c] = px[src[c]];        \
+			}                                                             \
+		}                                                                     \
+		else                                                                  \
+		{                                                                     \
+			for (p = 0; p < npixels; p++)                                 \
+			{                                                             \
+				for (int c = 0; c < inch; c++)                        \
+					px[c] = in[p * inch + c];                     \
+				for (int c = 0; c < outch; c++)                       \
+					out[p * outch + c] = px[src[c]];              \
+			}                                                             \
+		}                                                                     \
+	}
+
+DEFINE_REMAP_KERNEL(remap_8, uint8_t)
+DEFINE_REMAP_KERNEL(remap_16, uint16_t)
+DEFINE_REMAP_KERNEL(remap_32, uint32_t)
+
+static void remap_pixels(void *dstbuf, const void *srcbuf, size_t npixels, int bytes,
+                         int inch, int outch, const int *src, uint32_t one)
+{
+#define REMAP_CASE(i, o)                                                                     \
+	if (inch == (i) && outch == (o))                                                     \
+	{                                                                                    \
+		switch (bytes)                                                               \
+		{                                                                            \
+		case 1: remap_8(dstbuf, srcbuf, npixels, i, o, src, (uint8_t)one); return;   \
+		case 2: remap_16(dstbuf, srcbuf, npixels, i, o, src, (uint16_t)one); return; \
+		case 4: remap_32(dstbuf, srcbuf, npixels, i, o, src, one); return;           \
+		}                                                                            \
+	}
+
+	REMAP_CASE(3, 4)
+	REMAP_CASE(4, 3)
+	REMAP_CASE(3, 3)
+	REMAP_CASE(4, 4)
+	REMAP_CASE(1, 3)
+	REMAP_CASE(1, 4)
+#undef REMAP_CASE
+
+	switch (bytes)
+	{
+	case 1: remap_8(dstbuf, srcbuf, npixels, inch, outch, src, (uint8_t)one); return;
+	case 2: remap_16(dstbuf, srcbuf, npixels, inch, outch, src, (uint16_t)one); return;
+	case 4: remap_32(dstbuf, srcbuf, npixels, inch, outch, src, one); return;
+	}
+	printf("channels: invalid sample size %d\n", bytes);
+	exit(1);
+}
+
+static uint32_t one_value(const struct Image *img)
+{
+	float    f = 1.0f;
+	uint32_t u;
+
+	switch (img->format)
+	{
+	case BMP_FORMAT_FLOAT:
+		memcpy(&u, &f, sizeof u);
+		return u;
+
+	case BMP_FORMAT_S2_13:
+		return 8192;
+
+	default:
+		switch (img->bitsperchannel)
+		{
+		case 8 : return 0xffU;
+		case 16: return 0xffffU;
+		default: return 0xffffffffUL;
+		}
+	}
+}
+
+/********************************************************
+ * 	channel_map_apply
+ *
+ * 	Remap the channels of an image in place. If
+ * 	the pixels grow, the buffer is grown to aligned
+ * 	rows first and the rows are remapped back to
+ * 	front. Otherwise, the stride is kept.
+ *******************************************************/
+
+bool channel_map_apply(struct Image *img, const struct ChannelMap *map)
+{
+	int      bytes = img->bitsperchannel / 8;
+	uint32_t one   = one_value(img);
+
+	if (img->palette)
+	{
+		printf("channels: can't remap indexed image\n");
+		return false;
+	}
+
+	switch (img->bitsperchannel)
+	{
+	case 8:
+	case 16:
+	case 32:
+		break;
+	default:
+		printf("channels: invalid bitsperchannel %d\n", img->bitsperchannel);
+		return false;
+	}
+
+	if (!img_make_writable(img))
+		return false;
+
+	if (map->channels > img->channels)
+	{
+		size_t oldstride = img->stride;
+		size_t newstride = MAX(oldstride, img_aligned_stride(img->width, map->channels,
+		                                                     img->bitsperchannel));
+
+		if (!img_resize_buffer(img, newstride * img->height))
+		{
+			perror("channels");
+			return false;
+		}
+		for (size_t y = img->height; y > 0; y--)
+		{
+			remap_pixels(img->buffer + (y - 1) * newstride,
+			             img->buffer + (y - 1) * oldstride, img->width, bytes,
+			             img->channels, map->channels, map->src, one);
+		}
+		img->stride = newstride;
+	}
+	else if (img->stride == img_rowbytes(img))
+	{
+		remap_pixels(img->buffer, img->buffer, (size_t)img->width * img->height, bytes,
+		             img->channels, map->channels, map->src, one);
+		img->stride = (size_t)img->width * map->channels * bytes;
+	}
+	else
+	{
+		for (int y = 0; y < img->height; y++)
+		{
+			unsigned char *row = img->buffer + (size_t)y * img->stride;
+
+			remap_pixels(row, row, img->width, bytes, img->channels, map->channels,
+			             map->src, one);
+		}
+	}
+	img->channels = map->channels;
+	return true;
+}
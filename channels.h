@@ -0,0 +1,37 @@
+/* bmplibtest - channels.h
+ *
+ * Copyright (c) 2025, Rupert Weber.
+ *
+ * This file is part of bmplibtest.
+ * bmplibtest is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define CHANNEL_ZERO 4 /* constant 0 */
+#define CHANNEL_ONE  5 /* constant 1.0 (max. value for int) */
+
+struct ChannelSpec
+{
+	int  channels; /* number of output channels */
+	char src[4];   /* 'r', 'g', 'b', 'y', 'a', '0' or '1' */
+};
+
+struct ChannelMap
+{
+	int channels; /* number of output channels */
+	int src[4];   /* source channel (0..3) or CHANNEL_ZERO/CHANNEL_ONE */
+};
+
+bool channel_spec_parse(const char *str, struct ChannelSpec *spec);
+bool channel_map_resolve(const struct ChannelSpec *spec, int inchannels, struct ChannelMap *map);
+bool channel_map_apply(struct Image *img, const struct ChannelMap *map);
@@ -0,0 +1,1347 @@
+/* bmplibtest - compare.c
+ *
+ * Copyright (c) 2025, Rupert Weber.
+ *
+ * This file is part of bmplibtest.
+ * bmplibtest is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <math.h>
+
+#include <bmplib.h>
+
+#include "defs.h"
+#include "imgstack.h"
+#include "compare.h"
+
+/* Row kernels
+ *
+ * One kernel per sample type. The loops are kept free of any per-sample
+ * branching (the abs-diff is a compare/select, the mismatch count is a
+ * plain add of the comparison result), so the compiler can vectorize them.
+ * Accumulators are kept in local arrays and only added to the stats struct
+ * once per row. Errors are accumulated in the sample type's raw units and
+ * scaled once at the end (see struct SampleType).
+ */
+
+typedef uint64_t (*row_kernel)(const unsigned char *row0, const unsigned char *row1,
+                               int width, int channels,
+                               const struct CompareTolerance *tol,
+                               struct CompareStats *stats, float *diff);
+
+#define DEFINE_ROW_KERNEL_INT(name, type, sqtype)                                     \
+	static uint64_t name(const unsigned char *row0, const unsigned char *row1,    \
+	                     int width, int channels,                                 \
+	                     const struct CompareTolerance *tol,                      \
+	                     struct CompareStats *stats, float *diff)                 \
+	{                                                                             \
+		const type *a       = (const type *)row0;                                 \
+		const type *b       = (const type *)row1;                                 \
+		uint64_t    fuzz    = tol->fuzz;                                          \
+		uint64_t    mism[4] = { 0 }, sum[4] = { 0 }, max[4] = { 0 };              \
+		sqtype      sumsq[4] = { 0 };                                             \
+		uint64_t    total    = 0;                                                 \
+                                                                                      \
+		for (int x = 0; x < width; x++)                                           \
+		{                                                                         \
+			for (int c = 0; c < channels; c++)                                \
+			{                                                                 \
+				size_t   i = (size_t)x * channels + c;                    \
+				uint64_t d = a[i] > b[i] ? (uint64_t)(a[i] - b[i])        \
+				                         : (uint64_t)(b[i] - a[i]);       \
+				sum[c]    += d;                                           \
+				sumsq[c]  += (sqtype)d * d;                               \
+				max[c]     = d > max[c] ? d : max[c];                     \
+				mism[c]   += d > fuzz;                                    \
+				if (diff)                                                 \
+					diff[i] = (float)d;                               \
+			}                                                                 \
+		}                                                                         \
+                                                                                      \
+		for (int c = 0; c < channels; c++)                                        \
+		{                                                                         \
+			stats->chan[c].mismatches += mism[c];                             \
+			stats->chan[c].sumerr     += (double)sum[c];                      \
+			stats->chan[c].sumsqerr   += (double)sumsq[c];                    \
+			stats->chan[c].maxerr = MAX(stats->chan[c].maxerr, (double)max[c]); \
+			total += mism[c];                                                 \
+		}                                                                         \
+		return total;                                                             \
+	}
+
+DEFINE_ROW_KERNEL_INT(row_kernel_8, uint8_t, uint64_t)
+DEFINE_ROW_KERNEL_INT(row_kernel_16, uint16_t, uint64_t)
+DEFINE_ROW_KERNEL_INT(row_kernel_32, uint32_t, double)
+
+/* s2.13: signed distance in raw 1/8192 steps. fuzz is in raw steps,
+ * epsilon and relative epsilon are in real values. Both are converted
+ * once per row by s2_13_tolerance(), sample_mismatch() uses the same
+ * s2_13_match() as the row kernel.
+ */
+struct S2_13Tolerance
+{
+	int32_t fuzz;
+	int32_t eps;
+	float   rel;
+};
+
+static inline struct S2_13Tolerance s2_13_tolerance(const struct CompareTolerance *tol)
+{
+	return (struct S2_13Tolerance){ .fuzz = (int32_t)MIN(tol->fuzz, 0xffffU),
+		                        .eps  = (int32_t)MIN(tol->epsilon * 8192.0, 65536.0),
+		                        .rel  = (float)tol->relative };
+}
+
+static inline bool s2_13_match(int32_t a, int32_t b, const struct S2_13Tolerance *t)
+{
+	int32_t d  = a > b ? a - b : b - a;
+	int32_t aa = a < 0 ? -a : a;
+	int32_t ab = b < 0 ? -b : b;
+
+	return d <= t->fuzz || d <= t->eps || d <= t->rel * (float)MAX(aa, ab);
+}
+
+static uint64_t row_kernel_s2_13(const unsigned char *row0, const unsigned char *row1,
+                                 int width, int channels,
+                                 const struct CompareTolerance *tol,
+                                 struct CompareStats *stats, float *diff)
+{
+	const int16_t        *a       = (const int16_t *)row0;
+	const int16_t        *b       = (const int16_t *)row1;
+	struct S2_13Tolerance t       = s2_13_tolerance(tol);
+	uint64_t              mism[4] = { 0 }, sum[4] = { 0 }, sumsq[4] = { 0 };
+	int32_t        max[4]  = { 0 };
+	uint64_t       total   = 0;
+
+	for (int x = 0; x < width; x++)
+	{
+		for (int c = 0; c < channels; c++)
+		{
+			size_t  i   = (size_t)x * channels + c;
+			int32_t d   = a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+			sum[c]     += d;
+			sumsq[c]   += (uint64_t)d * d;
+			max[c]      = d > max[c] ? d : max[c];
+			mism[c]    += !s2_13_match(a[i], b[i], &t);
+			if (diff)
+				diff[i] = (float)d;
+		}
+	}
+
+	for (int c = 0; c < channels; c++)
+	{
+		stats->chan[c].mismatches += mism[c];
+		stats->chan[c].sumerr     += (double)sum[c];
+		stats->chan[c].sumsqerr   += (double)sumsq[c];
+		stats->chan[c].maxerr      = MAX(stats->chan[c].maxerr, (double)max[c]);
+		total                     += mism[c];
+	}
+	return total;
+}
+
+/* float: distance in ULPs. The bit patterns are mapped onto a monotonic
+ * integer scale, so -0.0 and 0.0 are identical and neighbouring floats are
+ * always 1 apart, regardless of exponent. Two NaNs are considered equal
+ * (whatever their payload), a NaN and a non-NaN are always a mismatch but
+ * don't contribute to the error sums.
+ */
+static inline int64_t float_ordered(uint32_t u)
+{
+	return (u & 0x80000000UL) ? -(int64_t)(u & 0x7fffffffUL) : (int64_t)u;
+}
+
+static uint64_t float_ulps(float a, float b)
+{
+	uint32_t ua, ub;
+	int64_t  d;
+
+	memcpy(&ua, &a, sizeof ua);
+	memcpy(&ub, &b, sizeof ub);
+	d = float_ordered(ua) - float_ordered(ub);
+	return d < 0 ? (uint64_t)-d : (uint64_t)d;
+}
+
+static bool float_match(float a, float b, const struct CompareTolerance *tol)
+{
+	bool   nana = a != a, nanb = b != b;
+	double d    = fabs((double)a - (double)b);
+
+	if (nana || nanb)
+		return nana && nanb;
+
+	return float_ulps(a, b) <= tol->fuzz || d <= tol->epsilon ||
+	       d <= tol->relative * MAX(fabs((double)a), fabs((double)b));
+}
+
+static uint64_t row_kernel_float(const unsigned char *row0, const unsigned char *row1,
+                                 int width, int channels,
+                                 const struct CompareTolerance *tol,
+                                 struct CompareStats *stats, float *diff)
+{
+	const float *a       = (const float *)row0;
+	const float *b       = (const float *)row1;
+	uint64_t     mism[4] = { 0 };
+	double       sum[4] = { 0 }, sumsq[4] = { 0 }, max[4] = { 0 };
+	uint64_t     total = 0;
+
+	for (int x = 0; x < width; x++)
+	{
+		for (int c = 0; c < channels; c++)
+		{
+			size_t i    = (size_t)x * channels + c;
+			bool   nan  = a[i] != a[i] || b[i] != b[i];
+			double d    = nan ? 0.0 : fabs((double)a[i] - (double)b[i]);
+			sum[c]     += d;
+			sumsq[c]   += d * d;
+			max[c]      = d > max[c] ? d : max[c];
+			mism[c]    += !float_match(a[i], b[i], tol);
+			if (diff)
+				diff[i] = nan ? INFINITY : (float)d;
+		}
+	}
+
+	for (int c = 0; c < channels; c++)
+	{
+		stats->chan[c].mismatches += mism[c];
+		stats->chan[c].sumerr     += sum[c];
+		stats->chan[c].sumsqerr   += sumsq[c];
+		stats->chan[c].maxerr      = MAX(stats->chan[c].maxerr, max[c]);
+		total                     += mism[c];
+	}
+	return total;
+}
+
+/* The following helpers look at individual samples. They are only
+ * used on rows which are already known to contain a mismatch.
+ */
+
+static double sample_value(const unsigned char *row, size_t i, BMPFORMAT format, int bits)
+{
+	switch (format)
+	{
+	case BMP_FORMAT_FLOAT: return ((const float *)row)[i];
+	case BMP_FORMAT_S2_13: return ((const int16_t *)row)[i] / 8192.0;
+	default:
+		switch (bits)
+		{
+		case 8 : return ((const uint8_t *)row)[i];
+		case 16: return ((const uint16_t *)row)[i];
+		default: return ((const uint32_t *)row)[i];
+		}
+	}
+}
+
+static bool sample_mismatch(const unsigned char *row0, const unsigned char *row1,
+                            size_t i, BMPFORMAT format, int bits,
+                            const struct CompareTolerance *tol)
+{
+	struct S2_13Tolerance t;
+	double                a, b;
+
+	switch (format)
+	{
+	case BMP_FORMAT_FLOAT:
+		return !float_match(((const float *)row0)[i], ((const float *)row1)[i], tol);
+
+	case BMP_FORMAT_S2_13:
+		t = s2_13_tolerance(tol);
+		return !s2_13_match(((const int16_t *)row0)[i], ((const int16_t *)row1)[i], &t);
+
+	default:
+		a = sample_value(row0, i, format, bits);
+		b = sample_value(row1, i, format, bits);
+		return fabs(a - b) > (double)tol->fuzz;
+	}
+}
+
+/* Everything the row loops need to know about a sample type */
+
+struct SampleType
+{
+	row_kernel kernel;
+	double     unit; /* scale from accumulated raw errors to reported errors */
+	double     peak; /* max. nominal value for PSNR */
+};
+
+static void sample_type(BMPFORMAT format, int bits, struct SampleType *type)
+{
+	switch (format)
+	{
+	case BMP_FORMAT_FLOAT:
+		type->kernel = row_kernel_float;
+		type->unit   = 1.0;
+		type->peak   = 1.0;
+		return;
+
+	case BMP_FORMAT_S2_13:
+		type->kernel = row_kernel_s2_13;
+		type->unit   = 1.0 / 8192.0;
+		type->peak   = 1.0;
+		return;
+
+	case BMP_FORMAT_INT:
+		type->unit = 1.0;
+		switch (bits)
+		{
+		case 8 : type->kernel = row_kernel_8; type->peak = 0xffU; return;
+		case 16: type->kernel = row_kernel_16; type->peak = 0xffffU; return;
+		case 32: type->kernel = row_kernel_32; type->peak = 0xffffffffUL; return;
+		}
+		break;
+	}
+	printf("compare: invalid format/bitsperchannel (%d/%d)\n", (int)format, bits);
+	exit(1);
+}
+
+/* Cross-format comparisons
+ *
+ * If the two images differ in number format or bit depth, they are
+ * compared in a common format: the int format with the lower bit depth if
+ * either image is int, otherwise float. Both images are streamed through a
+ * small per-tile scratch buffer, converted with the same math as
+ * convertformat{}, so no full-size intermediate images are needed.
+ */
+
+#define TILE_PIXELS 1024
+
+static void load_tile(const unsigned char *src, BMPFORMAT format, int bits,
+                      double *dst, size_t n)
+{
+	switch (format)
+	{
+	case BMP_FORMAT_FLOAT:
+		for (size_t i = 0; i < n; i++)
+			dst[i] = ((const float *)src)[i];
+		return;
+
+	case BMP_FORMAT_S2_13:
+		for (size_t i = 0; i < n; i++)
+			dst[i] = ((const int16_t *)src)[i] / 8192.0;
+		return;
+
+	case BMP_FORMAT_INT:
+		switch (bits)
+		{
+		case 8:
+			for (size_t i = 0; i < n; i++)
+				dst[i] = ((const uint8_t *)src)[i] / (double)0xffU;
+			return;
+
+		case 16:
+			for (size_t i = 0; i < n; i++)
+				dst[i] = ((const uint16_t *)src)[i] / (double)0xffffU;
+			return;
+
+		case 32:
+			for (size_t i = 0; i < n; i++)
+				dst[i] = ((const uint32_t *)src)[i] / (double)0xffffffffUL;
+			return;
+		}
+		break;
+	}
+	printf("compare: invalid format/bitsperchannel (%d/%d)\n", (int)format, bits);
+	exit(1);
+}
+
+static inline double clamp01(double d)
+{
+	return d < 0.0 ? 0.0 : (d > 1.0 ? 1.0 : d);
+}
+
+static void store_tile(const double *src, unsigned char *dst, BMPFORMAT format, int bits,
+                       size_t n)
+{
+	switch (format)
+	{
+	case BMP_FORMAT_FLOAT:
+		for (size_t i = 0; i < n; i++)
+			((float *)dst)[i] = (float)src[i];
+		return;
+
+	case BMP_FORMAT_INT:
+		switch (bits)
+		{
+		case 8:
+			for (size_t i = 0; i < n; i++)
+				((uint8_t *)dst)[i] = (uint8_t)(clamp01(src[i]) * 0xffU + 0.5);
+			return;
+
+		case 16:
+			for (size_t i = 0; i < n; i++)
+				((uint16_t *)dst)[i] = (uint16_t)(clamp01(src[i]) * 0xffffU + 0.5);
+			return;
+
+		case 32:
+			for (size_t i = 0; i < n; i++)
+				((uint32_t *)dst)[i] =
+				        (uint32_t)(clamp01(src[i]) * (double)0xffffffffUL + 0.5);
+			return;
+		}
+		break;
+
+	default:
+		break;
+	}
+	printf("compare: invalid target format/bitsperchannel (%d/%d)\n", (int)format, bits);
+	exit(1);
+}
+
+/* Row/tile iteration, shared by all compare modes */
+
+struct RowCtx
+{
+	const struct Image            *img0;
+	const struct Image            *img1;
+	const struct CompareTolerance *tol;
+	BMPFORMAT                      format; /* format/bits the comparison is done in */
+	int                            bits;
+	int                            tile; /* pixels per tile */
+	bool                           convert0, convert1;
+	unsigned char                 *scratch0, *scratch1;
+	double                        *dtile;
+	float                         *difftile; /* only for diff image */
+	unsigned char                 *heatrow;
+};
+
+static bool init_rowctx(struct RowCtx *ctx, const struct Image *img0,
+                        const struct Image *img1, const struct CompareTolerance *tol,
+                        bool diffimage)
+{
+	memset(ctx, 0, sizeof *ctx);
+	ctx->img0 = img0;
+	ctx->img1 = img1;
+	ctx->tol  = tol;
+
+	compare_common_format(img0, img1, &ctx->format, &ctx->bits);
+
+	ctx->convert0 = img0->format != ctx->format || img0->bitsperchannel != ctx->bits;
+	ctx->convert1 = img1->format != ctx->format || img1->bitsperchannel != ctx->bits;
+
+	if (!(ctx->convert0 || ctx->convert1))
+		ctx->tile = img0->width;
+	else
+		ctx->tile = MIN(img0->width, TILE_PIXELS);
+
+	size_t tilesamples = (size_t)ctx->tile * img0->channels;
+
+	if (ctx->convert0 || ctx->convert1)
+	{
+		ctx->scratch0 = malloc(tilesamples * ctx->bits / 8);
+		ctx->scratch1 = malloc(tilesamples * ctx->bits / 8);
+		ctx->dtile    = malloc(tilesamples * sizeof *ctx->dtile);
+		if (!(ctx->scratch0 && ctx->scratch1 && ctx->dtile))
+		{
+			perror("compare: scratch buffers");
+			return false;
+		}
+	}
+
+	if (diffimage)
+	{
+		ctx->difftile = malloc(tilesamples * sizeof *ctx->difftile);
+		ctx->heatrow  = malloc((size_t)img0->width * 3);
+		if (!(ctx->difftile && ctx->heatrow))
+		{
+			perror("compare: diff image buffers");
+			return false;
+		}
+	}
+	return true;
+}
+
+static void free_rowctx(struct RowCtx *ctx)
+{
+	free(ctx->scratch0);
+	free(ctx->scratch1);
+	free(ctx->dtile);
+	free(ctx->difftile);
+	free(ctx->heatrow);
+}
+
+static const unsigned char *get_tile_(const struct RowCtx *ctx, const struct Image *img,
+                                      bool convert, unsigned char *scratch, int x, int y,
+                                      int npx)
+{
+	const unsigned char *src;
+	size_t               n = (size_t)npx * img->channels;
+
+	src = img->buffer + (size_t)y * img->stride +
+	      (size_t)x * img->channels * img->bitsperchannel / 8;
+	if (!convert)
+		return src;
+
+	load_tile(src, img->format, img->bitsperchannel, ctx->dtile, n);
+	store_tile(ctx->dtile, scratch, ctx->format, ctx->bits, n);
+	return scratch;
+}
+
+static void get_tile(const struct RowCtx *ctx, int x, int y, int npx,
+                     const unsigned char **tile0, const unsigned char **tile1)
+{
+	*tile0 = get_tile_(ctx, ctx->img0, ctx->convert0, ctx->scratch0, x, y, npx);
+	*tile1 = get_tile_(ctx, ctx->img1, ctx->convert1, ctx->scratch1, x, y, npx);
+}
+
+static size_t first_mismatch(const struct RowCtx *ctx, const unsigned char *tile0,
+                             const unsigned char *tile1, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+	{
+		if (sample_mismatch(tile0, tile1, i, ctx->format, ctx->bits, ctx->tol))
+			break;
+	}
+	return i;
+}
+
+static size_t last_mismatch(const struct RowCtx *ctx, const unsigned char *tile0,
+                            const unsigned char *tile1, size_t n)
+{
+	size_t i;
+
+	for (i = n; i > 0; i--)
+	{
+		if (sample_mismatch(tile0, tile1, i - 1, ctx->format, ctx->bits, ctx->tol))
+			break;
+	}
+	/* the row kernel found a mismatch, but don't wrap around if this
+	 * ever disagrees with it */
+	return i ? i - 1 : 0;
+}
+
+/********************************************************
+ * 	compare_common_format
+ *
+ * 	Determine the format/bits two images are
+ * 	compared in.
+ *******************************************************/
+
+void compare_common_format(const struct Image *img0, const struct Image *img1,
+                           BMPFORMAT *format, int *bits)
+{
+	if (img0->format == img1->format && img0->bitsperchannel == img1->bitsperchannel)
+	{
+		*format = img0->format;
+		*bits   = img0->bitsperchannel;
+	}
+	else if (img0->format == BMP_FORMAT_INT && img1->format == BMP_FORMAT_INT)
+	{
+		*format = BMP_FORMAT_INT;
+		*bits   = MIN(img0->bitsperchannel, img1->bitsperchannel);
+	}
+	else if (img0->format == BMP_FORMAT_INT)
+	{
+		*format = BMP_FORMAT_INT;
+		*bits   = img0->bitsperchannel;
+	}
+	else if (img1->format == BMP_FORMAT_INT)
+	{
+		*format = BMP_FORMAT_INT;
+		*bits   = img1->bitsperchannel;
+	}
+	else
+	{
+		*format = BMP_FORMAT_FLOAT;
+		*bits   = 32;
+	}
+}
+
+/********************************************************
+ * 	compare_find_mismatch
+ *
+ * 	Returns true if images match (within tolerance),
+ * 	otherwise reports the first mismatching sample.
+ * 	Images must have identical width, height, and
+ * 	number of channels.
+ *******************************************************/
+
+bool compare_find_mismatch(const struct Image *img0, const struct Image *img1,
+                           const struct CompareTolerance *tol)
+{
+	struct CompareStats  dummy;
+	struct SampleType    type;
+	struct RowCtx        ctx;
+	const unsigned char *tile0, *tile1;
+	int                  channels = img0->channels;
+	bool                 match    = true;
+
+	if (!init_rowctx(&ctx, img0, img1, tol, false))
+	{
+		free_rowctx(&ctx);
+		return false;
+	}
+	sample_type(ctx.format, ctx.bits, &type);
+
+	/* contiguous rows: try the whole image at once */
+	if (!(ctx.convert0 || ctx.convert1) && img0->stride == img_rowbytes(img0) &&
+	    img1->stride == img_rowbytes(img1) &&
+	    !memcmp(img0->buffer, img1->buffer, img_rowbytes(img0) * img0->height))
+		goto done;
+
+	for (int y = 0; y < img0->height && match; y++)
+	{
+		for (int x = 0; x < img0->width; x += ctx.tile)
+		{
+			int    npx = MIN(ctx.tile, img0->width - x);
+			size_t n   = (size_t)npx * channels;
+			size_t i;
+
+			get_tile(&ctx, x, y, npx, &tile0, &tile1);
+			if (!memcmp(tile0, tile1, n * ctx.bits / 8))
+				continue;
+
+			memset(&dummy, 0, sizeof dummy);
+			if (!type.kernel(tile0, tile1, npx, channels, tol, &dummy, NULL))
+				continue;
+
+			i = first_mismatch(&ctx, tile0, tile1, n);
+			printf("compare: pixels don't match (%.10g vs %.10g @ %u,%u)\n",
+			       sample_value(tile0, i, ctx.format, ctx.bits),
+			       sample_value(tile1, i, ctx.format, ctx.bits),
+			       (unsigned)(x + i / channels), (unsigned)y);
+			match = false;
+			break;
+		}
+	}
+done:
+	free_rowctx(&ctx);
+	return match;
+}
+
+/* Diff image
+ *
+ * The heat map is built from the per-sample differences the row kernels
+ * write out during the comparison pass. Each pixel's largest normalized
+ * channel difference is amplified and mapped onto a black-red-yellow-white
+ * ramp. Rows are written with bmpwrite_save_line() as soon as they are
+ * complete, bottom row first, so the diff image never exists in memory
+ * as a whole.
+ */
+
+struct DiffWriter
+{
+	FILE     *file;
+	BMPHANDLE h;
+};
+
+static bool diffwriter_open(struct DiffWriter *dw, const char *path, int width, int height)
+{
+	memset(dw, 0, sizeof *dw);
+
+	if (!(dw->file = fopen(path, "wb")))
+	{
+		perror(path);
+		return false;
+	}
+	if (!(dw->h = bmpwrite_new(dw->file)))
+	{
+		printf("compare: couldn't get bmpwrite handle for diff image\n");
+		return false;
+	}
+	if (bmpwrite_set_dimensions(dw->h, width, height, 3, 8))
+	{
+		printf("compare: diff image: %s\n", bmp_errmsg(dw->h));
+		return false;
+	}
+	return true;
+}
+
+static void diffwriter_close(struct DiffWriter *dw)
+{
+	if (dw->h)
+		bmp_free(dw->h);
+	if (dw->file)
+		fclose(dw->file);
+	dw->h    = NULL;
+	dw->file = NULL;
+}
+
+static inline uint8_t heat_channel(float v)
+{
+	return (uint8_t)(v < 0.0f ? 0 : (v > 1.0f ? 255 : v * 255.0f + 0.5f));
+}
+
+static void diff_to_heat(const float *diff, int npx, int channels, float scale,
+                         unsigned char *heat)
+{
+	for (int x = 0; x < npx; x++)
+	{
+		float v = 0.0f;
+
+		for (int c = 0; c < channels; c++)
+			v = MAX(v, diff[(size_t)x * channels + c]);
+
+		v             = 3.0f * MIN(v * scale, 1.0f);
+		heat[3 * x]     = heat_channel(v);
+		heat[3 * x + 1] = heat_channel(v - 1.0f);
+		heat[3 * x + 2] = heat_channel(v - 2.0f);
+	}
+}
+
+/********************************************************
+ * 	compare_stats
+ *
+ * 	Compare the whole image and collect error
+ * 	statistics. Tiles which are bytewise identical
+ * 	are skipped with a memcmp().
+ * 	If diff is given, a difference heat map is
+ * 	written in the same pass.
+ *******************************************************/
+
+bool compare_stats(const struct Image *img0, const struct Image *img1,
+                   const struct CompareTolerance *tol, struct CompareStats *stats,
+                   const struct DiffImage *diff)
+{
+	int                  channels = img0->channels;
+	double               sumerr = 0.0, sumsqerr = 0.0;
+	struct SampleType    type;
+	struct RowCtx        ctx;
+	struct DiffWriter    dw    = { 0 };
+	bool                 ok    = false;
+	float                scale = 0.0f;
+	const unsigned char *tile0, *tile1;
+
+	assert(channels >= 1 && channels <= 4);
+
+	memset(stats, 0, sizeof *stats);
+
+	if (!init_rowctx(&ctx, img0, img1, tol, !!diff))
+		goto abort;
+
+	sample_type(ctx.format, ctx.bits, &type);
+
+	if (diff)
+	{
+		if (!diffwriter_open(&dw, diff->path, img0->width, img0->height))
+			goto abort;
+		scale = (float)(diff->amplify * type.unit / type.peak);
+	}
+
+	stats->channels = channels;
+	stats->samples  = (uint64_t)img0->width * channels * img0->height;
+	stats->xmin     = img0->width;
+	stats->ymin     = img0->height;
+	stats->xmax     = -1;
+	stats->ymax     = -1;
+
+	for (int row = 0; row < img0->height; row++)
+	{
+		/* BMP files are bottom-up, so go backwards if we write a diff image */
+		int y = diff ? img0->height - row - 1 : row;
+
+		for (int x = 0; x < img0->width; x += ctx.tile)
+		{
+			int      npx = MIN(ctx.tile, img0->width - x);
+			size_t   n   = (size_t)npx * channels;
+			uint64_t nmismatch;
+
+			get_tile(&ctx, x, y, npx, &tile0, &tile1);
+			if (!memcmp(tile0, tile1, n * ctx.bits / 8))
+			{
+				if (diff)
+					memset(ctx.heatrow + 3 * (size_t)x, 0, 3 * (size_t)npx);
+				continue;
+			}
+
+			nmismatch = type.kernel(tile0, tile1, npx, channels, tol, stats,
+			                        ctx.difftile);
+			if (diff)
+				diff_to_heat(ctx.difftile, npx, channels, scale,
+				             ctx.heatrow + 3 * (size_t)x);
+
+			if (nmismatch > 0)
+			{
+				int x0 = x + (int)(first_mismatch(&ctx, tile0, tile1, n) / channels);
+				int x1 = x + (int)(last_mismatch(&ctx, tile0, tile1, n) / channels);
+
+				stats->mismatches += nmismatch;
+				stats->xmin        = MIN(stats->xmin, x0);
+				stats->xmax        = MAX(stats->xmax, x1);
+				stats->ymin        = MIN(stats->ymin, y);
+				stats->ymax        = MAX(stats->ymax, y);
+			}
+		}
+
+		if (diff && bmpwrite_save_line(dw.h, ctx.heatrow))
+		{
+			printf("compare: diff image: %s\n", bmp_errmsg(dw.h));
+			goto abort;
+		}
+	}
+
+	for (int c = 0; c < channels; c++)
+	{
+		struct CompareChannel *ch = &stats->chan[c];
+
+		ch->maxerr    *= type.unit;
+		ch->sumerr    *= type.unit;
+		ch->sumsqerr  *= type.unit * type.unit;
+		stats->maxerr  = MAX(stats->maxerr, ch->maxerr);
+		sumerr        += ch->sumerr;
+		sumsqerr      += ch->sumsqerr;
+	}
+
+	if (stats->samples > 0)
+	{
+		stats->meanerr = sumerr / stats->samples;
+		sumsqerr      /= stats->samples;
+	}
+
+	if (sumsqerr > 0.0)
+		stats->psnr = 10.0 * log10(type.peak * type.peak / sumsqerr);
+	else
+		stats->psnr = INFINITY;
+
+	ok = true;
+abort:
+	diffwriter_close(&dw);
+	free_rowctx(&ctx);
+	return ok;
+}
+
+/* Perceptual metrics
+ *
+ * Both metrics work on nominal values (int scaled to 0..1, s2.13 and float
+ * as is), so images of different formats can be compared directly. Source
+ * rows are converted with load_tile() in chunks of TILE_PIXELS. Alpha
+ * channels are ignored.
+ */
+
+static void load_nominal(const struct Image *img, int x, int y, int npx, double *dst)
+{
+	load_tile(img->buffer + (size_t)y * img->stride +
+	                  (size_t)x * img->channels * img->bitsperchannel / 8,
+	          img->format, img->bitsperchannel, dst, (size_t)npx * img->channels);
+}
+
+/* SSIM
+ *
+ * Windowed SSIM on luma with the usual 11x11 Gaussian window (sigma 1.5),
+ * C1 = (0.01)^2 and C2 = (0.03)^2 for a nominal range of 1. The window is
+ * separable: each source row is blurred horizontally once into a ring of
+ * 11 rows (for the five moments x, y, x^2, y^2, xy), and the vertical pass
+ * for an output row only combines those ring rows. So memory use is a
+ * few rows, independent of image height. Image edges are replicated.
+ */
+
+#define SSIM_RADIUS 5
+#define SSIM_TAPS   (2 * SSIM_RADIUS + 1)
+#define SSIM_SIGMA  1.5
+#define SSIM_C1     (0.01f * 0.01f)
+#define SSIM_C2     (0.03f * 0.03f)
+
+enum { SSIM_X, SSIM_Y, SSIM_XX, SSIM_YY, SSIM_XY, SSIM_PLANES };
+
+struct SsimCtx
+{
+	const struct Image *img[2];
+	int                 width;
+	int                 height;
+	float               weight[SSIM_TAPS];
+	double             *dtile;
+	float              *luma[2]; /* width + 2 * SSIM_RADIUS, edges replicated */
+	float              *ring;    /* SSIM_TAPS rows of SSIM_PLANES planes */
+	float              *acc;     /* SSIM_PLANES planes */
+	float              *block;
+};
+
+static inline float *ssim_ring(struct SsimCtx *ctx, int v, int plane)
+{
+	int slot = (v + SSIM_TAPS) % SSIM_TAPS;
+
+	return ctx->ring + ((size_t)slot * SSIM_PLANES + plane) * ctx->width;
+}
+
+static void ssim_luma_row(struct SsimCtx *ctx, int i, int y)
+{
+	const struct Image *img      = ctx->img[i];
+	int                 channels = img->channels;
+	float              *dst      = ctx->luma[i] + SSIM_RADIUS;
+
+	for (int x = 0; x < ctx->width; x += TILE_PIXELS)
+	{
+		int npx = MIN(TILE_PIXELS, ctx->width - x);
+
+		load_nominal(img, x, y, npx, ctx->dtile);
+		if (channels < 3)
+		{
+			for (int p = 0; p < npx; p++)
+				dst[x + p] = (float)ctx->dtile[(size_t)p * channels];
+		}
+		else
+		{
+			for (int p = 0; p < npx; p++)
+			{
+				const double *px = ctx->dtile + (size_t)p * channels;
+				dst[x + p] = (float)(0.2126 * px[0] + 0.7152 * px[1] + 0.0722 * px[2]);
+			}
+		}
+	}
+
+	for (int k = 1; k <= SSIM_RADIUS; k++)
+	{
+		dst[-k]                 = dst[0];
+		dst[ctx->width - 1 + k] = dst[ctx->width - 1];
+	}
+}
+
+static void ssim_hblur_row(struct SsimCtx *ctx, int v)
+{
+	int                   y  = v < 0 ? 0 : (v >= ctx->height ? ctx->height - 1 : v);
+	const float *restrict a  = ctx->luma[0];
+	const float *restrict b  = ctx->luma[1];
+	float *restrict       mx = ssim_ring(ctx, v, SSIM_X);
+	float *restrict       my = ssim_ring(ctx, v, SSIM_Y);
+	float *restrict       xx = ssim_ring(ctx, v, SSIM_XX);
+	float *restrict       yy = ssim_ring(ctx, v, SSIM_YY);
+	float *restrict       xy = ssim_ring(ctx, v, SSIM_XY);
+
+	ssim_luma_row(ctx, 0, y);
+	ssim_luma_row(ctx, 1, y);
+
+	/* taps in the outer loop, so the inner loop runs along the row
+	 * and can be vectorized */
+	memset(mx, 0, (size_t)ctx->width * sizeof *mx);
+	memset(my, 0, (size_t)ctx->width * sizeof *my);
+	memset(xx, 0, (size_t)ctx->width * sizeof *xx);
+	memset(yy, 0, (size_t)ctx->width * sizeof *yy);
+	memset(xy, 0, (size_t)ctx->width * sizeof *xy);
+
+	for (int k = 0; k < SSIM_TAPS; k++)
+	{
+		float                 w  = ctx->weight[k];
+		const float *restrict ak = a + k;
+		const float *restrict bk = b + k;
+
+		for (int x = 0; x < ctx->width; x++)
+		{
+			float va = ak[x], vb = bk[x];
+			mx[x] += w * va;
+			my[x] += w * vb;
+			xx[x] += w * va * va;
+			yy[x] += w * vb * vb;
+			xy[x] += w * va * vb;
+		}
+	}
+}
+
+static void ssim_vblur_row(struct SsimCtx *ctx, int y)
+{
+	size_t width = ctx->width;
+
+	memset(ctx->acc, 0, SSIM_PLANES * width * sizeof *ctx->acc);
+	for (int k = 0; k < SSIM_TAPS; k++)
+	{
+		float w = ctx->weight[k];
+
+		for (int plane = 0; plane < SSIM_PLANES; plane++)
+		{
+			const float *src = ssim_ring(ctx, y - SSIM_RADIUS + k, plane);
+			float       *dst = ctx->acc + plane * width;
+
+			for (size_t x = 0; x < width; x++)
+				dst[x] += w * src[x];
+		}
+	}
+}
+
+static bool metric_ssim(const struct Image *img0, const struct Image *img1,
+                        struct MetricResult *result)
+{
+	struct SsimCtx ctx;
+	size_t         width = img0->width;
+	double         sum = 0.0, wsum = 0.0;
+	float          worst = 1.0f;
+
+	memset(&ctx, 0, sizeof ctx);
+	ctx.img[0] = img0;
+	ctx.img[1] = img1;
+	ctx.width  = img0->width;
+	ctx.height = img0->height;
+
+	for (int k = 0; k < SSIM_TAPS; k++)
+	{
+		double d      = k - SSIM_RADIUS;
+		ctx.weight[k] = (float)exp(-d * d / (2.0 * SSIM_SIGMA * SSIM_SIGMA));
+		wsum         += ctx.weight[k];
+	}
+	for (int k = 0; k < SSIM_TAPS; k++)
+		ctx.weight[k] = (float)(ctx.weight[k] / wsum);
+
+	ctx.dtile = malloc((size_t)MIN(ctx.width, TILE_PIXELS) *
+	                   MAX(img0->channels, img1->channels) * sizeof *ctx.dtile);
+	ctx.block = malloc(((SSIM_TAPS + 1) * SSIM_PLANES * width +
+	                    2 * (width + 2 * SSIM_RADIUS)) * sizeof *ctx.block);
+	if (!(ctx.dtile && ctx.block))
+	{
+		perror("compare: ssim buffers");
+		free(ctx.dtile);
+		free(ctx.block);
+		return false;
+	}
+	ctx.ring    = ctx.block;
+	ctx.acc     = ctx.ring + SSIM_TAPS * SSIM_PLANES * width;
+	ctx.luma[0] = ctx.acc + SSIM_PLANES * width;
+	ctx.luma[1] = ctx.luma[0] + width + 2 * SSIM_RADIUS;
+
+	for (int v = -SSIM_RADIUS; v < SSIM_RADIUS; v++)
+		ssim_hblur_row(&ctx, v);
+
+	for (int y = 0; y < ctx.height; y++)
+	{
+		const float *mx = ctx.acc + SSIM_X * width, *my = ctx.acc + SSIM_Y * width;
+		const float *xx = ctx.acc + SSIM_XX * width, *yy = ctx.acc + SSIM_YY * width;
+		const float *xy = ctx.acc + SSIM_XY * width;
+		float        rowsum = 0.0f, rowmin = 1.0f;
+
+		ssim_hblur_row(&ctx, y + SSIM_RADIUS);
+		ssim_vblur_row(&ctx, y);
+
+		for (size_t x = 0; x < width; x++)
+		{
+			float mxy = mx[x] * my[x];
+			float mxx = mx[x] * mx[x];
+			float myy = my[x] * my[x];
+			float s   = ((2.0f * mxy + SSIM_C1) * (2.0f * (xy[x] - mxy) + SSIM_C2)) /
+			          ((mxx + myy + SSIM_C1) * ((xx[x] - mxx) + (yy[x] - myy) + SSIM_C2));
+			rowsum += s;
+			rowmin  = s < rowmin ? s : rowmin;
+		}
+		sum  += rowsum;
+		worst = MIN(worst, rowmin);
+	}
+
+	result->mean  = sum / ((double)ctx.width * ctx.height);
+	result->worst = worst;
+
+	free(ctx.dtile);
+	free(ctx.block);
+	return true;
+}
+
+/* CIEDE2000
+ *
+ * Pixels are taken to be sRGB (gray images as R=G=B) and converted to
+ * CIELAB (D65). Rows which are bytewise identical are skipped, as are
+ * identical pixels, so the (expensive) color difference formula only
+ * runs where the images actually differ. 8-bit images use a lookup table
+ * for the sRGB transfer function.
+ */
+
+static double srgb_to_linear(double v)
+{
+	double a = fabs(v);
+
+	a = a <= 0.04045 ? a / 12.92 : pow((a + 0.055) / 1.055, 2.4);
+	return v < 0.0 ? -a : a;
+}
+
+static inline double lab_f(double t)
+{
+	const double d = 6.0 / 29.0;
+
+	return t > d * d * d ? cbrt(t) : t / (3.0 * d * d) + 4.0 / 29.0;
+}
+
+static void rgb_to_lab(const double *rgb, double *lab)
+{
+	double X, Y, Z;
+
+	X = (0.4124564 * rgb[0] + 0.3575761 * rgb[1] + 0.1804375 * rgb[2]) / 0.95047;
+	Y = (0.2126729 * rgb[0] + 0.7151522 * rgb[1] + 0.0721750 * rgb[2]);
+	Z = (0.0193339 * rgb[0] + 0.1191920 * rgb[1] + 0.9503041 * rgb[2]) / 1.08883;
+
+	X = lab_f(X);
+	Y = lab_f(Y);
+	Z = lab_f(Z);
+
+	lab[0] = 116.0 * Y - 16.0;
+	lab[1] = 500.0 * (X - Y);
+	lab[2] = 200.0 * (Y - Z);
+}
+
+#define PI 3.14159265358979323846
+
+static inline double deg2rad(double deg)
+{
+	return deg * (PI / 180.0);
+}
+
+static double hue_angle(double b, double a)
+{
+	double h;
+
+	if (a == 0.0 && b == 0.0)
+		return 0.0;
+	h = atan2(b, a) * (180.0 / PI);
+	return h < 0.0 ? h + 360.0 : h;
+}
+
+static inline double pow7(double x)
+{
+	double x2 = x * x;
+
+	return x2 * x2 * x2 * x;
+}
+
+static double ciede2000(const double *lab1, const double *lab2)
+{
+	const double pow25_7 = 6103515625.0; /* 25^7 */
+	double       C1, C2, Cm7, G, a1, a2, C1p, C2p, h1p, h2p;
+	double       dLp, dCp, dhp, dHp, Lpm, Cpm, hpm, Cpm7, T, dtheta, Rc, Sl, Sc, Sh, Rt;
+	double       L50, c1, s1, c2, s2, c3, s3, c4, s4;
+
+	C1  = hypot(lab1[1], lab1[2]);
+	C2  = hypot(lab2[1], lab2[2]);
+	Cm7 = pow7((C1 + C2) / 2.0);
+	G   = 0.5 * (1.0 - sqrt(Cm7 / (Cm7 + pow25_7)));
+
+	a1  = (1.0 + G) * lab1[1];
+	a2  = (1.0 + G) * lab2[1];
+	C1p = hypot(a1, lab1[2]);
+	C2p = hypot(a2, lab2[2]);
+	h1p = hue_angle(lab1[2], a1);
+	h2p = hue_angle(lab2[2], a2);
+
+	dLp = lab2[0] - lab1[0];
+	dCp = C2p - C1p;
+
+	if (C1p * C2p == 0.0)
+		dhp = 0.0;
+	else
+	{
+		dhp = h2p - h1p;
+		if (dhp > 180.0)
+			dhp -= 360.0;
+		else if (dhp < -180.0)
+			dhp += 360.0;
+	}
+	dHp = 2.0 * sqrt(C1p * C2p) * sin(deg2rad(dhp / 2.0));
+
+	Lpm = (lab1[0] + lab2[0]) / 2.0;
+	Cpm = (C1p + C2p) / 2.0;
+
+	if (C1p * C2p == 0.0)
+		hpm = h1p + h2p;
+	else if (fabs(h1p - h2p) <= 180.0)
+		hpm = (h1p + h2p) / 2.0;
+	else if (h1p + h2p < 360.0)
+		hpm = (h1p + h2p + 360.0) / 2.0;
+	else
+		hpm = (h1p + h2p - 360.0) / 2.0;
+
+	/* T = 1 - 0.17 cos(h - 30) + 0.24 cos(2h) + 0.32 cos(3h + 6) - 0.20 cos(4h - 63),
+	 * with the multiple angles derived from a single sin/cos pair */
+	c1 = cos(deg2rad(hpm));
+	s1 = sin(deg2rad(hpm));
+	c2 = c1 * c1 - s1 * s1;
+	s2 = 2.0 * s1 * c1;
+	c3 = c2 * c1 - s2 * s1;
+	s3 = s2 * c1 + c2 * s1;
+	c4 = c2 * c2 - s2 * s2;
+	s4 = 2.0 * s2 * c2;
+
+	T = 1.0 - 0.17 * (c1 * 0.86602540378443865 + s1 * 0.5) + 0.24 * c2 +
+	    0.32 * (c3 * 0.99452189536827333 - s3 * 0.10452846326765347) -
+	    0.20 * (c4 * 0.45399049973954675 + s4 * 0.89100652418836786);
+
+	dtheta = 30.0 * exp(-((hpm - 275.0) / 25.0) * ((hpm - 275.0) / 25.0));
+	Cpm7   = pow7(Cpm);
+	Rc     = 2.0 * sqrt(Cpm7 / (Cpm7 + pow25_7));
+	L50    = (Lpm - 50.0) * (Lpm - 50.0);
+	Sl     = 1.0 + 0.015 * L50 / sqrt(20.0 + L50);
+	Sc     = 1.0 + 0.045 * Cpm;
+	Sh     = 1.0 + 0.015 * Cpm * T;
+	Rt     = -sin(deg2rad(2.0 * dtheta)) * Rc;
+
+	dLp /= Sl;
+	dCp /= Sc;
+	dHp /= Sh;
+
+	return sqrt(dLp * dLp + dCp * dCp + dHp * dHp + Rt * dCp * dHp);
+}
+
+struct LabRow
+{
+	const struct Image *img;
+	double             *dtile;
+	double             *lab; /* 3 per pixel */
+};
+
+static void lab_row(struct LabRow *lr, const double *lut8, int y)
+{
+	const struct Image *img      = lr->img;
+	int                 channels = img->channels;
+	int                 width    = img->width;
+	const uint8_t      *src8     = NULL;
+	double              rgb[3];
+
+	if (lut8)
+		src8 = img->buffer + (size_t)y * img->stride;
+
+	for (int x = 0; x < width; x += TILE_PIXELS)
+	{
+		int npx = MIN(TILE_PIXELS, width - x);
+
+		if (!lut8)
+			load_nominal(img, x, y, npx, lr->dtile);
+
+		for (int p = 0; p < npx; p++)
+		{
+			size_t i = (size_t)p * channels;
+
+			for (int c = 0; c < 3; c++)
+			{
+				int ch = channels < 3 ? 0 : c;
+
+				if (lut8)
+					rgb[c] = lut8[src8[(size_t)(x + p) * channels + ch]];
+				else
+					rgb[c] = srgb_to_linear(lr->dtile[i + ch]);
+			}
+			rgb_to_lab(rgb, lr->lab + 3 * (size_t)(x + p));
+		}
+	}
+}
+
+static bool metric_deltae2000(const struct Image *img0, const struct Image *img1,
+                              struct MetricResult *result)
+{
+	struct LabRow lr[2];
+	double        lut8[256];
+	double        sum = 0.0, worst = 0.0;
+	size_t        rowsize = img_rowbytes(img0);
+	bool          ok      = false;
+	bool          is8[2];
+
+	memset(lr, 0, sizeof lr);
+
+	for (int i = 0; i < 256; i++)
+		lut8[i] = srgb_to_linear(i / 255.0);
+
+	for (int i = 0; i < 2; i++)
+	{
+		lr[i].img   = i ? img1 : img0;
+		is8[i]      = lr[i].img->format == BMP_FORMAT_INT && lr[i].img->bitsperchannel == 8;
+		lr[i].dtile = malloc((size_t)MIN(img0->width, TILE_PIXELS) * lr[i].img->channels *
+		                     sizeof *lr[i].dtile);
+		lr[i].lab   = malloc((size_t)img0->width * 3 * sizeof *lr[i].lab);
+		if (!(lr[i].dtile && lr[i].lab))
+		{
+			perror("compare: deltaE buffers");
+			goto abort;
+		}
+	}
+
+	for (int y = 0; y < img0->height; y++)
+	{
+		double rowsum = 0.0;
+
+		if (img0->format == img1->format &&
+		    img0->bitsperchannel == img1->bitsperchannel &&
+		    !memcmp(img0->buffer + y * img0->stride, img1->buffer + y * img1->stride,
+		            rowsize))
+			continue;
+
+		lab_row(&lr[0], is8[0] ? lut8 : NULL, y);
+		lab_row(&lr[1], is8[1] ? lut8 : NULL, y);
+
+		for (int x = 0; x < img0->width; x++)
+		{
+			const double *lab0 = lr[0].lab + 3 * (size_t)x;
+			const double *lab1 = lr[1].lab + 3 * (size_t)x;
+			double        d;
+
+			if (lab0[0] == lab1[0] && lab0[1] == lab1[1] && lab0[2] == lab1[2])
+				continue;
+
+			d       = ciede2000(lab0, lab1);
+			rowsum += d;
+			worst   = MAX(worst, d);
+		}
+		sum += rowsum;
+	}
+
+	result->mean  = sum / ((double)img0->width * img0->height);
+	result->worst = worst;
+	ok            = true;
+abort:
+	for (int i = 0; i < 2; i++)
+	{
+		free(lr[i].dtile);
+		free(lr[i].lab);
+	}
+	return ok;
+}
+
+/********************************************************
+ * 	compare_metric
+ *
+ * 	Compute a perceptual similarity metric over the
+ * 	whole image. Images must have identical width,
+ * 	height, and number of channels.
+ *******************************************************/
+
+bool compare_metric(const struct Image *img0, const struct Image *img1,
+                    enum CompareMetric metric, struct MetricResult *result)
+{
+	memset(result, 0, sizeof *result);
+
+	switch (metric)
+	{
+	case METRIC_SSIM:
+		return metric_ssim(img0, img1, result);
+	case METRIC_DELTAE2000:
+		return metric_deltae2000(img0, img1, result);
+	default:
+		break;
+	}
+	printf("compare: invalid metric (%d)\n", (int)metric);
+	return false;
+}
+
+/********************************************************
+ * 	compare_print_stats
+ *******************************************************/
+
+void compare_print_stats(const struct CompareStats *stats)
+{
+	printf("compare: %llu of %llu samples don't match\n",
+	       (unsigned long long)stats->mismatches, (unsigned long long)stats->samples);
+	printf("         max error %g, mean error %g, PSNR %.2f dB\n",
+	       stats->maxerr, stats->meanerr, stats->psnr);
+
+	if (stats->mismatches > 0)
+		printf("         mismatches within (%d,%d)-(%d,%d)\n", stats->xmin,
+		       stats->ymin, stats->xmax, stats->ymax);
+
+	if (stats->channels < 2)
+		return;
+
+	for (int c = 0; c < stats->channels; c++)
+	{
+		const struct CompareChannel *ch = &stats->chan[c];
+
+		printf("         channel %d: %llu mismatches, max error %g, mean error %g\n",
+		       c, (unsigned long long)ch->mismatches, ch->maxerr,
+		       stats->samples ? ch->sumerr * stats->channels / stats->samples : 0.0);
+	}
+}
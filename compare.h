@@ -0,0 +1,76 @@
+/* bmplibtest - compare.h
+ *
+ * Copyright (c) 2025, Rupert Weber.
+ *
+ * This file is part of bmplibtest.
+ * bmplibtest is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+struct CompareTolerance
+{
+	uint64_t fuzz; /* int: abs. difference, s2.13: raw 1/8192 steps, float: ULPs */
+	double   epsilon; /* abs. difference of real values (float/s2.13 only) */
+	double   relative; /* difference relative to larger magnitude (float/s2.13 only) */
+};
+
+struct DiffImage
+{
+	const char *path;
+	double      amplify;
+};
+
+enum CompareMetric
+{
+	METRIC_NONE,
+	METRIC_SSIM,
+	METRIC_DELTAE2000,
+};
+
+struct MetricResult
+{
+	double mean;  /* mean SSIM resp. mean deltaE */
+	double worst; /* lowest SSIM resp. highest deltaE */
+};
+
+struct CompareChannel
+{
+	uint64_t mismatches;
+	double   maxerr;
+	double   sumerr;
+	double   sumsqerr;
+};
+
+struct CompareStats
+{
+	uint64_t              samples;
+	uint64_t              mismatches;
+	double                maxerr;
+	double                meanerr;
+	double                psnr; /* INFINITY if images are identical */
+	int                   xmin, ymin; /* bounding box of mismatching pixels, */
+	int                   xmax, ymax; /* only valid if mismatches > 0       */
+	int                   channels;
+	struct CompareChannel chan[4];
+};
+
+void compare_common_format(const struct Image *img0, const struct Image *img1,
+                           BMPFORMAT *format, int *bits);
+bool compare_find_mismatch(const struct Image *img0, const struct Image *img1,
+                           const struct CompareTolerance *tol);
+bool compare_stats(const struct Image *img0, const struct Image *img1,
+                   const struct CompareTolerance *tol, struct CompareStats *stats,
+                   const struct DiffImage *diff);
+bool compare_metric(const struct Image *img0, const struct Image *img1,
+                    enum CompareMetric metric, struct MetricResult *result);
+void compare_print_stats(const struct CompareStats *stats);
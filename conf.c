@@ -39,6 +39,10 @@ enum Optnum
 	OP_SAMPLEDIR,
 	OP_REFDIR,
 	OP_TMPDIR,
+	OP_MANIFEST,
+	OP_BLESS,
+	OP_REFCACHE,
+	OP_NOPLANCACHE,
 	OP_DUMP,
 	OP_PRETTY,
 	OP_HELP,
@@ -53,16 +57,20 @@ struct Option
 	const char       *defaultstr;
 	const char       *envname;
 } s_options[] = {
-	{     OP_VERBOSE, 'v',  "verbose", false,             NULL,                     NULL },
-	{       OP_QUIET, 'q',    "quiet", false,             NULL,                     NULL },
-	{    OP_TESTFILE, 'f',     "file",  true, "./testdefs.txt",    "BMPLIBTEST_TESTFILE" },
-	{ OP_BMPSUITEDIR, 'b', "bmpsuite",  true,     "./bmpsuite", "BMPLIBTEST_BMPSUITEDIR" },
-	{   OP_SAMPLEDIR, 's',  "samples",  true,      "./samples",   "BMPLIBTEST_SAMPLEDIR" },
-	{      OP_REFDIR, 'r',     "refs",  true,         "./refs",      "BMPLIBTEST_REFDIR" },
-	{      OP_TMPDIR, 't',      "tmp",  true,          "./tmp",      "BMPLIBTEST_TMPDIR" },
-	{        OP_DUMP, 'd',     "dump", false,             NULL,                     NULL },
-	{      OP_PRETTY, 'p',   "pretty", false,             NULL,                     NULL },
-	{        OP_HELP, '?',     "help", false,             NULL,                     NULL },
+	{     OP_VERBOSE, 'v',      "verbose", false,             NULL,                     NULL },
+	{       OP_QUIET, 'q',        "quiet", false,             NULL,                     NULL },
+	{    OP_TESTFILE, 'f',         "file",  true, "./testdefs.txt",    "BMPLIBTEST_TESTFILE" },
+	{ OP_BMPSUITEDIR, 'b',     "bmpsuite",  true,     "./bmpsuite", "BMPLIBTEST_BMPSUITEDIR" },
+	{   OP_SAMPLEDIR, 's',      "samples",  true,      "./samples",   "BMPLIBTEST_SAMPLEDIR" },
+	{      OP_REFDIR, 'r',         "refs",  true,         "./refs",      "BMPLIBTEST_REFDIR" },
+	{      OP_TMPDIR, 't',          "tmp",  true,          "./tmp",      "BMPLIBTEST_TMPDIR" },
+	{    OP_MANIFEST, 'm',     "manifest",  true,   "./hashes.txt",    "BMPLIBTEST_MANIFEST" },
+	{       OP_BLESS, 'B',        "bless", false,             NULL,                     NULL },
+	{    OP_REFCACHE, 'c',     "refcache",  true,     "./refcache",    "BMPLIBTEST_REFCACHE" },
+	{ OP_NOPLANCACHE, 'P', "no-plancache", false,             NULL,                     NULL },
+	{        OP_DUMP, 'd',         "dump", false,             NULL,                     NULL },
+	{      OP_PRETTY, 'p',       "pretty", false,             NULL,                     NULL },
+	{        OP_HELP, '?',         "help", false,             NULL,                     NULL },
 };
 
 static MAY_BE_UNUSED void add_opt_str(char **result, const char *arg);
@@ -105,6 +113,14 @@ static bool do_opt(int op, struct Conf *conf)
 		conf->pretty = true;
 		break;
 
+	case OP_BLESS:
+		conf->bless = true;
+		break;
+
+	case OP_NOPLANCACHE:
+		conf->noplancache = true;
+		break;
+
 	default:
 		printf("Something is broken\n");
 		exit(1);
@@ -152,6 +168,14 @@ static bool do_opt_value(const char *arg, int op, struct Conf *conf)
 		add_opt_str(&conf->tmpdir, arg);
 		break;
 
+	case OP_MANIFEST:
+		add_opt_str(&conf->manifest, arg);
+		break;
+
+	case OP_REFCACHE:
+		add_opt_str(&conf->refcache, arg);
+		break;
+
 #ifdef NEVER
 	/* template for numerical arg (long) */
 	case OP_XXX:
@@ -212,6 +236,14 @@ static void load_env_strings(struct Conf *conf)
 			add_opt_str(&conf->tmpdir, str);
 			break;
 
+		case OP_MANIFEST:
+			add_opt_str(&conf->manifest, str);
+			break;
+
+		case OP_REFCACHE:
+			add_opt_str(&conf->refcache, str);
+			break;
+
 #ifdef NEVER
 		/* template for numerical arg (long) */
 		case OP_XXX:
@@ -268,6 +300,14 @@ static void load_default_strings(struct Conf *conf)
 			add_opt_str(&conf->tmpdir, s_options[i].defaultstr);
 			break;
 
+		case OP_MANIFEST:
+			add_opt_str(&conf->manifest, s_options[i].defaultstr);
+			break;
+
+		case OP_REFCACHE:
+			add_opt_str(&conf->refcache, s_options[i].defaultstr);
+			break;
+
 #ifdef NEVER
 		/* template for numerical arg (long) */
 		case OP_XXX:
@@ -328,6 +368,19 @@ void conf_usage(void)
 	print_option_with_value(OP_TMPDIR, "tmp-dir");
 	printf("\t\tDirectory where output images will be written.\n\n");
 
+	print_option_with_value(OP_REFCACHE, "cache-dir");
+	printf("\t\tDirectory for decoded reference PNGs. 'off' disables the cache.\n\n");
+
+	print_option(OP_NOPLANCACHE);
+	printf("\t\tDon't read or write the parsed test definitions cache\n"
+	       "\t\t(<file>.plancache in the working directory).\n\n");
+
+	print_option_with_value(OP_MANIFEST, "file");
+	printf("\t\tHash manifest used by expect-hash.\n\n");
+
+	print_option(OP_BLESS);
+	printf("\t\tRecord image hashes into the manifest instead of checking them.\n\n");
+
 	print_option(OP_VERBOSE);
 	print_option(OP_QUIET);
 	printf("\t\tBe more or less verbose. Repeat option to be even more verbose\n"
@@ -361,6 +414,10 @@ void conf_free(struct Conf *conf)
 		free(conf->refdir);
 	if (conf->tmpdir)
 		free(conf->tmpdir);
+	if (conf->manifest)
+		free(conf->manifest);
+	if (conf->refcache)
+		free(conf->refcache);
 
 	free(conf);
 }
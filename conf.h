@@ -32,10 +32,14 @@ struct Conf
 	char           *refdir;
 	char           *tmpdir;
 	char           *testfile;
+	char           *manifest;
+	char           *refcache;
 	bool            env;
 	bool            help;
 	bool            dump;
 	bool            pretty;
+	bool            bless;
+	bool            noplancache;
 	int             nstrings;
 	struct Confstr *strlist;
 };
@@ -0,0 +1,177 @@
+/* bmplibtest - dirscan.c
+ *
+ * Copyright (c) 2025, Rupert Weber.
+ *
+ * This file is part of bmplibtest.
+ * bmplibtest is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "allocate.h"
+#include "dirscan.h"
+
+/* Directory scans
+ *
+ * A file name given to loadbmp/loadpng may be a shell pattern, which
+ * turns the test into a sweep over all matching files. Only the last
+ * path component may contain '*', '?' or '[...]'; the directory it is in
+ * is opened relative to the already open configured dir (openat), and
+ * read once with readdir(). Names are matched with fnmatch(), files
+ * starting with '.' only match patterns that say so.
+ *
+ * The matches are sorted, so results and manifests don't depend on the
+ * order the file system returns the entries in. The names (including the
+ * pattern's directory part) live in the caller's arena, only the array
+ * pointing to them is malloc()ed and freed by dirscan_free().
+ */
+
+static bool is_regular_file(int dirfd, const struct dirent *ent);
+static int  compare_names(const void *a, const void *b);
+
+/********************************************************
+ * 	dirscan_is_pattern
+ *******************************************************/
+
+bool dirscan_is_pattern(const char *fname)
+{
+	return strpbrk(fname, "*?[") != NULL;
+}
+
+/********************************************************
+ * 	dirscan_match
+ *
+ * 	Returns false if the directory can't be read.
+ * 	No matches is not an error.
+ *******************************************************/
+
+bool dirscan_match(int dirfd, const char *pattern, struct Arena *arena,
+                   struct DirMatches *matches)
+{
+	const char    *base;
+	size_t         prefixlen, nalloc = 0;
+	int            fd;
+	DIR           *dir;
+	struct dirent *ent;
+
+	memset(matches, 0, sizeof *matches);
+
+	if ((base = strrchr(pattern, '/')))
+	{
+		char *sub = arena_strndup(arena, pattern, (size_t)(base - pattern));
+
+		base++;
+		prefixlen = (size_t)(base - pattern);
+		fd        = openat(dirfd, sub, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	}
+	else
+	{
+		base      = pattern;
+		prefixlen = 0;
+		fd        = openat(dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	}
+
+	if (fd == -1)
+		return false;
+
+	if (!(dir = fdopendir(fd)))
+	{
+		close(fd);
+		return false;
+	}
+
+	errno = 0;
+	while ((ent = readdir(dir)))
+	{
+		size_t namelen;
+		char  *name;
+
+		if (fnmatch(base, ent->d_name, FNM_PERIOD) || !is_regular_file(fd, ent))
+			continue;
+
+		if (matches->n == nalloc)
+		{
+			const char **tmp;
+
+			nalloc = nalloc ? 2 * nalloc : 256;
+			if (!(tmp = realloc(matches->names, nalloc * sizeof *tmp)))
+			{
+				perror("dirscan");
+				exit(1);
+			}
+			matches->names = tmp;
+		}
+
+		namelen = strlen(ent->d_name);
+		name    = arena_alloc(arena, prefixlen + namelen + 1, 0);
+		memcpy(name, pattern, prefixlen);
+		memcpy(name + prefixlen, ent->d_name, namelen + 1);
+		matches->names[matches->n++] = name;
+	}
+
+	if (errno)
+	{
+		int err = errno;
+
+		closedir(dir);
+		dirscan_free(matches);
+		errno = err;
+		return false;
+	}
+	closedir(dir);
+
+	if (matches->n > 1)
+		qsort(matches->names, matches->n, sizeof *matches->names, compare_names);
+
+	return true;
+}
+
+/********************************************************
+ * 	dirscan_free
+ *******************************************************/
+
+void dirscan_free(struct DirMatches *matches)
+{
+	free(matches->names);
+	matches->names = NULL;
+	matches->n     = 0;
+}
+
+static bool is_regular_file(int dirfd, const struct dirent *ent)
+{
+	struct stat st;
+
+	if (ent->d_type != DT_UNKNOWN && ent->d_type != DT_LNK)
+		return ent->d_type == DT_REG;
+
+	return !fstatat(dirfd, ent->d_name, &st, 0) && S_ISREG(st.st_mode);
+}
+
+static int compare_names(const void *a, const void *b)
+{
+	return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
@@ -0,0 +1,254 @@
+/* bmplibtest - hash.c
+ *
+ * Copyright (c) 2025, Rupert Weber.
+ *
+ * This file is part of bmplibtest.
+ * bmplibtest is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <bmplib.h>
+
+#include "defs.h"
+#include "imgstack.h"
+#include "hash.h"
+
+/* XXH64
+ *
+ * Plain C implementation of the XXH64 hash (https://xxhash.com), in its
+ * streaming form so large buffers can be hashed piecewise. The four
+ * independent lanes are what makes it fast; no intrinsics needed.
+ */
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char *p)
+{
+	return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 |
+	       (uint64_t)p[3] << 24 | (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 |
+	       (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+static inline uint32_t read32(const unsigned char *p)
+{
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+	       (uint32_t)p[3] << 24;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input)
+{
+	acc += input * PRIME64_2;
+	acc  = rotl64(acc, 31);
+	return acc * PRIME64_1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t val)
+{
+	acc ^= xxh_round(0, val);
+	return acc * PRIME64_1 + PRIME64_4;
+}
+
+static void xxh_stripes(uint64_t *v, const unsigned char *p, size_t nstripes)
+{
+	uint64_t v0 = v[0], v1 = v[1], v2 = v[2], v3 = v[3];
+
+	for (size_t i = 0; i < nstripes; i++, p += 32)
+	{
+		v0 = xxh_round(v0, read64(p));
+		v1 = xxh_round(v1, read64(p + 8));
+		v2 = xxh_round(v2, read64(p + 16));
+		v3 = xxh_round(v3, read64(p + 24));
+	}
+	v[0] = v0;
+	v[1] = v1;
+	v[2] = v2;
+	v[3] = v3;
+}
+
+void xxh64_init(struct Xxh64 *state, uint64_t seed)
+{
+	memset(state, 0, sizeof *state);
+	state->seed = seed;
+	state->v[0] = seed + PRIME64_1 + PRIME64_2;
+	state->v[1] = seed + PRIME64_2;
+	state->v[2] = seed;
+	state->v[3] = seed - PRIME64_1;
+}
+
+void xxh64_update(struct Xxh64 *state, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	state->total += len;
+
+	if (state->buflen)
+	{
+		size_t n = MIN(len, sizeof state->buf - state->buflen);
+
+		memcpy(state->buf + state->buflen, p, n);
+		state->buflen += n;
+		p             += n;
+		len           -= n;
+		if (state->buflen < sizeof state->buf)
+			return;
+		xxh_stripes(state->v, state->buf, 1);
+		state->buflen = 0;
+	}
+
+	if (len >= 32)
+	{
+		xxh_stripes(state->v, p, len / 32);
+		p   += len & ~(size_t)31;
+		len &= 31;
+	}
+
+	memcpy(state->buf, p, len);
+	state->buflen = len;
+}
+
+uint64_t xxh64_digest(const struct Xxh64 *state)
+{
+	const unsigned char *p   = state->buf;
+	size_t               len = state->buflen;
+	uint64_t             h;
+
+	if (state->total >= 32)
+	{
+		h = rotl64(state->v[0], 1) + rotl64(state->v[1], 7) +
+		    rotl64(state->v[2], 12) + rotl64(state->v[3], 18);
+		for (int i = 0; i < 4; i++)
+			h = xxh_merge(h, state->v[i]);
+	}
+	else
+	{
+		h = state->seed + PRIME64_5;
+	}
+
+	h += state->total;
+
+	for (; len >= 8; len -= 8, p += 8)
+	{
+		h ^= xxh_round(0, read64(p));
+		h  = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+	}
+	if (len >= 4)
+	{
+		h   ^= (uint64_t)read32(p) * PRIME64_1;
+		h    = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+		p   += 4;
+		len -= 4;
+	}
+	for (; len > 0; len--, p++)
+	{
+		h ^= *p * PRIME64_5;
+		h  = rotl64(h, 11) * PRIME64_1;
+	}
+
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+uint64_t xxh64(const void *data, size_t len, uint64_t seed)
+{
+	struct Xxh64 state;
+
+	xxh64_init(&state, seed);
+	xxh64_update(&state, data, len);
+	return xxh64_digest(&state);
+}
+
+/********************************************************
+ * 	xxh64_file
+ *
+ * 	Hash the remaining contents of file (seed 0).
+ *******************************************************/
+
+bool xxh64_file(FILE *file, uint64_t *hash)
+{
+	struct Xxh64  state;
+	unsigned char buf[65536];
+	size_t        n;
+
+	xxh64_init(&state, 0);
+	while ((n = fread(buf, 1, sizeof buf, file)) > 0)
+		xxh64_update(&state, buf, n);
+
+	if (ferror(file))
+		return false;
+
+	*hash = xxh64_digest(&state);
+	return true;
+}
+
+/********************************************************
+ * 	image_hash
+ *
+ * 	Hash of the canonical image representation:
+ * 	a header with width, height, channels, bits,
+ * 	format, and number of palette colors (each as
+ * 	32-bit little endian), followed by the palette
+ * 	and the pixel rows (without any padding).
+ * 	Samples wider than 8 bits are hashed in host
+ * 	byte order.
+ *******************************************************/
+
+uint64_t image_hash(const struct Image *img)
+{
+	struct Xxh64  state;
+	unsigned char header[6 * 4];
+	uint32_t      fields[6];
+	size_t        size;
+
+	fields[0] = (uint32_t)img->width;
+	fields[1] = (uint32_t)img->height;
+	fields[2] = (uint32_t)img->channels;
+	fields[3] = (uint32_t)img->bitsperchannel;
+	fields[4] = (uint32_t)img->format;
+	fields[5] = img->palette ? (uint32_t)img->numcolors : 0;
+
+	for (int i = 0; i < 6; i++)
+	{
+		for (int b = 0; b < 4; b++)
+			header[4 * i + b] = (unsigned char)(fields[i] >> (8 * b));
+	}
+
+	xxh64_init(&state, 0);
+	xxh64_update(&state, header, sizeof header);
+	if (img->palette)
+		xxh64_update(&state, img->palette, 4 * (size_t)img->numcolors);
+
+	size = img_rowbytes(img);
+	for (int y = 0; y < img->height; y++)
+		xxh64_update(&state, img->buffer + (size_t)y * img->stride, size);
+
+	return xxh64_digest(&state);
+}
@@ -0,0 +1,34 @@
+/* bmplibtest - hash.h
+ *
+ * Copyright (c) 2025, Rupert Weber.
+ *
+ * This file is part of bmplibtest.
+ * bmplibtest is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+struct Xxh64
+{
+	uint64_t      v[4];
+	uint64_t      total;
+	uint64_t      seed;
+	unsigned char buf[32];
+	size_t        buflen;
+};
+
+void     xxh64_init(struct Xxh64 *state, uint64_t seed);
+void     xxh64_update(struct Xxh64 *state, const void *data, size_t len);
+uint64_t xxh64_digest(const struct Xxh64 *state);
+uint64_t xxh64(const void *data, size_t len, uint64_t seed);
+bool     xxh64_file(FILE *file, uint64_t *hash);
+uint64_t image_hash(const struct Image *img);
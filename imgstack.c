@@ -17,13 +17,18 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <stdbool.h>
+#include <sys/mman.h>
 
 #include <bmplib.h>
 
 #include "imgstack.h"
+#include "bufpool.h"
 
 static struct Image **imgstack  = NULL;
 static int            imgcount  = 0;
@@ -109,14 +114,16 @@ void imgstack_destroy(void)
 		free(imgstack);
 		imgstack = NULL;
 	}
+	bufpool_destroy();
 }
 
+static void release_buffer(struct Image *img);
+
 void img_free(struct Image *img)
 {
 	if (img)
 	{
-		if (img->buffer)
-			free(img->buffer);
+		release_buffer(img);
 		if (img->palette)
 			free(img->palette);
 		if (img->iccprofile)
@@ -124,3 +131,274 @@ void img_free(struct Image *img)
 	}
 	free(img);
 }
+
+/* Shared buffers
+ *
+ * Views (see img_view()) share the parent's buffer. On creating the
+ * first view, ownership of the buffer (heap block or mapping) moves
+ * from the image into a refcounted struct SharedBuffer, which every
+ * image using it points to. The buffer is released with the last
+ * reference.
+ * Sharing is copy-on-write: anything modifying pixels in place must
+ * call img_make_writable() first, which gives an image that shares its
+ * buffer a private copy of its own pixels. Operations replacing the
+ * buffer just drop their reference.
+ */
+
+static void release_buffer(struct Image *img)
+{
+	if (img->shared)
+	{
+		if (--img->shared->refs == 0)
+		{
+			if (img->shared->mapping)
+				munmap(img->shared->mapping, img->shared->mapsize);
+			else if (img->shared->pooled)
+				bufpool_release(img->shared->block);
+			else
+				free(img->shared->block);
+			free(img->shared);
+		}
+		img->shared = NULL;
+	}
+	else if (img->mapping)
+	{
+		munmap(img->mapping, img->mapsize);
+		img->mapping = NULL;
+		img->mapsize = 0;
+	}
+	else if (img->pooled)
+		bufpool_release(img->buffer);
+	else if (img->buffer)
+		free(img->buffer);
+	img->buffer = NULL;
+	img->pooled = false;
+}
+
+/********************************************************
+ * 	img_resize_buffer
+ *
+ * 	Make sure the buffer holds at least newsize
+ * 	bytes. Growing moves the contents to a new
+ * 	aligned buffer (mapped buffers from the
+ * 	reference cache end up on the heap), shrinking
+ * 	keeps the current buffer.
+ * 	On failure, the old buffer remains valid.
+ *******************************************************/
+
+bool img_resize_buffer(struct Image *img, size_t newsize)
+{
+	unsigned char *tmp;
+
+	if (newsize <= img->buffersize)
+	{
+		img->buffersize = newsize;
+		return true;
+	}
+
+	if (!(tmp = img_aligned_alloc(newsize)))
+		return false;
+	if (img->buffer)
+		memcpy(tmp, img->buffer, img->buffersize);
+	release_buffer(img);
+
+	img->buffer     = tmp;
+	img->buffersize = newsize;
+	img->pooled     = true;
+	return true;
+}
+
+/********************************************************
+ * 	img_replace_buffer
+ *
+ * 	Release the current buffer and take ownership
+ * 	of the new one, which must come from
+ * 	img_aligned_alloc().
+ *******************************************************/
+
+void img_replace_buffer(struct Image *img, unsigned char *buffer, size_t size)
+{
+	release_buffer(img);
+	img->buffer     = buffer;
+	img->buffersize = size;
+	img->pooled     = true;
+}
+
+/********************************************************
+ * 	img_rowbytes
+ *
+ * 	Number of bytes actually used by one row (i.e.
+ * 	without any padding up to the stride).
+ *******************************************************/
+
+size_t img_rowbytes(const struct Image *img)
+{
+	return ((size_t)img->width * img->channels * img->bitsperchannel + 7) / 8;
+}
+
+/********************************************************
+ * 	img_aligned_stride
+ *
+ * 	Row stride for buffers we allocate ourselves:
+ * 	every row starts on an IMG_ROW_ALIGN boundary.
+ *******************************************************/
+
+size_t img_aligned_stride(int width, int channels, int bits)
+{
+	size_t rowbytes = ((size_t)width * channels * bits + 7) / 8;
+
+	return (rowbytes + IMG_ROW_ALIGN - 1) & ~(size_t)(IMG_ROW_ALIGN - 1);
+}
+
+/********************************************************
+ * 	img_aligned_alloc
+ *
+ * 	Allocate an IMG_ROW_ALIGN aligned buffer from
+ * 	the buffer pool. Hand it to an image with
+ * 	img_replace_buffer() (or release it with
+ * 	bufpool_release()).
+ *******************************************************/
+
+void *img_aligned_alloc(size_t size)
+{
+	return bufpool_alloc(size);
+}
+
+/********************************************************
+ * 	img_alloc_buffer
+ *
+ * 	Allocate an (uninitialized) buffer with aligned
+ * 	rows for the image's current dimensions and
+ * 	format. Any previous buffer is released.
+ *******************************************************/
+
+bool img_alloc_buffer(struct Image *img)
+{
+	size_t         stride = img_aligned_stride(img->width, img->channels, img->bitsperchannel);
+	unsigned char *buffer;
+
+	if (!(buffer = img_aligned_alloc(stride * img->height)))
+		return false;
+
+	img_replace_buffer(img, buffer, stride * img->height);
+	img->stride = stride;
+	return true;
+}
+
+/********************************************************
+ * 	img_view
+ *
+ * 	Create an image which shows the given region of
+ * 	parent, sharing parent's buffer. For packed
+ * 	1/2/4-bit indices, x must fall on a byte
+ * 	boundary.
+ *******************************************************/
+
+struct Image *img_view(struct Image *parent, int x, int y, int width, int height)
+{
+	struct Image *view;
+	size_t        xbits;
+
+	if (x < 0 || y < 0 || width < 1 || height < 1 || x > parent->width - width ||
+	    y > parent->height - height)
+	{
+		printf("view: region %dx%d+%d+%d outside of %dx%d image\n", width, height, x, y,
+		       parent->width, parent->height);
+		return NULL;
+	}
+
+	xbits = (size_t)x * parent->channels * parent->bitsperchannel;
+	if (xbits % 8)
+	{
+		printf("view: x=%d is not on a byte boundary\n", x);
+		return NULL;
+	}
+
+	if (!(view = malloc(sizeof *view)))
+	{
+		perror("view");
+		return NULL;
+	}
+	memset(view, 0, sizeof *view);
+
+	if (parent->palette)
+	{
+		if (!(view->palette = malloc(4 * (size_t)parent->numcolors)))
+		{
+			perror("view");
+			free(view);
+			return NULL;
+		}
+		memcpy(view->palette, parent->palette, 4 * (size_t)parent->numcolors);
+		view->numcolors = parent->numcolors;
+	}
+
+	if (!parent->shared)
+	{
+		if (!(parent->shared = malloc(sizeof *parent->shared)))
+		{
+			perror("view");
+			img_free(view);
+			return NULL;
+		}
+		parent->shared->refs    = 1;
+		parent->shared->block   = parent->mapping ? NULL : parent->buffer;
+		parent->shared->mapping = parent->mapping;
+		parent->shared->mapsize = parent->mapsize;
+		parent->shared->pooled  = parent->pooled;
+		parent->mapping         = NULL;
+		parent->mapsize         = 0;
+		parent->pooled          = false;
+	}
+
+	parent->shared->refs++;
+	view->shared         = parent->shared;
+	view->stride         = parent->stride;
+	view->buffer         = parent->buffer + (size_t)y * parent->stride + xbits / 8;
+	view->width          = width;
+	view->height         = height;
+	view->channels       = parent->channels;
+	view->bitsperchannel = parent->bitsperchannel;
+	view->buffersize     = (size_t)(height - 1) * view->stride +
+	                       ((size_t)width * view->channels * view->bitsperchannel + 7) / 8;
+	view->xdpi           = parent->xdpi;
+	view->ydpi           = parent->ydpi;
+	view->format         = parent->format;
+	view->orientation    = parent->orientation;
+
+	return view;
+}
+
+/********************************************************
+ * 	img_make_writable
+ *
+ * 	Must be called before modifying an image's
+ * 	pixels in place. If the buffer is shared with
+ * 	other images, the image gets its own copy.
+ *******************************************************/
+
+bool img_make_writable(struct Image *img)
+{
+	unsigned char *buffer;
+	size_t         stride, rowbytes;
+
+	if (!img->shared || img->shared->refs == 1)
+		return true;
+
+	rowbytes = img_rowbytes(img);
+	stride   = img_aligned_stride(img->width, img->channels, img->bitsperchannel);
+	if (!(buffer = img_aligned_alloc(stride * img->height)))
+	{
+		perror("copy shared image");
+		return false;
+	}
+	for (int y = 0; y < img->height; y++)
+	{
+		memcpy(buffer + (size_t)y * stride, img->buffer + (size_t)y * img->stride,
+		       rowbytes);
+	}
+
+	img_replace_buffer(img, buffer, stride * img->height);
+	img->stride = stride;
+	return true;
+}
@@ -17,22 +17,38 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#define IMG_ROW_ALIGN 64
+
+struct SharedBuffer
+{
+	int            refs;
+	unsigned char *block;   /* heap block to free(), or */
+	void          *mapping; /* mmap'ed region to unmap  */
+	size_t         mapsize;
+	bool           pooled;  /* block is from the buffer pool */
+};
+
 struct Image
 {
-	unsigned char *buffer;
-	size_t         buffersize;
-	unsigned char *palette;
-	int            numcolors;
-	unsigned char *iccprofile;
-	size_t         iccprofile_size;
-	int            width;
-	int            height;
-	int            channels;
-	int            bitsperchannel;
-	int            xdpi;
-	int            ydpi;
-	BMPFORMAT      format;
-	BMPORIENT      orientation;
+	unsigned char       *buffer;
+	size_t               buffersize;
+	size_t               stride;  /* bytes from one row start to the next */
+	unsigned char       *palette;
+	int                  numcolors;
+	unsigned char       *iccprofile;
+	size_t               iccprofile_size;
+	int                  width;
+	int                  height;
+	int                  channels;
+	int                  bitsperchannel;
+	int                  xdpi;
+	int                  ydpi;
+	BMPFORMAT            format;
+	BMPORIENT            orientation;
+	void                *mapping; /* if set, buffer points into this mmap'ed region, */
+	size_t               mapsize; /* which must be unmapped instead of freed         */
+	struct SharedBuffer *shared;  /* if set, buffer is shared with other images */
+	bool                 pooled;  /* buffer is from the buffer pool (see bufpool.c) */
 };
 
 bool          imgstack_push(struct Image *img);
@@ -41,4 +57,12 @@ bool          imgstack_swap(void);
 void          imgstack_delete(void);
 void          imgstack_clear(void);
 void          img_free(struct Image *img);
+bool          img_resize_buffer(struct Image *img, size_t newsize);
+void          img_replace_buffer(struct Image *img, unsigned char *buffer, size_t size);
+size_t        img_rowbytes(const struct Image *img);
+size_t        img_aligned_stride(int width, int channels, int bits);
+void         *img_aligned_alloc(size_t size);
+bool          img_alloc_buffer(struct Image *img);
+struct Image *img_view(struct Image *parent, int x, int y, int width, int height);
+bool          img_make_writable(struct Image *img);
 void          imgstack_destroy(void);
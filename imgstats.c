@@ -0,0 +1,279 @@
+/* bmplibtest - imgstats.c
+ *
+ * Copyright (c) 2025, Rupert Weber.
+ *
+ * This file is part of bmplibtest.
+ * bmplibtest is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include <bmplib.h>
+
+#include "defs.h"
+#include "imgstack.h"
+#include "imgstats.h"
+
+/* Image statistics
+ *
+ * Min, max, mean, standard deviation, and (optionally) a histogram per
+ * channel, collected in a single pass over the image. One kernel per
+ * sample type; accumulators are local and only written back per row, as
+ * in the compare kernels.
+ *
+ * Histograms of int8, int16, and s2.13 images have one bin per possible
+ * value. int32 and float images get HIST_BINS bins spanning 0..max resp.
+ * 0.0..1.0, values outside of that range are counted in the first/last
+ * bin.
+ */
+
+#define HIST_BINS 256
+
+struct Accum
+{
+	double min, max, sum, sumsq;
+};
+
+#define DEFINE_STATS_KERNEL(name, type, binexpr)                                      \
+	static void name(const unsigned char *row, int width, int channels,           \
+	                 struct Accum *acc, uint64_t *hist, int nbins)                \
+	{                                                                             \
+		const type *px = (const type *)row;                                   \
+		double      min[4], max[4], sum[4] = { 0 }, sumsq[4] = { 0 };         \
+                                                                                      \
+		for (int c = 0; c < channels; c++)                                    \
+		{                                                                     \
+			min[c] = acc[c].min;                                          \
+			max[c] = acc[c].max;                                          \
+		}                                                                     \
+                                                                                      \
+		for (int x = 0; x < width; x++)                                       \
+		{                                                                     \
+			for (int c = 0; c < channels; c++)                            \
+			{                                                             \
+				type   v = px[(size_t)x * channels + c];              \
+				double d = v;                                         \
+				min[c]   = d < min[c] ? d : min[c];                   \
+				max[c]   = d > max[c] ? d : max[c];                   \
+				sum[c]  += d;                                         \
+				sumsq[c] += d * d;                                    \
+				if (hist)                                             \
+					hist[(size_t)c * nbins + (binexpr)]++;        \
+			}                                                             \
+		}                                                                     \
+                                                                                      \
+		for (int c = 0; c < channels; c++)                                    \
+		{                                                                     \
+			acc[c].min    = min[c];                                       \
+			acc[c].max    = max[c];                                       \
+			acc[c].sum   += sum[c];                                       \
+			acc[c].sumsq += sumsq[c];                                     \
+		}                                                                     \
+	}
+
+static inline size_t float_bin(float v)
+{
+	if (!(v > 0.0f)) /* includes NaN */
+		return 0;
+	if (v >= 1.0f)
+		return HIST_BINS - 1;
+	return (size_t)(v * HIST_BINS);
+}
+
+DEFINE_STATS_KERNEL(stats_int8, uint8_t, v)
+DEFINE_STATS_KERNEL(stats_int16, uint16_t, v)
+DEFINE_STATS_KERNEL(stats_int32, uint32_t, v >> 24)
+DEFINE_STATS_KERNEL(stats_s2_13, int16_t, (uint16_t)(v + 32768))
+DEFINE_STATS_KERNEL(stats_float, float, float_bin(v))
+
+typedef void (*stats_kernel)(const unsigned char *row, int width, int channels,
+                             struct Accum *acc, uint64_t *hist, int nbins);
+
+/********************************************************
+ * 	imgstats_compute
+ *******************************************************/
+
+bool imgstats_compute(const struct Image *img, struct ImgStats *stats, bool histogram)
+{
+	struct Accum acc[4];
+	stats_kernel kernel;
+	double       unit     = 1.0;
+	int          channels = img->channels;
+
+	memset(stats, 0, sizeof *stats);
+
+	if (channels < 1 || channels > 4)
+	{
+		printf("stats: invalid number of channels %d\n", channels);
+		return false;
+	}
+
+	switch (img->format)
+	{
+	case BMP_FORMAT_FLOAT:
+		kernel          = stats_float;
+		stats->nbins    = HIST_BINS;
+		stats->binwidth = 1.0 / HIST_BINS;
+		break;
+
+	case BMP_FORMAT_S2_13:
+		kernel          = stats_s2_13;
+		unit            = 1.0 / 8192.0;
+		stats->nbins    = 0x10000;
+		stats->binstart = -4.0;
+		stats->binwidth = 1.0 / 8192.0;
+		break;
+
+	case BMP_FORMAT_INT:
+		switch (img->bitsperchannel)
+		{
+		case 8:
+			kernel          = stats_int8;
+			stats->nbins    = 0x100;
+			stats->binwidth = 1.0;
+			break;
+		case 16:
+			kernel          = stats_int16;
+			stats->nbins    = 0x10000;
+			stats->binwidth = 1.0;
+			break;
+		case 32:
+			kernel          = stats_int32;
+			stats->nbins    = HIST_BINS;
+			stats->binwidth = (double)(1UL << 24);
+			break;
+		default:
+			printf("stats: invalid bitsperchannel %d\n", img->bitsperchannel);
+			return false;
+		}
+		break;
+
+	default:
+		printf("stats: invalid format %d\n", (int)img->format);
+		return false;
+	}
+
+	if (histogram)
+	{
+		if (!(stats->hist = calloc((size_t)stats->nbins * channels, sizeof *stats->hist)))
+		{
+			perror("stats: histogram");
+			return false;
+		}
+	}
+
+	for (int c = 0; c < channels; c++)
+	{
+		acc[c].min   = INFINITY;
+		acc[c].max   = -INFINITY;
+		acc[c].sum   = 0.0;
+		acc[c].sumsq = 0.0;
+	}
+
+	for (int y = 0; y < img->height; y++)
+		kernel(img->buffer + (size_t)y * img->stride, img->width, channels, acc, stats->hist,
+		       stats->nbins);
+
+	stats->channels = channels;
+	stats->pixels   = (uint64_t)img->width * img->height;
+
+	for (int c = 0; c < channels; c++)
+	{
+		double n    = (double)stats->pixels;
+		double mean = n > 0 ? acc[c].sum / n : 0.0;
+		double var  = n > 0 ? acc[c].sumsq / n - mean * mean : 0.0;
+
+		stats->min[c]    = acc[c].min * unit;
+		stats->max[c]    = acc[c].max * unit;
+		stats->mean[c]   = mean * unit;
+		stats->stddev[c] = sqrt(var > 0.0 ? var : 0.0) * unit;
+	}
+	return true;
+}
+
+/********************************************************
+ * 	imgstats_write_histogram
+ *
+ * 	Text file, one line per non-empty bin:
+ * 	<bin start value> <count ch0> <count ch1> ...
+ *******************************************************/
+
+bool imgstats_write_histogram(const struct ImgStats *stats, const char *path)
+{
+	FILE *file;
+	bool  ok = true;
+
+	if (!stats->hist)
+		return false;
+
+	if (!(file = fopen(path, "w")))
+	{
+		perror(path);
+		return false;
+	}
+
+	fprintf(file, "# value");
+	for (int c = 0; c < stats->channels; c++)
+		fprintf(file, " ch%d", c);
+	fprintf(file, "\n");
+
+	for (int bin = 0; bin < stats->nbins; bin++)
+	{
+		bool empty = true;
+
+		for (int c = 0; c < stats->channels; c++)
+			empty = empty && !stats->hist[(size_t)c * stats->nbins + bin];
+		if (empty)
+			continue;
+
+		fprintf(file, "%.10g", stats->binstart + bin * stats->binwidth);
+		for (int c = 0; c < stats->channels; c++)
+			fprintf(file, " %llu",
+			        (unsigned long long)stats->hist[(size_t)c * stats->nbins + bin]);
+		fprintf(file, "\n");
+	}
+
+	if (ferror(file))
+	{
+		perror(path);
+		ok = false;
+	}
+	if (fclose(file))
+		ok = false;
+	return ok;
+}
+
+/********************************************************
+ * 	imgstats_print
+ *******************************************************/
+
+void imgstats_print(const struct ImgStats *stats)
+{
+	for (int c = 0; c < stats->channels; c++)
+	{
+		printf("stats: channel %d: min %g, max %g, mean %g, stddev %g\n", c,
+		       stats->min[c], stats->max[c], stats->mean[c], stats->stddev[c]);
+	}
+}
+
+void imgstats_free(struct ImgStats *stats)
+{
+	free(stats->hist);
+	stats->hist = NULL;
+}
@@ -0,0 +1,37 @@
+/* bmplibtest - imgstats.h
+ *
+ * Copyright (c) 2025, Rupert Weber.
+ *
+ * This file is part of bmplibtest.
+ * bmplibtest is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+struct ImgStats
+{
+	int       channels;
+	uint64_t  pixels;
+	double    min[4];   /* all values in image units: int as integers, */
+	double    max[4];   /* float and s2.13 as real values              */
+	double    mean[4];
+	double    stddev[4];
+	int       nbins;
+	double    binstart; /* value of the first bin and width of each bin */
+	double    binwidth;
+	uint64_t *hist;     /* nbins per channel, channel-major; NULL if not requested */
+};
+
+bool imgstats_compute(const struct Image *img, struct ImgStats *stats, bool histogram);
+bool imgstats_write_histogram(const struct ImgStats *stats, const char *path);
+void imgstats_print(const struct ImgStats *stats);
+void imgstats_free(struct ImgStats *stats);
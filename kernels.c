@@ -0,0 +1,546 @@
+/* bmplibtest - kernels.c
+ *
+ * Copyright (c) 2025, Rupert Weber.
+ *
+ * This file is part of bmplibtest.
+ * bmplibtest is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include <bmplib.h>
+
+#include "defs.h"
+#include "imgstack.h"
+#include "kernels.h"
+
+/* Pixel kernels
+ *
+ * Each operation is instantiated once per sample type (and, for the
+ * per-pixel operations, per number of channels) by the macros below, so
+ * the inner loops contain no switch on format or bit depth. The matching
+ * instance is looked up once per image.
+ *
+ * Sample types are listed in SAMPLE_TYPES() as
+ *   X(name, storage type, load function, store function)
+ * where load/store convert between the stored value and the nominal
+ * double value (0..1 for int).
+ */
+
+enum SampleKind
+{
+	KIND_INT8,
+	KIND_INT16,
+	KIND_INT32,
+	KIND_S2_13,
+	KIND_FLOAT,
+	NUM_KINDS
+};
+
+static int sample_kind(BMPFORMAT format, int bits)
+{
+	switch (format)
+	{
+	case BMP_FORMAT_FLOAT:
+		return bits == 32 ? KIND_FLOAT : -1;
+	case BMP_FORMAT_S2_13:
+		return bits == 16 ? KIND_S2_13 : -1;
+	case BMP_FORMAT_INT:
+		switch (bits)
+		{
+		case 8 : return KIND_INT8;
+		case 16: return KIND_INT16;
+		case 32: return KIND_INT32;
+		}
+		break;
+	}
+	return -1;
+}
+
+static inline double load_int8(uint8_t v)   { return v / (double)0xffU; }
+static inline double load_int16(uint16_t v) { return v / (double)0xffffU; }
+static inline double load_int32(uint32_t v) { return v / (double)0xffffffffUL; }
+static inline double load_float(float v)    { return v; }
+
+static inline uint8_t  store_int8(double d)  { return (uint8_t)(d * (double)0xffU + 0.5); }
+static inline uint16_t store_int16(double d) { return (uint16_t)(d * (double)0xffffU + 0.5); }
+static inline uint32_t store_int32(double d) { return (uint32_t)(d * (double)0xffffffffUL + 0.5); }
+static inline float    store_float(double d) { return (float)d; }
+
+/* s2.13
+ *
+ * All conversions to s2.13 saturate to [-4, 4 - 1/8192] before rounding,
+ * so values just below 4.0 no longer wrap around to -4.0. The helpers
+ * work on float resp. integers only. The generic kernels load and store
+ * s2.13 through the float helpers as well, every s2.13 value is exact in
+ * a float.
+ */
+
+static inline uint16_t s2_13_from_float(float f)
+{
+	f *= 8192.0f;
+	f  = f < -32768.0f ? -32768.0f : (f > 32767.0f ? 32767.0f : f);
+	return (uint16_t)(int16_t)roundf(f);
+}
+
+static inline float s2_13_to_float(uint16_t v)
+{
+	return (int16_t)v * (1.0f / 8192.0f);
+}
+
+static inline double   load_s2_13(uint16_t v) { return s2_13_to_float(v); }
+static inline uint16_t store_s2_13(double d)  { return s2_13_from_float((float)d); }
+
+/* s2.13 to int: negative values clip to 0, values above 1.0 to max. */
+
+static inline int32_t s2_13_clip01(uint16_t v)
+{
+	int32_t i = (int16_t)v;
+
+	return i < 0 ? 0 : (i > 8192 ? 8192 : i);
+}
+
+static inline uint8_t s2_13_to_int8(uint16_t v)
+{
+	return (uint8_t)((s2_13_clip01(v) * 0xff + 4096) >> 13);
+}
+
+static inline uint16_t s2_13_to_int16(uint16_t v)
+{
+	return (uint16_t)((s2_13_clip01(v) * 0xffff + 4096) >> 13);
+}
+
+/* int to s2.13: round(v * 8192 / max), in integer math */
+
+static inline uint16_t int8_to_s2_13(uint8_t v)
+{
+	return (uint16_t)(((uint32_t)v * 16384 + 0xff) / (2 * 0xff));
+}
+
+static inline uint16_t int16_to_s2_13(uint16_t v)
+{
+	return (uint16_t)(((uint32_t)v * 16384 + 0xffff) / (2 * 0xffff));
+}
+
+#define SAMPLE_TYPES(X, ...)                                                  \
+	X(__VA_ARGS__, int8, uint8_t, load_int8, store_int8)                  \
+	X(__VA_ARGS__, int16, uint16_t, load_int16, store_int16)              \
+	X(__VA_ARGS__, int32, uint32_t, load_int32, store_int32)              \
+	X(__VA_ARGS__, s2_13, uint16_t, load_s2_13, store_s2_13)              \
+	X(__VA_ARGS__, float, float, load_float, store_float)
+
+/* same list again, for nesting (macros don't expand recursively) */
+#define SAMPLE_TYPES_DST(X, ...)                                              \
+	X(__VA_ARGS__, int8, uint8_t, load_int8, store_int8)                  \
+	X(__VA_ARGS__, int16, uint16_t, load_int16, store_int16)              \
+	X(__VA_ARGS__, int32, uint32_t, load_int32, store_int32)              \
+	X(__VA_ARGS__, s2_13, uint16_t, load_s2_13, store_s2_13)              \
+	X(__VA_ARGS__, float, float, load_float, store_float)
+
+/* Per-pixel operations on the color channels (alpha is left alone).
+ * OP(d, args) maps a nominal value to a new one.
+ */
+
+struct OpArgs
+{
+	double factor;
+	double lo, hi; /* clamp range */
+};
+
+typedef void (*pixel_kernel)(unsigned char *buffer, size_t npixels,
+                             const struct OpArgs *args);
+
+static inline double op_to_linear(double d, const struct OpArgs *args)
+{
+	(void)args;
+	if (d <= 0.04045)
+		return d / 12.92;
+	return pow((d + 0.055) / 1.055, 2.4);
+}
+
+static inline double op_to_srgb(double d, const struct OpArgs *args)
+{
+	(void)args;
+	if (d <= 0.0031308)
+		return d * 12.92;
+	return 1.055 * pow(d, 1.0 / 2.4) - 0.055;
+}
+
+/* clamping with +/-INFINITY as limits is a no-op, NaNs pass through */
+static inline double op_scale(double d, const struct OpArgs *args)
+{
+	d *= args->factor;
+	return d < args->lo ? args->lo : (d > args->hi ? args->hi : d);
+}
+
+#define DEFINE_PIXEL_KERNEL_CH(op, name, type, load, store, ch, colorch)                \
+	static void op##_##name##_##ch(unsigned char *buffer, size_t npixels,           \
+	                               const struct OpArgs *args)                       \
+	{                                                                               \
+		type *buf = (type *)buffer;                                             \
+                                                                                        \
+		for (size_t px = 0; px < npixels; px++)                                 \
+		{                                                                       \
+			for (int c = 0; c < (colorch); c++)                             \
+			{                                                               \
+				size_t i = px * (ch) + c;                               \
+				buf[i]   = store(op(load(buf[i]), args));               \
+			}                                                               \
+		}                                                                       \
+	}
+
+#define DEFINE_PIXEL_KERNEL(op, name, type, load, store)                         \
+	DEFINE_PIXEL_KERNEL_CH(op, name, type, load, store, 1, 1)                \
+	DEFINE_PIXEL_KERNEL_CH(op, name, type, load, store, 2, 1)                \
+	DEFINE_PIXEL_KERNEL_CH(op, name, type, load, store, 3, 3)                \
+	DEFINE_PIXEL_KERNEL_CH(op, name, type, load, store, 4, 3)
+
+#define PIXEL_KERNEL_ENTRY(op, name, type, load, store)                          \
+	{ op##_##name##_1, op##_##name##_2, op##_##name##_3, op##_##name##_4 },
+
+SAMPLE_TYPES(DEFINE_PIXEL_KERNEL, op_to_linear)
+SAMPLE_TYPES(DEFINE_PIXEL_KERNEL, op_to_srgb)
+SAMPLE_TYPES(DEFINE_PIXEL_KERNEL, op_scale)
+
+static const pixel_kernel to_linear_kernels[NUM_KINDS][4] = {
+	SAMPLE_TYPES(PIXEL_KERNEL_ENTRY, op_to_linear)
+};
+static const pixel_kernel to_srgb_kernels[NUM_KINDS][4] = {
+	SAMPLE_TYPES(PIXEL_KERNEL_ENTRY, op_to_srgb)
+};
+static const pixel_kernel scale_kernels[NUM_KINDS][4] = {
+	SAMPLE_TYPES(PIXEL_KERNEL_ENTRY, op_scale)
+};
+
+/* LUT kernels
+ *
+ * For int8 and int16 images, any per-sample operation can be
+ * precomputed for all possible values. The LUT is filled with the same
+ * load/op/store as the direct kernels, so results are exactly the same.
+ */
+
+typedef void (*lut_kernel)(unsigned char *buffer, size_t npixels, const void *lut);
+
+#define DEFINE_LUT_KERNEL_CH(name, type, ch, colorch)                                 \
+	static void name##_##ch(unsigned char *buffer, size_t npixels, const void *lut) \
+	{                                                                             \
+		type       *buf = (type *)buffer;                                     \
+		const type *tab = lut;                                                \
+                                                                                      \
+		for (size_t px = 0; px < npixels; px++)                               \
+		{                                                                     \
+			for (int c = 0; c < (colorch); c++)                           \
+			{                                                             \
+				size_t i = px * (ch) + c;                             \
+				buf[i]   = tab[buf[i]];                               \
+			}                                                             \
+		}                                                                     \
+	}
+
+#define DEFINE_LUT_KERNEL(name, type)                                                 \
+	DEFINE_LUT_KERNEL_CH(name, type, 1, 1)                                        \
+	DEFINE_LUT_KERNEL_CH(name, type, 2, 1)                                        \
+	DEFINE_LUT_KERNEL_CH(name, type, 3, 3)                                        \
+	DEFINE_LUT_KERNEL_CH(name, type, 4, 3)
+
+DEFINE_LUT_KERNEL(lut_int8, uint8_t)
+DEFINE_LUT_KERNEL(lut_int16, uint16_t)
+
+static const lut_kernel lut_int8_kernels[4]  = { lut_int8_1, lut_int8_2, lut_int8_3, lut_int8_4 };
+static const lut_kernel lut_int16_kernels[4] = { lut_int16_1, lut_int16_2, lut_int16_3, lut_int16_4 };
+
+static bool check_pixel_format(const struct Image *img, const char *what, int *kind)
+{
+	*kind = sample_kind(img->format, img->bitsperchannel);
+
+	if (*kind < 0 || img->channels < 1 || img->channels > 4)
+	{
+		printf("%s: invalid format/bits/channels (%d/%d/%d)\n", what,
+		       (int)img->format, img->bitsperchannel, img->channels);
+		return false;
+	}
+	return true;
+}
+
+/* Rows are processed one at a time, unless they are contiguous
+ * (stride == row size), in which case the whole image is one run.
+ */
+
+static size_t row_runs(const struct Image *img, size_t *npixels)
+{
+	if (img->stride == img_rowbytes(img))
+	{
+		*npixels = (size_t)img->width * img->height;
+		return 1;
+	}
+	*npixels = (size_t)img->width;
+	return (size_t)img->height;
+}
+
+static bool run_pixel_kernel(struct Image *img, const pixel_kernel (*table)[4],
+                             const struct OpArgs *args, const char *what)
+{
+	pixel_kernel kernel;
+	size_t       nruns, npixels;
+	int          kind;
+
+	if (!check_pixel_format(img, what, &kind) || !img_make_writable(img))
+		return false;
+
+	kernel = table[kind][img->channels - 1];
+	nruns  = row_runs(img, &npixels);
+	for (size_t r = 0; r < nruns; r++)
+		kernel(img->buffer + r * img->stride, npixels, args);
+	return true;
+}
+
+static void run_lut_kernel(struct Image *img, lut_kernel kernel, const void *lut)
+{
+	size_t nruns, npixels;
+
+	nruns = row_runs(img, &npixels);
+	for (size_t r = 0; r < nruns; r++)
+		kernel(img->buffer + r * img->stride, npixels, lut);
+}
+
+/********************************************************
+ * 	kernel_gamma
+ *
+ * 	Convert the color channels between sRGB and
+ * 	linear gamma.
+ *******************************************************/
+
+bool kernel_gamma(struct Image *img, bool to_linear)
+{
+	return run_pixel_kernel(img, to_linear ? to_linear_kernels : to_srgb_kernels,
+	                        NULL, "convertgamma");
+}
+
+/********************************************************
+ * 	kernel_exposure
+ *
+ * 	Multiply the color channels by factor.
+ * 	int images always saturate at 0..max, float
+ * 	and s2.13 images are clipped to 0..1 only if
+ * 	clip is set (s2.13 otherwise saturates at the
+ * 	limits of its range).
+ *******************************************************/
+
+bool kernel_exposure(struct Image *img, double factor, bool clip)
+{
+	struct OpArgs args = { .factor = factor, .lo = 0.0, .hi = 1.0 };
+	int           kind;
+
+	if (!check_pixel_format(img, "exposure", &kind) || !img_make_writable(img))
+		return false;
+
+	switch (kind)
+	{
+	case KIND_INT8:
+	{
+		uint8_t lut[0x100];
+
+		for (unsigned v = 0; v <= 0xff; v++)
+			lut[v] = store_int8(op_scale(load_int8(v), &args));
+		run_lut_kernel(img, lut_int8_kernels[img->channels - 1], lut);
+		return true;
+	}
+
+	case KIND_INT16:
+	{
+		static uint16_t lut[0x10000]; /* too big for the stack */
+
+		for (unsigned v = 0; v <= 0xffff; v++)
+			lut[v] = store_int16(op_scale(load_int16(v), &args));
+		run_lut_kernel(img, lut_int16_kernels[img->channels - 1], lut);
+		return true;
+	}
+
+	case KIND_S2_13:
+		if (!clip)
+		{
+			args.lo = -4.0;
+			args.hi = 4.0;
+		}
+		break;
+
+	case KIND_FLOAT:
+		if (!clip)
+		{
+			args.lo = -INFINITY;
+			args.hi = INFINITY;
+		}
+		break;
+	}
+
+	return run_pixel_kernel(img, scale_kernels, &args, "exposure");
+}
+
+/* Format conversion
+ *
+ * One kernel per (source, target) pair, converting one run of samples.
+ * Source and destination may be the same memory: the loop goes front to
+ * back if the samples shrink or keep their size, otherwise back to front.
+ */
+
+typedef void (*convert_kernel)(unsigned char *dstbuf, const unsigned char *srcbuf,
+                               size_t nvals);
+
+#define DEFINE_CONVERT_LOOP(fname, stype, dtype, expr)                             \
+	static void fname(unsigned char *dstbuf, const unsigned char *srcbuf,      \
+	                  size_t nvals)                                             \
+	{                                                                           \
+		const stype *src = (const stype *)srcbuf;                           \
+		dtype       *dst = (dtype *)dstbuf;                                 \
+		stype        v;                                                     \
+                                                                                    \
+		if (sizeof(dtype) <= sizeof(stype))                                 \
+		{                                                                   \
+			for (size_t i = 0; i < nvals; i++)                          \
+			{                                                           \
+				v      = src[i];                                    \
+				dst[i] = (expr);                                    \
+			}                                                           \
+		}                                                                   \
+		else                                                                \
+		{                                                                   \
+			for (size_t i = nvals; i > 0; i--)                          \
+			{                                                           \
+				v          = src[i - 1];                            \
+				dst[i - 1] = (expr);                                \
+			}                                                           \
+		}                                                                   \
+	}
+
+#define DEFINE_CONVERT_KERNEL(sname, stype, sload, sstore, dname, dtype, dload, dstore) \
+	DEFINE_CONVERT_LOOP(convert_##sname##_to_##dname, stype, dtype, dstore(sload(v)))
+
+#define DEFINE_CONVERT_FROM(unused, sname, stype, sload, sstore)                 \
+	SAMPLE_TYPES_DST(DEFINE_CONVERT_KERNEL, sname, stype, sload, sstore)
+
+#define CONVERT_ENTRY(sname, stype, sload, sstore, dname, dtype, dload, dstore)  \
+	convert_##sname##_to_##dname,
+
+#define CONVERT_ROW(unused, sname, stype, sload, sstore)                         \
+	{ SAMPLE_TYPES_DST(CONVERT_ENTRY, sname, stype, sload, sstore) },
+
+SAMPLE_TYPES(DEFINE_CONVERT_FROM, 0)
+
+static const convert_kernel convert_kernels[NUM_KINDS][NUM_KINDS] = {
+	SAMPLE_TYPES(CONVERT_ROW, 0)
+};
+
+/* direct s2.13 conversions, bypassing double */
+
+DEFINE_CONVERT_LOOP(fast_float_to_s2_13, float, uint16_t, s2_13_from_float(v))
+DEFINE_CONVERT_LOOP(fast_s2_13_to_float, uint16_t, float, s2_13_to_float(v))
+DEFINE_CONVERT_LOOP(fast_s2_13_to_int8, uint16_t, uint8_t, s2_13_to_int8(v))
+DEFINE_CONVERT_LOOP(fast_s2_13_to_int16, uint16_t, uint16_t, s2_13_to_int16(v))
+DEFINE_CONVERT_LOOP(fast_int8_to_s2_13, uint8_t, uint16_t, int8_to_s2_13(v))
+DEFINE_CONVERT_LOOP(fast_int16_to_s2_13, uint16_t, uint16_t, int16_to_s2_13(v))
+
+static const struct
+{
+	int            from, to;
+	convert_kernel kernel;
+} fast_converts[] = {
+	{ KIND_FLOAT, KIND_S2_13, fast_float_to_s2_13 },
+	{ KIND_S2_13, KIND_FLOAT, fast_s2_13_to_float },
+	{ KIND_S2_13, KIND_INT8, fast_s2_13_to_int8 },
+	{ KIND_S2_13, KIND_INT16, fast_s2_13_to_int16 },
+	{ KIND_INT8, KIND_S2_13, fast_int8_to_s2_13 },
+	{ KIND_INT16, KIND_S2_13, fast_int16_to_s2_13 },
+};
+
+/********************************************************
+ * 	kernel_convert
+ *
+ * 	Convert the image samples to the given format
+ * 	in place. If the samples grow, the buffer is
+ * 	grown to aligned rows first (never shrinking
+ * 	the stride, so new rows never start before the
+ * 	old ones) and the rows are converted back to
+ * 	front. Otherwise, rows are converted front to
+ * 	back, keeping the stride unless the rows were
+ * 	contiguous (then they stay contiguous).
+ *******************************************************/
+
+bool kernel_convert(struct Image *img, BMPFORMAT format, int bits)
+{
+	int            from = sample_kind(img->format, img->bitsperchannel);
+	int            to   = sample_kind(format, bits);
+	convert_kernel kernel;
+	size_t         nruns, npixels, nvals;
+
+	if (from < 0 || to < 0)
+	{
+		printf("convertformat: invalid format/bits (%d/%d -> %d/%d)\n",
+		       (int)img->format, img->bitsperchannel, (int)format, bits);
+		return false;
+	}
+
+	kernel = convert_kernels[from][to];
+	for (size_t i = 0; i < ARRAY_SIZE(fast_converts); i++)
+	{
+		if (fast_converts[i].from == from && fast_converts[i].to == to)
+			kernel = fast_converts[i].kernel;
+	}
+
+	/* views share their buffer, growing it in place would overwrite the
+	 * other images' pixels just as well
+	 */
+	if (!img_make_writable(img))
+		return false;
+
+	if (bits > img->bitsperchannel)
+	{
+		size_t oldstride = img->stride;
+		size_t newstride = MAX(oldstride, img_aligned_stride(img->width, img->channels, bits));
+
+		if (!img_resize_buffer(img, newstride * img->height))
+		{
+			perror("convertformat");
+			return false;
+		}
+		nvals = (size_t)img->width * img->channels;
+		for (size_t y = img->height; y > 0; y--)
+		{
+			kernel(img->buffer + (y - 1) * newstride,
+			       img->buffer + (y - 1) * oldstride, nvals);
+		}
+		img->stride = newstride;
+	}
+	else
+	{
+		nruns = row_runs(img, &npixels);
+		nvals = npixels * img->channels;
+		for (size_t r = 0; r < nruns; r++)
+		{
+			unsigned char *row = img->buffer + r * img->stride;
+			kernel(row, row, nvals);
+		}
+		/* a single run over contiguous rows leaves them packed */
+		if (nruns == 1)
+			img->stride = ((size_t)img->width * img->channels * bits + 7) / 8;
+	}
+
+	img->format         = format;
+	img->bitsperchannel = bits;
+	return true;
+}
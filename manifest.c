@@ -0,0 +1,256 @@
+/* bmplibtest - manifest.c
+ *
+ * Copyright (c) 2025, Rupert Weber.
+ *
+ * This file is part of bmplibtest.
+ * bmplibtest is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include "manifest.h"
+
+/* Hash manifest
+ *
+ * Plain text file, one entry per line:
+ *
+ *     <16 hex digits> <key>
+ *
+ * The key is the rest of the line (usually the test description).
+ * Empty lines and lines starting with '#' are ignored. Entries are
+ * kept in file order, so that a blessed manifest diffs cleanly;
+ * new keys are appended.
+ */
+
+struct Entry
+{
+	uint64_t hash;
+	char    *key;
+};
+
+static struct Entry *entries   = NULL;
+static int           nentries  = 0;
+static int           allocated = 0;
+static bool          modified  = false;
+
+static bool add_entry(const char *key, size_t keylen, uint64_t hash);
+
+/********************************************************
+ * 	manifest_load
+ *
+ * 	A missing manifest file is not an error, it
+ * 	is simply treated as empty.
+ *******************************************************/
+
+bool manifest_load(const char *path)
+{
+	FILE *file;
+	char  line[512];
+	int   linenum = 0;
+	bool  ok      = true;
+
+	manifest_free();
+
+	if (!(file = fopen(path, "r")))
+		return true;
+
+	while (fgets(line, sizeof line, file))
+	{
+		char    *p, *endptr;
+		size_t   len;
+		uint64_t hash;
+
+		linenum++;
+		len = strlen(line);
+		if (len && line[len - 1] != '\n' && !feof(file))
+		{
+			printf("%s:%d: line too long\n", path, linenum);
+			ok = false;
+			break;
+		}
+		while (len && strchr("\r\n \t", line[len - 1]))
+			line[--len] = 0;
+
+		p = line;
+		while (*p == ' ' || *p == '\t')
+			p++;
+		if (!*p || *p == '#')
+			continue;
+
+		hash = strtoull(p, &endptr, 16);
+		if (endptr - p != 16 || !(*endptr == ' ' || *endptr == '\t'))
+		{
+			printf("%s:%d: invalid manifest entry\n", path, linenum);
+			ok = false;
+			break;
+		}
+		p = endptr;
+		while (*p == ' ' || *p == '\t')
+			p++;
+		if (!*p)
+		{
+			printf("%s:%d: manifest entry without key\n", path, linenum);
+			ok = false;
+			break;
+		}
+		if (!add_entry(p, strlen(p), hash))
+		{
+			ok = false;
+			break;
+		}
+	}
+	fclose(file);
+
+	if (!ok)
+		manifest_free();
+	return ok;
+}
+
+/********************************************************
+ * 	manifest_lookup
+ *******************************************************/
+
+bool manifest_lookup(const char *key, uint64_t *hash)
+{
+	for (int i = 0; i < nentries; i++)
+	{
+		if (!strcmp(entries[i].key, key))
+		{
+			*hash = entries[i].hash;
+			return true;
+		}
+	}
+	return false;
+}
+
+/********************************************************
+ * 	manifest_set
+ *******************************************************/
+
+bool manifest_set(const char *key, uint64_t hash)
+{
+	if (strchr(key, '\n') || strchr(key, '\r'))
+	{
+		printf("manifest: key must not contain line breaks: '%s'\n", key);
+		return false;
+	}
+
+	for (int i = 0; i < nentries; i++)
+	{
+		if (!strcmp(entries[i].key, key))
+		{
+			if (entries[i].hash != hash)
+			{
+				entries[i].hash = hash;
+				modified        = true;
+			}
+			return true;
+		}
+	}
+
+	if (!add_entry(key, strlen(key), hash))
+		return false;
+	modified = true;
+	return true;
+}
+
+/********************************************************
+ * 	manifest_save
+ *
+ * 	Only writes the file if entries were changed
+ * 	since it was loaded.
+ *******************************************************/
+
+bool manifest_save(const char *path)
+{
+	FILE *file;
+	bool  ok = true;
+
+	if (!modified)
+		return true;
+
+	if (!(file = fopen(path, "w")))
+	{
+		perror(path);
+		return false;
+	}
+
+	for (int i = 0; i < nentries; i++)
+	{
+		if (0 > fprintf(file, "%016" PRIx64 " %s\n", entries[i].hash, entries[i].key))
+		{
+			ok = false;
+			break;
+		}
+	}
+	if (fclose(file))
+		ok = false;
+
+	if (!ok)
+		perror(path);
+	else
+		modified = false;
+	return ok;
+}
+
+/********************************************************
+ * 	manifest_free
+ *******************************************************/
+
+void manifest_free(void)
+{
+	for (int i = 0; i < nentries; i++)
+		free(entries[i].key);
+	free(entries);
+	entries   = NULL;
+	nentries  = 0;
+	allocated = 0;
+	modified  = false;
+}
+
+static bool add_entry(const char *key, size_t keylen, uint64_t hash)
+{
+	char *dup;
+
+	if (nentries == allocated)
+	{
+		struct Entry *tmp;
+		int           newsize = allocated ? 2 * allocated : 32;
+
+		if (!(tmp = realloc(entries, newsize * sizeof *entries)))
+		{
+			perror("realloc manifest");
+			return false;
+		}
+		entries   = tmp;
+		allocated = newsize;
+	}
+
+	if (!(dup = malloc(keylen + 1)))
+	{
+		perror("malloc manifest key");
+		return false;
+	}
+	memcpy(dup, key, keylen);
+	dup[keylen] = 0;
+
+	entries[nentries].hash  = hash;
+	entries[nentries].key   = dup;
+	nentries++;
+	return true;
+}
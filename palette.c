@@ -0,0 +1,449 @@
+/* bmplibtest - palette.c
+ *
+ * Copyright (c) 2025, Rupert Weber.
+ *
+ * This file is part of bmplibtest.
+ * bmplibtest is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <bmplib.h>
+
+#include "defs.h"
+#include "imgstack.h"
+#include "palette.h"
+
+#define MAX_PIXEL_SIZE 16 /* 4 channels of 32 bits */
+#define INDEX_TILE     1024
+
+/* Palette expansion
+ *
+ * The palette is expanded once into a table of complete output pixels
+ * (in the target format, including alpha), so flattening an image is a
+ * single table lookup and a fixed-size copy per pixel. The copy loops are
+ * instantiated per pixel size, letting the compiler turn them into plain
+ * loads/stores (or gathers, where available).
+ *
+ * Indices with less than 8 bits are unpacked tile-wise into a small
+ * 8-bit index buffer first. Rows of packed indices start on a byte
+ * boundary, most significant bits first (as in BMP files).
+ */
+
+static void build_lut(const struct Image *img, const struct FlattenOpts *opts,
+                      unsigned char *lut, int outch)
+{
+	int pxsize = outch * opts->bits / 8;
+
+	for (int i = 0; i < 256; i++)
+	{
+		unsigned char *px = lut + (size_t)i * pxsize;
+
+		for (int c = 0; c < outch; c++)
+		{
+			unsigned v = 0xff; /* alpha */
+
+			if (c < 3)
+				v = i < img->numcolors ? img->palette[4 * i + c] : 0;
+
+			if (opts->format == BMP_FORMAT_FLOAT)
+			{
+				float f = v / 255.0f;
+				memcpy(px + 4 * c, &f, sizeof f);
+			}
+			else if (opts->bits == 16)
+			{
+				uint16_t u = (uint16_t)(v * 0x101U);
+				memcpy(px + 2 * c, &u, sizeof u);
+			}
+			else
+			{
+				px[c] = (unsigned char)v;
+			}
+		}
+	}
+}
+
+#define DEFINE_GATHER(name, size)                                                     \
+	static void name(const uint8_t *idx, size_t n, const unsigned char *lut,     \
+	                 unsigned char *dst)                                          \
+	{                                                                             \
+		for (size_t i = 0; i < n; i++)                                        \
+			memcpy(dst + i * (size), lut + (size_t)idx[i] * (size), (size));  \
+	}
+
+DEFINE_GATHER(gather_3, 3)
+DEFINE_GATHER(gather_4, 4)
+DEFINE_GATHER(gather_6, 6)
+DEFINE_GATHER(gather_8, 8)
+DEFINE_GATHER(gather_12, 12)
+DEFINE_GATHER(gather_16, 16)
+
+typedef void (*gather_fn)(const uint8_t *idx, size_t n, const unsigned char *lut,
+                          unsigned char *dst);
+
+static gather_fn gather_for_size(int pxsize)
+{
+	switch (pxsize)
+	{
+	case 3 : return gather_3;
+	case 4 : return gather_4;
+	case 6 : return gather_6;
+	case 8 : return gather_8;
+	case 12: return gather_12;
+	case 16: return gather_16;
+	}
+	printf("flatten: invalid pixel size %d\n", pxsize);
+	exit(1);
+}
+
+static void unpack_indices(const unsigned char *src, int bits, int x0, int n, uint8_t *idx)
+{
+	unsigned mask = (1U << bits) - 1;
+
+	for (int i = 0; i < n; i++)
+	{
+		size_t pos   = (size_t)(x0 + i) * bits;
+		int    shift = 8 - bits - (int)(pos & 7);
+
+		idx[i] = (src[pos >> 3] >> shift) & mask;
+	}
+}
+
+/********************************************************
+ * 	palette_flatten
+ *
+ * 	Convert an indexed image (1/2/4/8-bit indices)
+ * 	to RGB or RGBA in the given format.
+ *******************************************************/
+
+bool palette_flatten(struct Image *img, const struct FlattenOpts *opts)
+{
+	union {
+		unsigned char b[256 * MAX_PIXEL_SIZE];
+		uint32_t      align;
+	} lut;
+	uint8_t        idx[INDEX_TILE];
+	int            outch    = opts->alpha ? 4 : 3;
+	int            pxsize   = outch * opts->bits / 8;
+	int            idxbits  = img->bitsperchannel;
+	size_t         stride   = img_aligned_stride(img->width, outch, opts->bits);
+	size_t         newsize  = stride * img->height;
+	unsigned char *newbuf;
+	gather_fn      gather;
+
+	if (!(img->palette && img->channels == 1))
+	{
+		printf("flatten: image is not indexed\n");
+		return false;
+	}
+
+	switch (idxbits)
+	{
+	case 1:
+	case 2:
+	case 4:
+	case 8:
+		break;
+	default:
+		printf("flatten: invalid index size %d\n", idxbits);
+		return false;
+	}
+
+	gather = gather_for_size(pxsize);
+	build_lut(img, opts, lut.b, outch);
+
+	if (!(newbuf = img_aligned_alloc(newsize)))
+	{
+		perror("flatten");
+		return false;
+	}
+
+	for (int y = 0; y < img->height; y++)
+	{
+		const unsigned char *src = img->buffer + (size_t)y * img->stride;
+		unsigned char       *dst = newbuf + (size_t)y * stride;
+
+		if (idxbits == 8)
+		{
+			gather(src, img->width, lut.b, dst);
+			continue;
+		}
+
+		for (int x = 0; x < img->width; x += INDEX_TILE)
+		{
+			int n = MIN(INDEX_TILE, img->width - x);
+
+			unpack_indices(src, idxbits, x, n, idx);
+			gather(idx, n, lut.b, dst + (size_t)x * pxsize);
+		}
+	}
+
+	img_replace_buffer(img, newbuf, newsize);
+	img->stride = stride;
+	free(img->palette);
+	img->palette        = NULL;
+	img->numcolors      = 0;
+	img->channels       = outch;
+	img->bitsperchannel = opts->bits;
+	img->format         = opts->format;
+	return true;
+}
+
+/* Palette remapping
+ *
+ * Any reordering of the palette is expressed as an index LUT (old index
+ * -> new index), so the index plane is rewritten in a single pass of
+ * table lookups, independent of the order chosen.
+ * Packed 1/2/4-bit indices are handled with the same loop: the index LUT
+ * is first turned into a LUT over whole bytes, which remaps all indices
+ * packed into a byte at once.
+ */
+
+struct SortKey
+{
+	double key;
+	int    index;
+};
+
+static int cmp_sortkey(const void *a, const void *b)
+{
+	const struct SortKey *ka = a, *kb = b;
+
+	if (ka->key != kb->key)
+		return ka->key < kb->key ? -1 : 1;
+	return ka->index - kb->index; /* keep sort stable */
+}
+
+static void count_indices(const struct Image *img, uint64_t *count)
+{
+	uint64_t hist[256] = { 0 };
+	int      bits      = img->bitsperchannel;
+	size_t   rowbytes  = ((size_t)img->width * bits + 7) / 8;
+	size_t   fullbytes = (size_t)img->width * bits / 8;
+	int      perbyte   = 8 / bits;
+	unsigned mask      = (1U << bits) - 1;
+	uint8_t  idx[8];
+
+	for (int y = 0; y < img->height; y++)
+	{
+		const unsigned char *row = img->buffer + (size_t)y * img->stride;
+
+		for (size_t i = 0; i < fullbytes; i++)
+			hist[row[i]]++;
+
+		/* partially used last byte of a row */
+		if (fullbytes < rowbytes)
+		{
+			int n = img->width - (int)(fullbytes * perbyte);
+			unpack_indices(row + fullbytes, bits, 0, n, idx);
+			for (int i = 0; i < n; i++)
+				count[idx[i]]++;
+		}
+	}
+
+	for (int b = 0; b < 256; b++)
+	{
+		if (!hist[b])
+			continue;
+		for (int k = 0; k < perbyte; k++)
+			count[(b >> (8 - bits * (k + 1))) & mask] += hist[b];
+	}
+}
+
+/********************************************************
+ * 	palette_order_parse
+ *
+ * 	"reverse", "sort-luma", "sort-frequency" or
+ * 	"custom:" followed by a '/'-separated list
+ * 	of old indices in their new order.
+ *******************************************************/
+
+bool palette_order_parse(const char *str, struct RemapOrder *order)
+{
+	bool        used[256] = { false };
+	const char *p;
+	char       *endptr;
+
+	memset(order, 0, sizeof *order);
+
+	if (!strcmp(str, "reverse"))
+		order->order = ORDER_REVERSE;
+	else if (!strcmp(str, "sort-luma"))
+		order->order = ORDER_SORT_LUMA;
+	else if (!strcmp(str, "sort-frequency"))
+		order->order = ORDER_SORT_FREQUENCY;
+	else if (strncmp(str, "custom:", 7))
+		return false;
+	else
+	{
+		order->order = ORDER_CUSTOM;
+		for (p = str + 7; *p; p = *endptr ? endptr + 1 : endptr)
+		{
+			long v = strtol(p, &endptr, 10);
+
+			if (endptr == p || !(*endptr == '/' || *endptr == '\0') || v < 0 ||
+			    v > 255 || used[v])
+				return false;
+			used[v]                         = true;
+			order->custom[order->ncustom++] = (uint8_t)v;
+		}
+	}
+	return true;
+}
+
+static bool custom_order(const struct RemapOrder *order, int numcolors, int *neworder)
+{
+	bool used[256] = { false };
+	int  n         = 0;
+
+	for (int i = 0; i < order->ncustom; i++)
+	{
+		if (order->custom[i] >= numcolors)
+		{
+			printf("remappalette: custom order has index %d, image has %d colors\n",
+			       (int)order->custom[i], numcolors);
+			return false;
+		}
+		used[order->custom[i]] = true;
+		neworder[n++]          = order->custom[i];
+	}
+
+	/* colors not listed keep their relative order */
+	for (int i = 0; i < numcolors; i++)
+	{
+		if (!used[i])
+			neworder[n++] = i;
+	}
+	return true;
+}
+
+/********************************************************
+ * 	palette_remap
+ *
+ * 	Reorder the palette of an indexed image and
+ * 	rewrite the indices accordingly.
+ *******************************************************/
+
+bool palette_remap(struct Image *img, const struct RemapOrder *order)
+{
+	struct SortKey keys[256];
+	int            neworder[256]; /* new index -> old index */
+	uint8_t        lut[256];      /* old index -> new index */
+	uint8_t        bytelut[256];
+	unsigned char  newpal[256 * 4];
+	uint64_t       count[256] = { 0 };
+	int            numcolors  = img->numcolors;
+	int            bits       = img->bitsperchannel;
+	size_t         size;
+
+	if (!(img->palette && img->channels == 1 && numcolors > 0))
+	{
+		printf("remappalette: image is not indexed\n");
+		return false;
+	}
+
+	switch (bits)
+	{
+	case 1:
+	case 2:
+	case 4:
+	case 8:
+		if (numcolors <= (1 << bits))
+			break;
+		/* fallthrough */
+	default:
+		printf("remappalette: invalid index size %d for %d colors\n", bits, numcolors);
+		return false;
+	}
+
+	switch (order->order)
+	{
+	case ORDER_REVERSE:
+		for (int i = 0; i < numcolors; i++)
+			neworder[i] = numcolors - i - 1;
+		break;
+
+	case ORDER_SORT_LUMA:
+	case ORDER_SORT_FREQUENCY:
+		if (order->order == ORDER_SORT_FREQUENCY)
+			count_indices(img, count);
+
+		for (int i = 0; i < numcolors; i++)
+		{
+			const unsigned char *c = img->palette + 4 * i;
+
+			keys[i].index = i;
+			if (order->order == ORDER_SORT_LUMA)
+				keys[i].key = 0.2126 * c[0] + 0.7152 * c[1] + 0.0722 * c[2];
+			else
+				keys[i].key = -(double)count[i]; /* most frequent first */
+		}
+		qsort(keys, numcolors, sizeof keys[0], cmp_sortkey);
+		for (int i = 0; i < numcolors; i++)
+			neworder[i] = keys[i].index;
+		break;
+
+	case ORDER_CUSTOM:
+		if (!custom_order(order, numcolors, neworder))
+			return false;
+		break;
+
+	default:
+		printf("remappalette: invalid order %d\n", (int)order->order);
+		return false;
+	}
+
+	if (!img_make_writable(img))
+		return false;
+
+	/* indices beyond the palette are left alone */
+	for (int i = 0; i < 256; i++)
+		lut[i] = (uint8_t)i;
+	for (int i = 0; i < numcolors; i++)
+	{
+		lut[neworder[i]] = (uint8_t)i;
+		memcpy(newpal + 4 * i, img->palette + 4 * neworder[i], 4);
+	}
+	memcpy(img->palette, newpal, 4 * (size_t)numcolors);
+
+	if (bits == 8)
+		memcpy(bytelut, lut, sizeof bytelut);
+	else
+	{
+		unsigned mask = (1U << bits) - 1;
+
+		for (int b = 0; b < 256; b++)
+		{
+			bytelut[b] = 0;
+			for (int shift = 0; shift < 8; shift += bits)
+				bytelut[b] |= lut[(b >> shift) & mask] << shift;
+		}
+	}
+
+	size = img_rowbytes(img);
+	for (int y = 0; y < img->height; y++)
+	{
+		unsigned char *row = img->buffer + (size_t)y * img->stride;
+
+		for (size_t i = 0; i < size; i++)
+			row[i] = bytelut[row[i]];
+	}
+
+	return true;
+}
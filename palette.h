@@ -0,0 +1,45 @@
+/* bmplibtest - palette.h
+ *
+ * Copyright (c) 2025, Rupert Weber.
+ *
+ * This file is part of bmplibtest.
+ * bmplibtest is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+struct FlattenOpts
+{
+	bool      alpha; /* add an (opaque) alpha channel */
+	BMPFORMAT format;
+	int       bits;
+};
+
+bool palette_flatten(struct Image *img, const struct FlattenOpts *opts);
+
+enum PaletteOrder
+{
+	ORDER_REVERSE,
+	ORDER_SORT_LUMA,
+	ORDER_SORT_FREQUENCY,
+	ORDER_CUSTOM,
+};
+
+struct RemapOrder
+{
+	enum PaletteOrder order;
+	int               ncustom;    /* ORDER_CUSTOM: old indices in their new order */
+	uint8_t           custom[256];
+};
+
+bool palette_order_parse(const char *str, struct RemapOrder *order);
+bool palette_remap(struct Image *img, const struct RemapOrder *order);
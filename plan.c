@@ -0,0 +1,502 @@
+/* bmplibtest - plan.c
+ *
+ * Copyright (c) 2025, Rupert Weber.
+ *
+ * This file is part of bmplibtest.
+ * bmplibtest is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "allocate.h"
+#include "testparser.h"
+#include "plan.h"
+#include "dirscan.h"
+
+/* Execution plan
+ *
+ * After parsing, the test definitions are compiled once: each action is
+ * resolved to its ActionDef (so running it is a single indirect call),
+ * and its arguments are checked against the action's option table.
+ *
+ * Option values are resolved at the same time and stored in the argument:
+ * arg->id tells the action which option it is, the value is in arg->word
+ * (index of an OPT_WORD value), arg->num or arg->value (whatever the
+ * option's parse function made of it, allocated with the plan). Actions
+ * only read these, they never look at the strings again.
+ *
+ * All errors in the file are reported before any test is run. Checks
+ * which depend on the image (e.g. a channel map referring to alpha) and
+ * combinations of options are still up to the actions.
+ *
+ * Actions of a template are shared by all tests generated from it. Those
+ * with parameters are bound and resolved once per generated test, the
+ * result is kept in cmd->boundargs.
+ *
+ * A file argument (OPT_PATH) which is a pattern makes the test a sweep:
+ * the runner lists the matching files and runs the test once for each,
+ * plan_arguments() puts the match in place of the pattern. The files are
+ * only listed when the test is run, so neither the plan nor the plan
+ * cache depend on the contents of the directories.
+ *
+ * Settings blocks are checked the same way, their sections against a
+ * separate table; the caller applies them once before running the tests.
+ *
+ * Lookups are remembered by string address. Within one definitions file
+ * parsed from text that rarely helps, but a list loaded from the plan
+ * cache shares each distinct string, so a generated suite resolves its
+ * handful of action and option names only once. Each entry is tagged
+ * with the kind of lookup, as an action table, its first action and that
+ * action's first option can share one address.
+ */
+
+#define MEMO_SIZE 256
+
+enum MemoKind
+{
+	MEMO_ACTION = 1,
+	MEMO_OPTION,
+	MEMO_VALUE
+};
+
+struct Memo
+{
+	enum MemoKind kind;
+	const void   *scope; /* ActionDef resp. OptDef the lookup was made for */
+	const char   *str;
+	const void   *result;
+	double        num;
+	const void   *value;
+	bool          valid;
+};
+
+static struct Arena plan_arena; /* bound arguments and parsed values */
+
+static const struct ActionDef *find_action(const char *name, const struct ActionDef *defs,
+                                           int ndefs, struct Memo *memo);
+static const struct OptDef    *find_option(const char *name, const struct ActionDef *def,
+                                           struct Memo *memo);
+static bool check_value(struct Argument *arg, const char *value, const struct OptDef *opt,
+                        struct Memo *memo);
+static int find_word(const char *value, const char *words);
+static struct Memo *memo_slot(struct Memo *memo, enum MemoKind kind, const void *scope,
+                              const char *str);
+static int check_arguments(const struct Command *cmd, int testnum, const struct Action *action,
+                           struct Argument *args, struct Memo *memo);
+static int check_pattern(struct Command *cmd, int testnum, const struct Action *action,
+                         const struct Argument *args);
+static int check_settings(const struct Command *cmd, int num, const struct ActionDef *defs,
+                          int ndefs, struct Memo *memo);
+static void print_where(const struct Command *cmd, int num);
+static bool is_path_pattern(const struct ActionDef *def, int idx, const struct Argument *arg);
+
+/********************************************************
+ * 	plan_compile
+ *
+ * 	Returns the number of errors found (and
+ * 	printed).
+ *******************************************************/
+
+int plan_compile(struct Command *cmdlist, const struct ActionDef *defs, int ndefs,
+                 const struct ActionDef *settingdefs, int nsettingdefs)
+{
+	int                testnum = 0, settingsnum = 0, errors = 0, i;
+	static struct Memo memo[MEMO_SIZE];
+
+	memset(memo, 0, sizeof memo);
+
+	for (struct Command *cmd = cmdlist; cmd; cmd = cmd->next)
+	{
+		if (cmd->type == COMMAND_SETTINGS)
+		{
+			errors += check_settings(cmd, ++settingsnum, settingdefs, nsettingdefs, memo);
+			continue;
+		}
+		testnum++;
+
+		i = 0;
+		for (struct Action *action = cmd->actionlist; action; action = action->next, i++)
+		{
+			/* Tests generated from a template share its actions, those
+			 * without parameters only need to be checked once.
+			 */
+			if (cmd->bindings && action->def && !action->templated)
+			{
+				check_pattern(cmd, 0, action, action->arglist);
+				continue;
+			}
+
+			if (!(action->def = find_action(action->actname, defs, ndefs, memo)))
+			{
+				print_where(cmd, testnum);
+				printf("unknown action '%s'\n", action->actname);
+				errors++;
+				continue;
+			}
+
+			if (action->templated)
+			{
+				struct Argument *args;
+
+				if (!cmd->boundargs)
+				{
+					size_t n = 0;
+
+					for (struct Action *a = cmd->actionlist; a; a = a->next)
+						n++;
+					cmd->boundargs = arena_alloc(&plan_arena, n * sizeof *cmd->boundargs,
+					                             ARENA_ALIGN | ARENA_ZERO);
+				}
+				args = cmd->boundargs[i] = bind_arguments(&plan_arena, action, cmd);
+
+				errors += check_arguments(cmd, testnum, action, args, memo);
+				errors += check_pattern(cmd, testnum, action, args);
+			}
+			else
+			{
+				errors += check_arguments(cmd, testnum, action, action->arglist, memo);
+				errors += check_pattern(cmd, testnum, action, action->arglist);
+			}
+		}
+	}
+
+	return errors;
+}
+
+/********************************************************
+ * 	plan_free
+ *
+ * 	Free the bound arguments and parsed values.
+ * 	Call before free_cmdlist().
+ *******************************************************/
+
+void plan_free(void)
+{
+	arena_free(&plan_arena);
+}
+
+/********************************************************
+ * 	plan_arguments
+ *
+ * 	The arguments to pass to action's perform().
+ * 	For actions of a template, these are the
+ * 	arguments bound to cmd's parameters by
+ * 	plan_compile().
+ * 	If match is given and action is cmd's sweep
+ * 	action, the arguments are copied to arena
+ * 	with match in place of the file pattern.
+ * 	The plan's own arguments are never modified,
+ * 	so a test can be run any number of times.
+ *******************************************************/
+
+const struct Argument *plan_arguments(const struct Command *cmd, const struct Action *action,
+                                      const char *match, struct Arena *arena)
+{
+	const struct Argument *args = action->arglist;
+	struct Argument       *copy = NULL, **tail = &copy;
+	int                    idx  = 0;
+
+	if (action->templated)
+	{
+		for (const struct Action *a = cmd->actionlist; a != action; a = a->next)
+			idx++;
+		args = cmd->boundargs[idx];
+		idx  = 0;
+	}
+
+	if (!match || action != cmd->sweep)
+		return args;
+
+	for (const struct Argument *arg = args; arg; arg = arg->next, idx++)
+	{
+		*tail  = arena_alloc(arena, sizeof **tail, ARENA_ALIGN);
+		**tail = *arg;
+		if (is_path_pattern(action->def, idx, arg))
+			(*tail)->argname = arena_strdup(arena, match);
+		tail = &(*tail)->next;
+	}
+	return copy;
+}
+
+/* Check args against the option table of action->def and resolve their
+ * values.
+ */
+static int check_arguments(const struct Command *cmd, int testnum, const struct Action *action,
+                           struct Argument *args, struct Memo *memo)
+{
+	const struct ActionDef *def = action->def;
+	const struct OptDef    *opt;
+	struct Argument        *arg    = args;
+	int                     errors = 0;
+
+	for (int i = 0; i < def->npositional; i++, arg = arg->next)
+	{
+		opt = &def->positional[i];
+		if (!arg || *arg->argvalue)
+		{
+			print_where(cmd, testnum);
+			printf("%s: missing %s\n", action->actname, opt->name);
+			errors++;
+			break;
+		}
+		if (!check_value(arg, arg->argname, opt, memo))
+		{
+			print_where(cmd, testnum);
+			printf("%s: invalid %s '%s'\n", action->actname, opt->name, arg->argname);
+			errors++;
+		}
+	}
+
+	for (; arg; arg = arg->next)
+	{
+		if (!(opt = find_option(arg->argname, def, memo)))
+		{
+			print_where(cmd, testnum);
+			printf("%s: unknown option '%s'\n", action->actname, arg->argname);
+			errors++;
+		}
+		else if (!check_value(arg, arg->argvalue, opt, memo))
+		{
+			print_where(cmd, testnum);
+			printf("%s: invalid value '%s' for %s\n", action->actname, arg->argvalue,
+			       arg->argname);
+			errors++;
+		}
+	}
+	return errors;
+}
+
+/* The sections of a settings block are checked like actions, against
+ * their own table.
+ */
+static int check_settings(const struct Command *cmd, int num, const struct ActionDef *defs,
+                          int ndefs, struct Memo *memo)
+{
+	int errors = 0;
+
+	for (struct Action *section = cmd->actionlist; section; section = section->next)
+	{
+		if (!(section->def = find_action(section->actname, defs, ndefs, memo)))
+		{
+			print_where(cmd, num);
+			printf("unknown section '%s'\n", section->actname);
+			errors++;
+			continue;
+		}
+		errors += check_arguments(cmd, num, section, section->arglist, memo);
+	}
+	return errors;
+}
+
+static void print_where(const struct Command *cmd, int num)
+{
+	if (cmd->type == COMMAND_SETTINGS)
+		printf("settings %d: ", num);
+	else
+		printf("test %d (%s): ", num, cmd->descr);
+}
+
+/* Make the action with a file pattern cmd's sweep action. Only the file
+ * name itself may be a pattern, and there can only be one per test.
+ */
+static int check_pattern(struct Command *cmd, int testnum, const struct Action *action,
+                         const struct Argument *args)
+{
+	const struct Argument *arg = args;
+	int                    errors = 0;
+
+	for (int i = 0; arg && i < action->def->npositional; i++, arg = arg->next)
+	{
+		const char *slash;
+
+		if (!is_path_pattern(action->def, i, arg))
+			continue;
+
+		if ((slash = strrchr(arg->argname, '/')) &&
+		    strcspn(arg->argname, "*?[") < (size_t)(slash - arg->argname))
+		{
+			if (testnum)
+			{
+				print_where(cmd, testnum);
+				printf("%s: only the file name may be a pattern: '%s'\n", action->actname,
+				       arg->argname);
+			}
+			errors++;
+		}
+		else if (cmd->sweep && cmd->sweep != action)
+		{
+			if (testnum)
+			{
+				print_where(cmd, testnum);
+				printf("%s: only one file pattern per test\n", action->actname);
+			}
+			errors++;
+		}
+		else
+			cmd->sweep = action;
+	}
+	return errors;
+}
+
+static bool is_path_pattern(const struct ActionDef *def, int idx, const struct Argument *arg)
+{
+	return idx < def->npositional && def->positional[idx].kind == OPT_PATH &&
+	       !*arg->argvalue && dirscan_is_pattern(arg->argname);
+}
+
+static const struct ActionDef *find_action(const char *name, const struct ActionDef *defs,
+                                           int ndefs, struct Memo *memo)
+{
+	struct Memo *m = memo_slot(memo, MEMO_ACTION, defs, name);
+
+	if (m->valid)
+		return m->result;
+
+	m->result = NULL;
+	for (int i = 0; i < ndefs; i++)
+	{
+		if (!strcmp(name, defs[i].name))
+		{
+			m->result = &defs[i];
+			break;
+		}
+	}
+	m->valid = true;
+	return m->result;
+}
+
+static const struct OptDef *find_option(const char *name, const struct ActionDef *def,
+                                        struct Memo *memo)
+{
+	struct Memo         *m = memo_slot(memo, MEMO_OPTION, def, name);
+	const struct OptDef *opts;
+
+	if (m->valid)
+		return m->result;
+
+	m->result = NULL;
+	for (opts = def->opts; opts && opts->name; opts++)
+	{
+		if (!strcmp(name, opts->name))
+		{
+			m->result = opts;
+			break;
+		}
+	}
+	m->valid = true;
+	return m->result;
+}
+
+static bool check_value(struct Argument *arg, const char *value, const struct OptDef *opt,
+                        struct Memo *memo)
+{
+	struct Memo    *m;
+	struct Argument parsed = { 0 };
+	char           *endptr = NULL;
+
+	arg->id = opt->id;
+
+	switch (opt->kind)
+	{
+	case OPT_FLAG:
+		return !*value;
+
+	case OPT_WORD:
+		return (arg->word = find_word(value, opt->words)) != -1;
+
+	case OPT_INT:
+	case OPT_NUM:
+		m = memo_slot(memo, MEMO_VALUE, opt, value);
+		if (!m->valid)
+		{
+			long long num = 0;
+
+			errno = 0;
+			if (opt->kind == OPT_INT)
+			{
+				/* actions take integer options as int */
+				num    = strtoll(value, &endptr, 10);
+				m->num = (double)num;
+			}
+			else
+				m->num = strtod(value, &endptr);
+			m->result = *value && !*endptr && errno != ERANGE ? opt : NULL;
+			if (opt->kind == OPT_INT && (num < INT_MIN || num > INT_MAX))
+				m->result = NULL;
+			m->valid  = true;
+		}
+		arg->num = m->num;
+		return m->result != NULL;
+
+	case OPT_PARSED:
+		m = memo_slot(memo, MEMO_VALUE, opt, value);
+		if (!m->valid)
+		{
+			m->result = opt->parse(value, &parsed, &plan_arena) ? opt : NULL;
+			m->num    = parsed.num;
+			m->value  = parsed.value;
+			m->valid  = true;
+		}
+		arg->num   = m->num;
+		arg->value = m->value;
+		return m->result != NULL;
+
+	case OPT_STR:
+	case OPT_PATH:
+		return *value;
+	}
+	return false;
+}
+
+/* Index of value in the '|'-separated list words, -1 if it isn't one */
+static int find_word(const char *value, const char *words)
+{
+	size_t len = strlen(value);
+
+	for (int idx = 0; words && *words; idx++)
+	{
+		const char *sep = strchr(words, '|');
+		size_t      wlen = sep ? (size_t)(sep - words) : strlen(words);
+
+		if (wlen == len && !memcmp(value, words, len))
+			return idx;
+		words = sep ? sep + 1 : NULL;
+	}
+	return -1;
+}
+
+/* Returns the memo entry for (kind, scope, str). If it holds a different
+ * lookup, it is cleared and can be filled in by the caller.
+ */
+static struct Memo *memo_slot(struct Memo *memo, enum MemoKind kind, const void *scope,
+                              const char *str)
+{
+	uintptr_t    h = ((uintptr_t)str >> 3) ^ ((uintptr_t)scope >> 4) * 31 ^ (uintptr_t)kind;
+	struct Memo *m = &memo[h % MEMO_SIZE];
+
+	if (m->kind != kind || m->scope != scope || m->str != str)
+	{
+		memset(m, 0, sizeof *m);
+		m->kind  = kind;
+		m->scope = scope;
+		m->str   = str;
+	}
+	return m;
+}
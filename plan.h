@@ -0,0 +1,54 @@
+/* bmplibtest - plan.h
+ *
+ * Copyright (c) 2025, Rupert Weber.
+ *
+ * This file is part of bmplibtest.
+ * bmplibtest is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+enum OptKind
+{
+	OPT_FLAG,   /* no value                                          */
+	OPT_WORD,   /* one of OptDef.words, its index stored in arg->word */
+	OPT_INT,    /* integer, stored in arg->num                       */
+	OPT_NUM,    /* real number, stored in arg->num                   */
+	OPT_STR,    /* any non-empty string, e.g. a file name            */
+	OPT_PATH,   /* file in the preceding dir argument, may be a pattern */
+	OPT_PARSED, /* converted by OptDef.parse into arg->num or arg->value */
+};
+
+struct OptDef
+{
+	const char  *name;
+	enum OptKind kind;
+	const char  *words; /* OPT_WORD: allowed values, separated by '|' */
+	int          id;    /* passed to the action as arg->id */
+	bool        (*parse)(const char *str, struct Argument *arg, struct Arena *arena);
+};
+
+struct ActionDef
+{
+	const char          *name;
+	bool                (*perform)(const struct Argument *args);
+	const struct OptDef *positional;  /* leading arguments given without value, */
+	int                  npositional; /* e.g. dir and file name                  */
+	const struct OptDef *opts;        /* named options, terminated by { NULL }   */
+};
+
+void                   plan_free(void);
+int                    plan_compile(struct Command *cmdlist, const struct ActionDef *defs,
+                                    int ndefs, const struct ActionDef *settingdefs,
+                                    int nsettingdefs);
+const struct Argument *plan_arguments(const struct Command *cmd, const struct Action *action,
+                                      const char *match, struct Arena *arena);
@@ -0,0 +1,504 @@
+/* bmplibtest - plancache.c
+ *
+ * Copyright (c) 2025, Rupert Weber.
+ *
+ * This file is part of bmplibtest.
+ * bmplibtest is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "config.h"
+#include "allocate.h"
+#include "testparser.h"
+#include "plancache.h"
+
+/* Plan cache
+ *
+ * The parsed test definitions are stored next to the definitions file
+ * (<file>.plancache), keyed by the XXH64 hash of the file contents and
+ * the program version. A changed file or a different version of
+ * bmplibtest is a miss, and the cache is simply rewritten.
+ *
+ * File layout: a 64-byte header, then fixed-size records for all
+ * commands, actions, arguments and template bindings, then a table of
+ * NUL-terminated strings which the records refer to by offset. Commands
+ * give the index and number of their actions and bindings; actions are
+ * stored once per list, so the tests generated from a template share
+ * them as they do in memory. Arguments follow their actions' order. Each
+ * distinct string is stored only once, generated suites repeat the same
+ * action and option names and values over and over.
+ *
+ * Loading maps the file MAP_PRIVATE and builds the lists from the
+ * records; the strings are used in place, so the mapping is kept until
+ * plancache_release(). Nothing is tokenized or copied.
+ */
+
+#define PLAN_MAGIC     "BLTPLN02"
+#define PLAN_BYTEORDER 0x01020304UL
+#define PLAN_TEMPLATED 0x01
+
+struct PlanHeader
+{
+	char     magic[8];
+	uint32_t byteorder;
+	uint32_t ncommands;
+	uint64_t key;
+	char     version[16];
+	uint32_t nactions;
+	uint32_t nargs;
+	uint64_t strsize;
+	uint32_t nbindings;
+	uint32_t reserved;
+};
+
+_Static_assert(sizeof(struct PlanHeader) == 64, "plan cache header must be 64 bytes");
+
+struct PlanCommand
+{
+	uint32_t type;
+	uint32_t descr;
+	uint32_t actions;
+	uint32_t nactions;
+	uint32_t bindings;
+	uint32_t nbindings;
+};
+
+struct PlanAction
+{
+	uint32_t name;
+	uint32_t nargs;
+	uint32_t flags;
+	uint32_t reserved;
+};
+
+struct PlanArg
+{
+	uint32_t name;
+	uint32_t value;
+};
+
+struct StrTable
+{
+	char     *buf;
+	size_t    size;
+	size_t    capacity;
+	uint32_t *slots; /* offset + 1 of each interned string, 0 = empty */
+	size_t    nslots;
+	size_t    count;
+};
+
+static unsigned char *plan_map     = NULL;
+static size_t         plan_mapsize = 0;
+
+static bool     version_matches(const struct PlanHeader *hdr);
+static bool     intern(struct StrTable *tab, const char *str, uint32_t *offset);
+static uint64_t str_hash(const char *str);
+
+/********************************************************
+ * 	plancache_load
+ *
+ * 	Returns NULL if there is no (valid) cached plan
+ * 	for key.
+ *******************************************************/
+
+struct Command *plancache_load(const char *path, uint64_t key, struct Arena *arena)
+{
+	struct stat         st;
+	struct PlanHeader  *hdr;
+	struct PlanCommand *pcmd;
+	struct PlanAction  *pact;
+	struct PlanArg     *parg, *pbind;
+	struct Command     *cmds;
+	struct Action      *acts;
+	struct Argument    *args;
+	struct Binding     *binds;
+	char               *strings;
+	unsigned char      *map = MAP_FAILED;
+	size_t              mapsize, recsize;
+	uint32_t            ig = 0, end;
+	int                 fd;
+
+	if (-1 == (fd = open(path, O_RDONLY)))
+		return NULL;
+
+	if (fstat(fd, &st) || st.st_size < (off_t)sizeof *hdr)
+	{
+		close(fd);
+		return NULL;
+	}
+	mapsize = (size_t)st.st_size;
+
+	map = mmap(NULL, mapsize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	hdr = (struct PlanHeader *)map;
+	if (memcmp(hdr->magic, PLAN_MAGIC, sizeof hdr->magic) ||
+	    hdr->byteorder != PLAN_BYTEORDER || hdr->key != key || !version_matches(hdr))
+		goto abort;
+
+	recsize = (size_t)hdr->ncommands * sizeof *pcmd + (size_t)hdr->nactions * sizeof *pact +
+	          ((size_t)hdr->nargs + hdr->nbindings) * sizeof *parg;
+	if (hdr->ncommands < 1 || recsize > mapsize - sizeof *hdr ||
+	    hdr->strsize != mapsize - sizeof *hdr - recsize || hdr->strsize > UINT32_MAX ||
+	    map[mapsize - 1] != 0)
+		goto corrupt;
+
+	pcmd    = (struct PlanCommand *)(map + sizeof *hdr);
+	pact    = (struct PlanAction *)(pcmd + hdr->ncommands);
+	parg    = (struct PlanArg *)(pact + hdr->nactions);
+	pbind   = parg + hdr->nargs;
+	strings = (char *)(pbind + hdr->nbindings);
+
+	cmds  = arena_alloc(arena, (size_t)hdr->ncommands * sizeof *cmds, ARENA_ALIGN);
+	acts  = arena_alloc(arena, ((size_t)hdr->nactions + 1) * sizeof *acts, ARENA_ALIGN);
+	args  = arena_alloc(arena, ((size_t)hdr->nargs + 1) * sizeof *args, ARENA_ALIGN);
+	binds = arena_alloc(arena, ((size_t)hdr->nbindings + 1) * sizeof *binds, ARENA_ALIGN);
+
+#define STR(off) ((off) < hdr->strsize ? strings + (off) : NULL)
+
+	for (uint32_t ia = 0; ia < hdr->nactions; ia++)
+	{
+		if (pact[ia].nargs > hdr->nargs - ig || !(acts[ia].actname = STR(pact[ia].name)))
+			goto corrupt;
+
+		acts[ia].next      = NULL;
+		acts[ia].arglist   = pact[ia].nargs ? &args[ig] : NULL;
+		acts[ia].def       = NULL;
+		acts[ia].templated = !!(pact[ia].flags & PLAN_TEMPLATED);
+
+		for (uint32_t j = 0; j < pact[ia].nargs; j++, ig++)
+		{
+			if (!(args[ig].argname = STR(parg[ig].name)) ||
+			    !(args[ig].argvalue = STR(parg[ig].value)))
+				goto corrupt;
+			args[ig].next  = j + 1 < pact[ia].nargs ? &args[ig + 1] : NULL;
+			args[ig].id    = 0;
+			args[ig].word  = 0;
+			args[ig].num   = 0.0;
+			args[ig].value = NULL;
+		}
+	}
+	if (ig != hdr->nargs)
+		goto corrupt;
+
+	for (uint32_t ib = 0; ib < hdr->nbindings; ib++)
+	{
+		if (!(binds[ib].name = STR(pbind[ib].name)) || !(binds[ib].value = STR(pbind[ib].value)))
+			goto corrupt;
+	}
+
+	for (uint32_t ic = 0; ic < hdr->ncommands; ic++)
+	{
+		if (pcmd[ic].type > COMMAND_SETTINGS || !(cmds[ic].descr = STR(pcmd[ic].descr)) ||
+		    pcmd[ic].actions > hdr->nactions ||
+		    pcmd[ic].nactions > hdr->nactions - pcmd[ic].actions ||
+		    pcmd[ic].bindings > hdr->nbindings ||
+		    pcmd[ic].nbindings > hdr->nbindings - pcmd[ic].bindings ||
+		    pcmd[ic].nbindings > INT32_MAX)
+			goto corrupt;
+
+		cmds[ic].next       = ic + 1 < hdr->ncommands ? &cmds[ic + 1] : NULL;
+		cmds[ic].type       = (enum CommandType)pcmd[ic].type;
+		cmds[ic].actionlist = pcmd[ic].nactions ? &acts[pcmd[ic].actions] : NULL;
+		cmds[ic].bindings   = pcmd[ic].nbindings ? &binds[pcmd[ic].bindings] : NULL;
+		cmds[ic].nbindings  = (int)pcmd[ic].nbindings;
+		cmds[ic].sweep      = NULL;
+		cmds[ic].boundargs  = NULL;
+
+		end = pcmd[ic].actions + pcmd[ic].nactions;
+		for (uint32_t ia = pcmd[ic].actions; ia + 1 < end; ia++)
+			acts[ia].next = &acts[ia + 1];
+	}
+#undef STR
+
+	plancache_release();
+	plan_map     = map;
+	plan_mapsize = mapsize;
+	return cmds;
+
+corrupt:
+	printf("plancache: ignoring corrupt file %s\n", path);
+abort:
+	munmap(map, mapsize);
+	return NULL;
+}
+
+/********************************************************
+ * 	plancache_release
+ *
+ * 	Unmap the cache file. All strings of a list
+ * 	returned by plancache_load() are gone after this.
+ *******************************************************/
+
+void plancache_release(void)
+{
+	if (plan_map)
+		munmap(plan_map, plan_mapsize);
+	plan_map     = NULL;
+	plan_mapsize = 0;
+}
+
+/********************************************************
+ * 	plancache_store
+ *
+ * 	Like the reference cache, the file is written
+ * 	under a temporary name and then renamed.
+ * 	Failure is not an error, the definitions will
+ * 	just be parsed again next time. A read-only
+ * 	directory is silently skipped.
+ *******************************************************/
+
+bool plancache_store(const char *path, uint64_t key, const struct Command *cmdlist)
+{
+	char                   tmppath[1024];
+	struct PlanHeader      hdr;
+	struct PlanCommand    *pcmd  = NULL;
+	struct PlanAction     *pact  = NULL;
+	struct PlanArg        *parg  = NULL, *pbind = NULL;
+	struct StrTable        tab   = { 0 };
+	const struct Command  *cmd;
+	const struct Action   *act, *prevlist;
+	const struct Argument *arg;
+	FILE                  *file = NULL;
+	uint32_t               ic = 0, ia = 0, ig = 0, ib = 0;
+	bool                   ret = false;
+
+	if ((int)sizeof tmppath <
+	    snprintf(tmppath, sizeof tmppath, "%s.%ld.tmp", path, (long)getpid()))
+		return false;
+
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, PLAN_MAGIC, sizeof hdr.magic);
+	strncpy(hdr.version, PROGRAM_VERSION, sizeof hdr.version);
+	hdr.byteorder = PLAN_BYTEORDER;
+	hdr.key       = key;
+
+	/* consecutive commands with the same action list (i.e. generated
+	 * from the same matrix) share one copy
+	 */
+	prevlist = NULL;
+	for (cmd = cmdlist; cmd; cmd = cmd->next)
+	{
+		hdr.ncommands++;
+		hdr.nbindings += (uint32_t)cmd->nbindings;
+		if (cmd->actionlist && cmd->actionlist == prevlist)
+			continue;
+		prevlist = cmd->actionlist;
+		for (act = cmd->actionlist; act; act = act->next)
+		{
+			hdr.nactions++;
+			for (arg = act->arglist; arg; arg = arg->next)
+				hdr.nargs++;
+		}
+	}
+	if (!hdr.ncommands)
+		return false;
+
+	if (!((pcmd = calloc(hdr.ncommands, sizeof *pcmd)) &&
+	      (pact = calloc((size_t)hdr.nactions + 1, sizeof *pact)) &&
+	      (parg = calloc((size_t)hdr.nargs + 1, sizeof *parg)) &&
+	      (pbind = calloc((size_t)hdr.nbindings + 1, sizeof *pbind))))
+	{
+		perror("plancache_store");
+		goto done;
+	}
+
+	prevlist = NULL;
+	for (cmd = cmdlist; cmd; cmd = cmd->next, ic++)
+	{
+		pcmd[ic].type = (uint32_t)cmd->type;
+		if (!intern(&tab, cmd->descr, &pcmd[ic].descr))
+			goto done;
+
+		pcmd[ic].bindings  = ib;
+		pcmd[ic].nbindings = (uint32_t)cmd->nbindings;
+		for (int i = 0; i < cmd->nbindings; i++, ib++)
+		{
+			if (!(intern(&tab, cmd->bindings[i].name, &pbind[ib].name) &&
+			      intern(&tab, cmd->bindings[i].value, &pbind[ib].value)))
+				goto done;
+		}
+
+		if (cmd->actionlist && cmd->actionlist == prevlist)
+		{
+			pcmd[ic].actions  = pcmd[ic - 1].actions;
+			pcmd[ic].nactions = pcmd[ic - 1].nactions;
+			continue;
+		}
+		prevlist = cmd->actionlist;
+
+		pcmd[ic].actions = ia;
+		for (act = cmd->actionlist; act; act = act->next, ia++)
+		{
+			pcmd[ic].nactions++;
+			pact[ia].flags = act->templated ? PLAN_TEMPLATED : 0;
+			if (!intern(&tab, act->actname, &pact[ia].name))
+				goto done;
+			for (arg = act->arglist; arg; arg = arg->next, ig++)
+			{
+				pact[ia].nargs++;
+				if (!(intern(&tab, arg->argname, &parg[ig].name) &&
+				      intern(&tab, arg->argvalue, &parg[ig].value)))
+					goto done;
+			}
+		}
+	}
+	hdr.strsize = tab.size;
+
+	if (!(file = fopen(tmppath, "wb")))
+	{
+		if (!(errno == EACCES || errno == EROFS || errno == EPERM))
+			perror(tmppath);
+		goto done;
+	}
+
+	if (1 != fwrite(&hdr, sizeof hdr, 1, file) ||
+	    hdr.ncommands != fwrite(pcmd, sizeof *pcmd, hdr.ncommands, file) ||
+	    hdr.nactions != fwrite(pact, sizeof *pact, hdr.nactions, file) ||
+	    hdr.nargs != fwrite(parg, sizeof *parg, hdr.nargs, file) ||
+	    hdr.nbindings != fwrite(pbind, sizeof *pbind, hdr.nbindings, file) ||
+	    1 != fwrite(tab.buf, tab.size, 1, file))
+		goto abort;
+
+	if (fclose(file))
+	{
+		file = NULL;
+		goto abort;
+	}
+	file = NULL;
+
+	if (rename(tmppath, path))
+		goto abort;
+
+	ret = true;
+	goto done;
+
+abort:
+	perror(tmppath);
+	if (file)
+		fclose(file);
+	remove(tmppath);
+done:
+	free(pcmd);
+	free(pact);
+	free(parg);
+	free(pbind);
+	free(tab.buf);
+	free(tab.slots);
+	return ret;
+}
+
+static bool version_matches(const struct PlanHeader *hdr)
+{
+	char version[sizeof hdr->version];
+
+	memset(version, 0, sizeof version);
+	strncpy(version, PROGRAM_VERSION, sizeof version);
+	return !memcmp(version, hdr->version, sizeof version);
+}
+
+/* Returns (in offset) the offset of str in the string table, adding it
+ * if it isn't there yet. The hash table is kept at most half full.
+ */
+static bool intern(struct StrTable *tab, const char *str, uint32_t *offset)
+{
+	size_t len = strlen(str) + 1, i;
+
+	if (2 * tab->count >= tab->nslots)
+	{
+		/* rehash */
+		size_t    nslots = tab->nslots ? 2 * tab->nslots : 4096;
+		uint32_t *slots;
+
+		if (!(slots = calloc(nslots, sizeof *slots)))
+			goto nomem;
+		for (size_t s = 0; s < tab->nslots; s++)
+		{
+			if (!tab->slots[s])
+				continue;
+			i = str_hash(tab->buf + tab->slots[s] - 1) & (nslots - 1);
+			while (slots[i])
+				i = (i + 1) & (nslots - 1);
+			slots[i] = tab->slots[s];
+		}
+		free(tab->slots);
+		tab->slots  = slots;
+		tab->nslots = nslots;
+	}
+
+	i = str_hash(str) & (tab->nslots - 1);
+	for (; tab->slots[i]; i = (i + 1) & (tab->nslots - 1))
+	{
+		if (!strcmp(tab->buf + tab->slots[i] - 1, str))
+		{
+			*offset = tab->slots[i] - 1;
+			return true;
+		}
+	}
+
+	if (tab->size + len >= UINT32_MAX)
+	{
+		printf("plancache: too many strings\n");
+		return false;
+	}
+
+	if (tab->size + len > tab->capacity)
+	{
+		size_t capacity = tab->capacity ? tab->capacity : 65536;
+		char  *buf;
+
+		while (capacity < tab->size + len)
+			capacity *= 2;
+		if (!(buf = realloc(tab->buf, capacity)))
+			goto nomem;
+		tab->buf      = buf;
+		tab->capacity = capacity;
+	}
+
+	memcpy(tab->buf + tab->size, str, len);
+	*offset        = (uint32_t)tab->size;
+	tab->slots[i]  = (uint32_t)tab->size + 1;
+	tab->size     += len;
+	tab->count++;
+	return true;
+
+nomem:
+	perror("plancache_store");
+	return false;
+}
+
+/* FNV-1a */
+static uint64_t str_hash(const char *str)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	for (; *str; str++)
+		h = (h ^ (unsigned char)*str) * 0x100000001b3ULL;
+	return h;
+}
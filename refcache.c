@@ -0,0 +1,262 @@
+/* bmplibtest - refcache.c
+ *
+ * Copyright (c) 2025, Rupert Weber.
+ *
+ * This file is part of bmplibtest.
+ * bmplibtest is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <bmplib.h>
+#include <png.h>
+
+#include "defs.h"
+#include "imgstack.h"
+#include "refcache.h"
+
+/* Reference cache
+ *
+ * Decoded reference PNGs are stored as uncompressed files named
+ * <key>.raw in the cache directory, where key is the XXH64 hash of
+ * the PNG file contents. A changed PNG simply gets a new key, stale
+ * entries are never used (and can be deleted at any time).
+ *
+ * File layout: a 64-byte header, followed by the pixel rows, each
+ * starting on a 64-byte boundary. Samples are in host byte order;
+ * the header records the byte order, so a cache directory moved to
+ * a different machine is treated as a miss.
+ *
+ * Cache files are mapped MAP_PRIVATE and the mapping becomes the image
+ * buffer directly, rows and stride as stored. Actions modifying the
+ * image in place only ever touch copy-on-write pages, never the file.
+ *
+ * The key only covers the PNG file, not how it was decoded. The header
+ * also records the libpng version in use and CACHE_DECODER, which must
+ * be bumped whenever loadpng changes the way it converts PNGs. Entries
+ * written with a different decoder are treated as a miss and replaced.
+ */
+
+#define CACHE_MAGIC     "BLTRAW01"
+#define CACHE_BYTEORDER 0x01020304UL
+#define CACHE_ALIGN     IMG_ROW_ALIGN
+#define CACHE_DECODER   1
+
+struct CacheHeader
+{
+	char          magic[8];
+	uint32_t      byteorder;
+	uint32_t      bits;
+	uint64_t      key;
+	uint32_t      width;
+	uint32_t      height;
+	uint32_t      channels;
+	uint32_t      reserved0;
+	uint64_t      stride;
+	uint64_t      dataoffset;
+	uint32_t      pngversion;
+	uint32_t      decoder;
+};
+
+_Static_assert(sizeof(struct CacheHeader) == CACHE_ALIGN, "cache header must be 64 bytes");
+
+static bool cache_path(char *path, size_t size, const char *dir, uint64_t key, const char *ext);
+
+/********************************************************
+ * 	refcache_load
+ *
+ * 	Returns NULL if there is no (valid) cached image
+ * 	for key.
+ *******************************************************/
+
+struct Image *refcache_load(const char *dir, uint64_t key)
+{
+	char                path[1024];
+	struct stat         st;
+	struct CacheHeader *hdr;
+	struct Image       *img = NULL;
+	unsigned char      *map = MAP_FAILED;
+	size_t              rowbytes, mapsize;
+	int                 fd;
+
+	if (!cache_path(path, sizeof path, dir, key, "raw"))
+		return NULL;
+
+	if (-1 == (fd = open(path, O_RDONLY)))
+		return NULL;
+
+	if (fstat(fd, &st) || st.st_size < (off_t)sizeof *hdr)
+	{
+		close(fd);
+		return NULL;
+	}
+	mapsize = (size_t)st.st_size;
+
+	map = mmap(NULL, mapsize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	hdr = (struct CacheHeader *)map;
+	if (memcmp(hdr->magic, CACHE_MAGIC, sizeof hdr->magic) ||
+	    hdr->byteorder != CACHE_BYTEORDER || hdr->key != key ||
+	    hdr->pngversion != png_access_version_number() || hdr->decoder != CACHE_DECODER)
+		goto abort;
+
+	if (hdr->width < 1 || hdr->width > INT32_MAX || hdr->height < 1 ||
+	    hdr->height > INT32_MAX || hdr->channels < 1 || hdr->channels > 4 ||
+	    !(hdr->bits == 8 || hdr->bits == 16))
+		goto abort;
+
+	rowbytes = (size_t)hdr->width * hdr->channels * hdr->bits / 8;
+	if (hdr->stride < rowbytes || hdr->stride % CACHE_ALIGN ||
+	    hdr->dataoffset % CACHE_ALIGN || hdr->dataoffset > mapsize ||
+	    (mapsize - hdr->dataoffset) / hdr->stride < hdr->height)
+	{
+		printf("refcache: ignoring corrupt file %s\n", path);
+		goto abort;
+	}
+
+	if (!(img = malloc(sizeof *img)))
+	{
+		perror("allocate cached image");
+		goto abort;
+	}
+	memset(img, 0, sizeof *img);
+
+	img->width          = (int)hdr->width;
+	img->height         = (int)hdr->height;
+	img->channels       = (int)hdr->channels;
+	img->bitsperchannel = (int)hdr->bits;
+	img->format         = BMP_FORMAT_INT;
+	img->stride         = hdr->stride;
+	img->buffersize     = hdr->stride * hdr->height;
+	img->mapping        = map;
+	img->mapsize        = mapsize;
+	img->buffer         = map + hdr->dataoffset;
+	return img;
+
+abort:
+	if (img)
+		free(img);
+	munmap(map, mapsize);
+	return NULL;
+}
+
+/********************************************************
+ * 	refcache_store
+ *
+ * 	The cache file is written under a temporary name
+ * 	and then renamed, so concurrent runs never see a
+ * 	partial file.
+ *******************************************************/
+
+bool refcache_store(const char *dir, uint64_t key, const struct Image *img)
+{
+	char               path[1024], tmppath[1024];
+	struct CacheHeader hdr;
+	FILE              *file = NULL;
+	size_t             rowbytes, stride;
+	static const unsigned char zeros[CACHE_ALIGN];
+
+	if (!(img->bitsperchannel == 8 || img->bitsperchannel == 16) || img->palette)
+		return false;
+
+	if (mkdir(dir, 0777) && errno != EEXIST)
+	{
+		perror(dir);
+		return false;
+	}
+
+	if (!cache_path(path, sizeof path, dir, key, "raw"))
+		return false;
+	if ((int)sizeof tmppath <
+	    snprintf(tmppath, sizeof tmppath, "%s.%ld.tmp", path, (long)getpid()))
+		return false;
+
+	rowbytes = img_rowbytes(img);
+	stride   = img_aligned_stride(img->width, img->channels, img->bitsperchannel);
+
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, CACHE_MAGIC, sizeof hdr.magic);
+	hdr.byteorder  = CACHE_BYTEORDER;
+	hdr.key        = key;
+	hdr.width      = (uint32_t)img->width;
+	hdr.height     = (uint32_t)img->height;
+	hdr.channels   = (uint32_t)img->channels;
+	hdr.bits       = (uint32_t)img->bitsperchannel;
+	hdr.stride     = stride;
+	hdr.dataoffset = sizeof hdr;
+	hdr.pngversion = png_access_version_number();
+	hdr.decoder    = CACHE_DECODER;
+
+	if (!(file = fopen(tmppath, "wb")))
+	{
+		perror(tmppath);
+		return false;
+	}
+
+	if (1 != fwrite(&hdr, sizeof hdr, 1, file))
+		goto abort;
+
+	for (int y = 0; y < img->height; y++)
+	{
+		if (1 != fwrite(img->buffer + (size_t)y * img->stride, rowbytes, 1, file))
+			goto abort;
+		if (stride > rowbytes && 1 != fwrite(zeros, stride - rowbytes, 1, file))
+			goto abort;
+	}
+
+	if (fclose(file))
+	{
+		file = NULL;
+		goto abort;
+	}
+	file = NULL;
+
+	if (rename(tmppath, path))
+		goto abort;
+
+	return true;
+
+abort:
+	perror(tmppath);
+	if (file)
+		fclose(file);
+	remove(tmppath);
+	return false;
+}
+
+static bool cache_path(char *path, size_t size, const char *dir, uint64_t key, const char *ext)
+{
+	if ((int)size < snprintf(path, size, "%s/%016" PRIx64 ".%s", dir, key, ext))
+	{
+		printf("refcache: path too long\n");
+		return false;
+	}
+	return true;
+}
@@ -16,68 +16,177 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
+#define _POSIX_C_SOURCE 200809L
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include <assert.h>
+#include <ctype.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
+#include <bmplib.h>
+
+#include "defs.h"
+#include "imgstack.h"
+#include "hash.h"
 #include "allocate.h"
 #include "testparser.h"
+#include "plancache.h"
+
+/* Test definition parser
+ *
+ * The whole file is mapped (or, if it can't be mapped, read) into memory
+ * and parsed in a single pass. The scanner works on spans (pointer and
+ * length) into that buffer, character classes are looked up in a table.
+ * Nothing is copied until a command, action or argument is added to the
+ * list, at which point its strings are copied into the definitions arena
+ * in one go. The mapping is released after parsing, so there are no
+ * limits on the length of descriptions, names, or values.
+ *
+ * Line and position for error messages are only computed when an error
+ * is reported.
+ *
+ * A template (`template (name) { ... }`) is parsed like a test but not
+ * added to the list; its arguments may refer to parameters as $name. A
+ * matrix (`matrix (descr) { template: name, param: [v1, v2, ...], ... }`)
+ * adds one test for every combination of parameter values, the last
+ * parameter varying fastest. Generated tests share the template's action
+ * list and only carry their own description and bindings, parameters are
+ * substituted when the arguments are needed (see bind_arguments()).
+ *
+ * A settings block (`settings { loadbmp {...} timing {...} }`) is parsed
+ * like a test, its actions name the sections. It is added to the list as
+ * a COMMAND_SETTINGS command.
+ *
+ * If a plan cache path is given and the cache matches the file contents,
+ * the lists are loaded from the cache instead (see plancache.c), and a
+ * freshly parsed file is written to the cache.
+ */
+
+struct Span
+{
+	const char *ptr;
+	size_t      len;
+};
+
+#define CC_SPACE   0x01 /* white space                           */
+#define CC_KEYWORD 0x02 /* valid in command and action keywords  */
+#define CC_KWEND   0x04 /* ends a keyword                        */
+#define CC_NAMEEND 0x08 /* ends an argument name                 */
+#define CC_VALEND  0x10 /* ends an argument value                */
+#define CC_INVALID 0x20 /* invalid in argument names and values  */
+#define CC_NEWLINE 0x40
+#define CC_LISTEND 0x80 /* ends a value in a matrix list         */
 
-static void ignore_comment(FILE *file);
-static int  read_keyword(FILE *file, char *buffer, int size);
-
-struct read_text_args
-{
-	FILE       *file;
-	char       *buffer;
-	int         size;
-	const char *endswith;
-	const char *invalid;
-	const char *valid; /* if non-NULL, only these chars are valid */
-	int         minlen; /* minum length before considering endswith */
-	bool        keep_ending_char;
-	bool newline_to_space; /* convert newline and following whitespace to a single space */
-	bool allow_comments_within;
-	bool no_eof; /* must not encounter EOF */
+#define MATRIX_MAX_PARAMS 16
+#define MATRIX_MAX_TESTS  10000000
+
+struct Template
+{
+	struct Template *next;
+	char            *name;
+	struct Action   *actionlist;
+	const char     **params; /* parameters referenced by the arguments */
+	int              nparams;
 };
-#define read_text(...) read_text_(&(struct read_text_args) { __VA_ARGS__ })
-static int read_text_(struct read_text_args *args);
 
-static void parse_command(FILE *file, const char *cmdname);
-static void parse_actionlist(FILE *file);
-static void parse_action(FILE *file, const char *actname);
-static void parse_action_args(FILE *file);
+struct MatrixParam
+{
+	char  *name;
+	char **values;
+	int    nvalues;
+};
 
-static int  read_char(FILE *file);
-static void unread_char(FILE *file, int c);
+static unsigned char cclass[256];
+
+static const char *src_begin = NULL;
+static const char *src       = NULL;
+static const char *src_end   = NULL;
+
+static bool        map_input(FILE *file, size_t *size, bool *mapped);
+static void        init_cclass(void);
+static int         peek(void);
+static void        skip_space(void);
+static struct Span scan_keyword(void);
+static struct Span scan_until(unsigned char endclass, const char *what);
+static char       *scan_descr(void);
+static void        where(const char *p, size_t *line, size_t *pos);
+
+static void parse_command(struct Span cmdname);
+static void parse_actionlist(void);
+static void parse_action(struct Span actname);
+static void parse_action_args(void);
+static void parse_matrix(char *descr, struct Span cmdname);
+static void parse_matrix_values(struct MatrixParam *param);
+static void expand_matrix(const char *descr, const struct Template *tmpl,
+                          const struct MatrixParam *params, int nparams);
+static void add_template(char *descr, struct Span cmdname);
+static void template_done(void);
+static void add_param(struct Template *tmpl, const char *str, int *capacity);
+static struct Template *find_template(struct Span name);
+static struct Command  *append_command(char *descr, enum CommandType type);
+static bool             span_is(struct Span span, const char *str);
+static size_t           param_len(const char *p);
 
 static void prettyprint(void);
 static void dumpall(void);
 
-static size_t line    = 1;
-static size_t pos     = 0;
-static size_t prevpos = 0;
-
+static struct Arena      defs_arena     = { 0 };
 static struct Command   *cmdlisthead    = NULL;
 static struct Command  **cmdlist        = &cmdlisthead;
 static struct Action   **curractionlist = NULL;
 static struct Argument **currarglist    = NULL;
+static struct Action    *curraction     = NULL;
+static struct Template  *templates      = NULL;
+static struct Template  *currtemplate   = NULL;
 
 #define WHITESPACE " \t\r\n"
 
-struct Command *parse_test_definitions(FILE *file)
+struct Command *parse_test_definitions(FILE *file, const char *cachepath)
 {
-	char keyword[32] = { 0 };
+	size_t      size;
+	bool        mapped;
+	uint64_t    key = 0;
+	struct Span keyword;
+
+	init_cclass();
+
+	if (!map_input(file, &size, &mapped))
+		exit(1);
+
+	if (cachepath)
+	{
+		key = xxh64(src_begin, size, 0);
+		if ((cmdlisthead = plancache_load(cachepath, key, &defs_arena)))
+			goto done;
+	}
+
+	src     = src_begin;
+	src_end = src_begin + size;
 
-	while (read_keyword(file, keyword, sizeof keyword))
+	for (;;)
 	{
-		parse_command(file, keyword);
-		memset(keyword, 0, sizeof keyword);
+		skip_space();
+		if (src == src_end)
+			break;
+		keyword = scan_keyword();
+		parse_command(keyword);
 	}
 
+	if (cachepath && cmdlisthead)
+		plancache_store(cachepath, key, cmdlisthead);
+
+done:
+	if (mapped)
+		munmap((void *)src_begin, size);
+	else
+		free((void *)src_begin);
+	src_begin = src = src_end = NULL;
+
 	return cmdlisthead;
 }
 
@@ -100,7 +209,102 @@ void print_test_definitions(enum TestPrintStyle style)
 
 void free_cmdlist(void)
 {
-	free_all();
+	arena_free(&defs_arena);
+	plancache_release();
+	cmdlisthead    = NULL;
+	cmdlist        = &cmdlisthead;
+	curractionlist = NULL;
+	currarglist    = NULL;
+	curraction     = NULL;
+	templates      = NULL;
+	currtemplate   = NULL;
+}
+
+/********************************************************
+ * 	expand_params
+ *
+ * 	Substitute template parameters ($name) in str.
+ * 	"$$" is a literal '$', as is a '$' not followed
+ * 	by a name. Returns str itself if there is
+ * 	nothing to substitute, NULL if a parameter
+ * 	isn't bound.
+ *******************************************************/
+
+char *expand_params(struct Arena *arena, const char *str, const struct Binding *bindings,
+                    int nbindings)
+{
+	const struct Binding *b = NULL;
+	const char           *p;
+	char                 *out = NULL, *o = NULL;
+	size_t                len = 0, n;
+
+	if (!strchr(str, '$'))
+		return (char *)str;
+
+	for (int pass = 0; pass < 2; pass++)
+	{
+		for (p = str; *p; p++)
+		{
+			if ('$' != *p || !(n = param_len(p + 1)))
+			{
+				if ('$' == *p && '$' == p[1])
+					p++;
+				if (pass)
+					*o++ = *p;
+				else
+					len++;
+				continue;
+			}
+			for (b = bindings; b < bindings + nbindings; b++)
+			{
+				if (strlen(b->name) == n && !memcmp(b->name, p + 1, n))
+					break;
+			}
+			if (b == bindings + nbindings)
+				return NULL;
+			if (pass)
+				o = stpcpy(o, b->value);
+			else
+				len += strlen(b->value);
+			p += n;
+		}
+		if (!pass)
+			o = out = arena_alloc(arena, len + 1, 0);
+	}
+	*o = 0;
+	return out;
+}
+
+/********************************************************
+ * 	bind_arguments
+ *
+ * 	Returns the argument list of action with the
+ * 	parameters of cmd substituted. Non-templated
+ * 	actions return their own list, otherwise the
+ * 	copy lives in arena.
+ *******************************************************/
+
+struct Argument *bind_arguments(struct Arena *arena, const struct Action *action,
+                                const struct Command *cmd)
+{
+	struct Argument *head = NULL, **tail = &head;
+	char            *str;
+
+	if (!action->templated)
+		return action->arglist;
+
+	for (const struct Argument *arg = action->arglist; arg; arg = arg->next)
+	{
+		*tail = arena_alloc(arena, sizeof **tail, ARENA_ALIGN | ARENA_ZERO);
+
+		str              = expand_params(arena, arg->argname, cmd->bindings, cmd->nbindings);
+		(*tail)->argname = str ? str : arg->argname;
+		str               = expand_params(arena, arg->argvalue, cmd->bindings, cmd->nbindings);
+		(*tail)->argvalue = str ? str : arg->argvalue;
+
+		tail = &(*tail)->next;
+	}
+	return head;
 }
 
 static void dumpall(void)
@@ -108,15 +312,20 @@ static void dumpall(void)
 	struct Command  *cmd;
 	struct Action   *action;
 	struct Argument *arg;
+	struct Arena     tmp   = { 0 };
+	struct ArenaMark mark  = arena_mark(&tmp);
 	int              count = 0;
 
 	for (cmd = cmdlisthead; cmd; cmd = cmd->next)
 	{
-		printf("Test %02d: '%s'\n", ++count, cmd->descr);
+		if (cmd->type == COMMAND_SETTINGS)
+			printf("Settings: '%s'\n", cmd->descr);
+		else
+			printf("Test %02d: '%s'\n", ++count, cmd->descr);
 		for (action = cmd->actionlist; action; action = action->next)
 		{
 			printf(" +-'%s'\n", action->actname);
-			for (arg = action->arglist; arg; arg = arg->next)
+			for (arg = bind_arguments(&tmp, action, cmd); arg; arg = arg->next)
 			{
 				if (arg->argvalue && *arg->argvalue)
 					printf("  +-'%s':'%s'\n", arg->argname, arg->argvalue);
@@ -124,82 +333,91 @@ static void dumpall(void)
 					printf("  +-'%s'\n", arg->argname);
 			}
 		}
+		arena_reset(&tmp, &mark);
 	}
+	arena_free(&tmp);
 }
 
 static void prettyprint(void)
 {
 	struct Command  *cmd;
 	struct Action   *action;
-	struct Argument *arg;
+	struct Argument *arg, *arglist;
+	struct Arena     tmp   = { 0 };
+	struct ArenaMark mark  = arena_mark(&tmp);
 	int              count = 0;
 
 	puts("\n# Test definitions:\n");
 	for (cmd = cmdlisthead; cmd; cmd = cmd->next)
 	{
-		printf("# Test %02d:\n", ++count);
-		printf("test (%s) {\n", cmd->descr);
+		if (cmd->type == COMMAND_SETTINGS)
+			printf(*cmd->descr ? "settings (%s) {\n" : "settings {\n", cmd->descr);
+		else
+		{
+			printf("# Test %02d:\n", ++count);
+			printf("test (%s) {\n", cmd->descr);
+		}
 		for (action = cmd->actionlist; action; action = action->next)
 		{
 			printf("\t%-13s { ", action->actname);
-			for (arg = action->arglist; arg; arg = arg->next)
+			arglist = bind_arguments(&tmp, action, cmd);
+			for (arg = arglist; arg; arg = arg->next)
 			{
-				if (arg != action->arglist)
+				if (arg != arglist)
 					printf(", ");
 				if (arg->argvalue && *arg->argvalue)
 					printf("%s: %s", arg->argname, arg->argvalue);
 				else
 					printf("%s", arg->argname);
 			}
-			if (action->arglist)
+			if (arglist)
 				puts(" }");
 			else
 				puts("}");
 		}
 		puts("}\n");
+		arena_reset(&tmp, &mark);
 	}
 	puts("\n");
+	arena_free(&tmp);
 }
 
-static void add_argument(const char *argname, const char *argvalue)
+static void add_argument(struct Span argname, struct Span argvalue)
 {
-	assert(argname != NULL);
-	assert(argvalue != NULL);
-	int namelen = (int)strlen(argname);
-	int vallen  = (int)strlen(argvalue);
-
 	if (!currarglist)
 	{
-		fprintf(stderr, "%s(): there is no current argument list! (%s)\n",
-		                                                 __func__, argname);
+		fprintf(stderr, "%s(): there is no current argument list! (%.*s)\n",
+		                                   __func__, (int)argname.len, argname.ptr);
 		exit(1);
 	}
 
-	*currarglist = allocate(sizeof **currarglist, true);
+	*currarglist = arena_alloc(&defs_arena, sizeof **currarglist, ARENA_ALIGN | ARENA_ZERO);
 
-	(*currarglist)->argname = allocate(namelen + 1, false);
-	strcpy((*currarglist)->argname, argname);
+	(*currarglist)->argname  = arena_strndup(&defs_arena, argname.ptr, argname.len);
+	(*currarglist)->argvalue = arena_strndup(&defs_arena, argvalue.ptr, argvalue.len);
 
-	(*currarglist)->argvalue = allocate(vallen + 1, false);
-	strcpy((*currarglist)->argvalue, argvalue);
+	if (currtemplate && (memchr(argname.ptr, '$', argname.len) ||
+	                     memchr(argvalue.ptr, '$', argvalue.len)))
+		curraction->templated = true;
 
 	currarglist = &(*currarglist)->next;
 }
 
-static void add_action(const char *actname, int len)
+static void add_action(struct Span actname)
 {
 	if (!curractionlist)
 	{
-		fprintf(stderr, "%s(): there is no current action list! (%s)\n",
-		                                                __func__, actname);
+		fprintf(stderr, "%s(): there is no current action list! (%.*s)\n",
+		                                 __func__, (int)actname.len, actname.ptr);
 		exit(1);
 	}
 
-	*curractionlist = allocate(sizeof **curractionlist, true);
+	*curractionlist = arena_alloc(&defs_arena, sizeof **curractionlist,
+	                              ARENA_ALIGN | ARENA_ZERO);
 
-	(*curractionlist)->actname = allocate(len + 1, false);
-	strcpy((*curractionlist)->actname, actname);
+	(*curractionlist)->actname = arena_strndup(&defs_arena, actname.ptr, actname.len);
 
+	curraction     = *curractionlist;
 	currarglist    = &(*curractionlist)->arglist;
 	curractionlist = &(*curractionlist)->next;
 }
@@ -215,8 +433,10 @@ static void action_done(void)
 	currarglist = NULL;
 }
 
-static void add_command(const char *descr, int len, const char *cmdname)
+static void add_command(char *descr, struct Span cmdname)
 {
+	size_t line, pos;
+
 	if (curractionlist)
 	{
 		fprintf(stderr, "%s(): there's already an unfinalized command! (%s)\n",
@@ -224,24 +444,41 @@ static void add_command(const char *descr, int len, const char *cmdname)
 		exit(1);
 	}
 
-	*cmdlist = allocate(sizeof **cmdlist, true);
-
-	(*cmdlist)->descr = allocate(len + 1, false);
-	strcpy((*cmdlist)->descr, descr);
+	if (span_is(cmdname, "template"))
+	{
+		add_template(descr, cmdname);
+		return;
+	}
 
-	if (!strcmp(cmdname, "test"))
+	if (span_is(cmdname, "settings"))
 	{
-		(*cmdlist)->type = COMMAND_TEST;
+		curractionlist = &append_command(descr, COMMAND_SETTINGS)->actionlist;
+		return;
 	}
-	else
+
+	if (!span_is(cmdname, "test"))
 	{
-		fprintf(stderr, "%s(): Unknown command '%s' on line %zu\n",
-		        __func__, cmdname, line);
+		where(cmdname.ptr, &line, &pos);
+		fprintf(stderr, "%s(): Unknown command '%.*s' on line %zu\n",
+		        __func__, (int)cmdname.len, cmdname.ptr, line);
 		exit(1);
 	}
 
-	curractionlist = &(*cmdlist)->actionlist;
-	cmdlist        = &(*cmdlist)->next;
+	curractionlist = &append_command(descr, COMMAND_TEST)->actionlist;
+}
+
+static struct Command *append_command(char *descr, enum CommandType type)
+{
+	struct Command *cmd;
+
+	cmd = arena_alloc(&defs_arena, sizeof *cmd, ARENA_ALIGN | ARENA_ZERO);
+
+	cmd->descr = descr;
+	cmd->type  = type;
+
+	*cmdlist = cmd;
+	cmdlist  = &cmd->next;
+	return cmd;
 }
 
 static void command_done(void)
@@ -251,15 +488,352 @@ static void command_done(void)
 		fprintf(stderr, "%s(): there is no current command to finalize!\n", __func__);
 		exit(1);
 	}
+	if (currtemplate)
+		template_done();
 	curractionlist = NULL;
 }
 
-static void parse_command(FILE *file, const char *cmdname)
+/********************************************************
+ * 	templates
+ *******************************************************/
+
+static void add_template(char *descr, struct Span cmdname)
+{
+	struct Template *tmpl;
+	size_t           line, pos;
+
+	if (!*descr || find_template((struct Span){ descr, strlen(descr) }))
+	{
+		where(cmdname.ptr, &line, &pos);
+		fprintf(stderr, "%s(): template on line %zu needs a unique name, e.g. "
+		                "'template (name) { ... }'\n", __func__, line);
+		exit(1);
+	}
+
+	tmpl       = arena_alloc(&defs_arena, sizeof *tmpl, ARENA_ALIGN | ARENA_ZERO);
+	tmpl->name = descr;
+	tmpl->next = templates;
+	templates  = tmpl;
+
+	currtemplate   = tmpl;
+	curractionlist = &tmpl->actionlist;
+}
+
+/* Collect the parameters the template's arguments refer to, so a matrix
+ * can be checked for missing ones.
+ */
+static void template_done(void)
+{
+	int capacity = 0;
+
+	for (struct Action *action = currtemplate->actionlist; action; action = action->next)
+	{
+		if (!action->templated)
+			continue;
+		for (struct Argument *arg = action->arglist; arg; arg = arg->next)
+		{
+			add_param(currtemplate, arg->argname, &capacity);
+			add_param(currtemplate, arg->argvalue, &capacity);
+		}
+	}
+	currtemplate = NULL;
+}
+
+static void add_param(struct Template *tmpl, const char *str, int *capacity)
+{
+	const char **params;
+	size_t       n;
+
+	for (const char *p = strchr(str, '$'); p; p = strchr(p + 1, '$'))
+	{
+		if ('$' == p[1])
+		{
+			p++;
+			continue;
+		}
+		if (!(n = param_len(p + 1)))
+			continue;
+
+		for (int i = 0; i < tmpl->nparams; i++)
+		{
+			if (strlen(tmpl->params[i]) == n && !memcmp(tmpl->params[i], p + 1, n))
+			{
+				n = 0;
+				break;
+			}
+		}
+		if (!n)
+			continue;
+
+		if (tmpl->nparams == *capacity)
+		{
+			*capacity = *capacity ? 2 * *capacity : 8;
+			params    = arena_alloc(&defs_arena, *capacity * sizeof *params, ARENA_ALIGN);
+			if (tmpl->nparams)
+				memcpy(params, tmpl->params, tmpl->nparams * sizeof *params);
+			tmpl->params = params;
+		}
+		tmpl->params[tmpl->nparams++] = arena_strndup(&defs_arena, p + 1, n);
+	}
+}
+
+static struct Template *find_template(struct Span name)
+{
+	for (struct Template *tmpl = templates; tmpl; tmpl = tmpl->next)
+	{
+		if (span_is(name, tmpl->name))
+			return tmpl;
+	}
+	return NULL;
+}
+
+/********************************************************
+ * 	matrix
+ *******************************************************/
+
+static void parse_matrix(char *descr, struct Span cmdname)
+{
+	struct MatrixParam params[MATRIX_MAX_PARAMS];
+	struct Template   *tmpl    = NULL;
+	int                nparams = 0, c, i;
+	struct Span        name, value;
+	const char        *at;
+	size_t             line, pos;
+
+	/* We are inside the braces of a matrix. We expect 'name: value' or
+	 * 'name: [value, ...]' entries up to the closing brace, one of them
+	 * naming the template.
+	 */
+
+	for (;;)
+	{
+		skip_space();
+		if (EOF == (c = peek()))
+		{
+			fprintf(stderr, "%s(): EOF while reading matrix '%s'\n", __func__, descr);
+			exit(1);
+		}
+		if (',' == c || '}' == c)
+		{
+			src++;
+			if ('}' == c)
+				break;
+			continue;
+		}
+
+		at   = src;
+		name = scan_until(CC_NAMEEND, "matrix parameter");
+		skip_space();
+		if (!name.len || ':' != peek())
+		{
+			where(at, &line, &pos);
+			fprintf(stderr, "%s(): expected 'name: value' on line %zu, pos %zu\n",
+			        __func__, line, pos);
+			exit(1);
+		}
+		src++;
+		skip_space();
+
+		if (span_is(name, "template"))
+		{
+			at    = src;
+			value = scan_until(CC_VALEND, "template name");
+			if (!(tmpl = find_template(value)))
+			{
+				where(at, &line, &pos);
+				fprintf(stderr, "%s(): unknown template '%.*s' on line %zu, pos %zu\n",
+				        __func__, (int)value.len, value.ptr, line, pos);
+				exit(1);
+			}
+			continue;
+		}
+
+		for (i = 0; i < nparams; i++)
+		{
+			if (span_is(name, params[i].name))
+				break;
+		}
+		if (i < nparams || nparams == MATRIX_MAX_PARAMS)
+		{
+			where(at, &line, &pos);
+			fprintf(stderr, "%s(): %s parameter '%.*s' on line %zu, pos %zu\n", __func__,
+			        i < nparams ? "duplicate" : "too many", (int)name.len, name.ptr,
+			        line, pos);
+			exit(1);
+		}
+		params[nparams] = (struct MatrixParam){
+			.name = arena_strndup(&defs_arena, name.ptr, name.len),
+		};
+		parse_matrix_values(&params[nparams]);
+		nparams++;
+	}
+
+	if (!tmpl)
+	{
+		where(cmdname.ptr, &line, &pos);
+		fprintf(stderr, "%s(): matrix on line %zu has no template\n", __func__, line);
+		exit(1);
+	}
+
+	for (int k = 0; k < tmpl->nparams; k++)
+	{
+		for (i = 0; i < nparams; i++)
+		{
+			if (!strcmp(tmpl->params[k], params[i].name))
+				break;
+		}
+		if (i == nparams)
+		{
+			where(cmdname.ptr, &line, &pos);
+			fprintf(stderr, "%s(): matrix on line %zu has no values for $%s (template '%s')\n",
+			        __func__, line, tmpl->params[k], tmpl->name);
+			exit(1);
+		}
+	}
+
+	expand_matrix(descr, tmpl, params, nparams);
+}
+
+static void parse_matrix_values(struct MatrixParam *param)
 {
-	int  c;
-	int  descr_len  = 0;
-	char descr[112] = { 0 };
-	bool has_descr = false, has_actionlist = false;
+	struct Span value;
+	int         capacity = 0, c;
+	char      **values;
+	bool        list;
+	size_t      line, pos;
+
+	if ((list = '[' == peek()))
+		src++;
+
+	for (;;)
+	{
+		if (list)
+		{
+			skip_space();
+			if (EOF == (c = peek()))
+			{
+				fprintf(stderr, "%s(): EOF while reading values for '%s'\n", __func__,
+				        param->name);
+				exit(1);
+			}
+			if (',' == c)
+			{
+				src++;
+				continue;
+			}
+			if (']' == c)
+			{
+				src++;
+				break;
+			}
+		}
+
+		value = scan_until(list ? CC_LISTEND : CC_VALEND, "matrix value");
+		if (!value.len)
+		{
+			where(src, &line, &pos);
+			fprintf(stderr, "%s(): missing value for '%s' on line %zu, pos %zu\n",
+			        __func__, param->name, line, pos);
+			exit(1);
+		}
+
+		if (param->nvalues == capacity)
+		{
+			capacity = capacity ? 2 * capacity : 8;
+			values   = arena_alloc(&defs_arena, capacity * sizeof *values, ARENA_ALIGN);
+			if (param->nvalues)
+				memcpy(values, param->values, param->nvalues * sizeof *values);
+			param->values = values;
+		}
+		param->values[param->nvalues++] = arena_strndup(&defs_arena, value.ptr, value.len);
+
+		if (!list)
+			break;
+	}
+
+	if (!param->nvalues)
+	{
+		fprintf(stderr, "%s(): empty list for '%s'\n", __func__, param->name);
+		exit(1);
+	}
+}
+
+static void expand_matrix(const char *descr, const struct Template *tmpl,
+                          const struct MatrixParam *params, int nparams)
+{
+	struct Binding *bindings;
+	struct Command *cmd;
+	long            total = 1, rem;
+	char           *d, *o;
+	size_t          len;
+
+	for (int i = 0; i < nparams; i++)
+	{
+		if (total > MATRIX_MAX_TESTS / params[i].nvalues)
+		{
+			fprintf(stderr, "%s(): matrix '%s' expands to more than %d tests\n", __func__,
+			        descr, MATRIX_MAX_TESTS);
+			exit(1);
+		}
+		total *= params[i].nvalues;
+	}
+
+	for (long k = 0; k < total; k++)
+	{
+		bindings = NULL;
+		if (nparams)
+			bindings = arena_alloc(&defs_arena, nparams * sizeof *bindings, ARENA_ALIGN);
+
+		rem = k;
+		for (int i = nparams - 1; i >= 0; i--)
+		{
+			bindings[i].name  = params[i].name;
+			bindings[i].value = params[i].values[rem % params[i].nvalues];
+			rem /= params[i].nvalues;
+		}
+
+		if (*descr)
+		{
+			if (!(d = expand_params(&defs_arena, descr, bindings, nparams)))
+			{
+				fprintf(stderr, "%s(): description '%s' refers to a parameter "
+				                "the matrix doesn't have\n", __func__, descr);
+				exit(1);
+			}
+		}
+		else
+		{
+			/* default description: "template: a=1, b=2" */
+			len = strlen(tmpl->name) + 2;
+			for (int i = 0; i < nparams; i++)
+				len += strlen(bindings[i].name) + strlen(bindings[i].value) + 3;
+			o = d = arena_alloc(&defs_arena, len + 1, 0);
+			o     = stpcpy(o, tmpl->name);
+			*o++  = ':';
+			for (int i = 0; i < nparams; i++)
+			{
+				o    = stpcpy(o, i ? ", " : " ");
+				o    = stpcpy(o, bindings[i].name);
+				*o++ = '=';
+				o    = stpcpy(o, bindings[i].value);
+			}
+			*o = 0;
+		}
+
+		cmd             = append_command(d, COMMAND_TEST);
+		cmd->actionlist = tmpl->actionlist;
+		cmd->bindings   = bindings;
+		cmd->nbindings  = nparams;
+	}
+}
+
+static void parse_command(struct Span cmdname)
+{
+	int         c;
+	const char *at;
+	char       *descr     = NULL;
+	bool        has_descr = false, has_actionlist = false;
+	size_t      line, pos;
 
 	/* A command keyword has been read, we now expect an optional
 	 * description in parentheses, an opening brace '{' followed by a
@@ -267,42 +841,36 @@ static void parse_command(FILE *file, const char *cmdname)
 	 * closing brace '}'. We ignore white space and comments.
 	 */
 
-	while (EOF != (c = read_char(file)))
+	for (;;)
 	{
+		skip_space();
+		if (EOF == (c = peek()))
+			break;
+		at = src++;
+
 		if ('}' == c)
 		{
 			if (!has_actionlist)
 			{
+				where(at, &line, &pos);
 				fprintf(stderr, "%s(): unexpected closing brace on line %zu, pos %zu\n",
 				        __func__, line, pos);
 				exit(1);
 			}
-			break;
-		}
-
-		if (strchr(WHITESPACE, c))
-			continue;
-
-		if ('#' == c)
-		{
-			ignore_comment(file);
-			continue;
+			command_done();
+			return;
 		}
 
 		if ('(' == c)
 		{
 			if (has_descr)
 			{
+				where(at, &line, &pos);
 				fprintf(stderr, "%s(): command already has description '%s' (line %zu, pos %zu)\n",
 				        __func__, descr, line, pos);
 				exit(1);
 			}
-			descr_len = read_text(.file = file, .buffer = descr,
-			                      .size = sizeof descr, .endswith = ")",
-			                      .invalid = "{}(", .newline_to_space = true,
-			                      .keep_ending_char      = false,
-			                      .allow_comments_within = true,
-			                      .no_eof                = true);
+			descr     = scan_descr();
 			has_descr = true;
 			continue;
 		}
@@ -311,38 +879,34 @@ static void parse_command(FILE *file, const char *cmdname)
 		{
 			if (has_actionlist)
 			{
+				where(at, &line, &pos);
 				fprintf(stderr, "%s(): cannot have nested commands, line %zu, pos %zu\n",
 				        __func__, line, pos);
 				exit(1);
 			}
-			add_command(descr, descr_len, cmdname);
-			parse_actionlist(file);
+			if (span_is(cmdname, "matrix"))
+			{
+				parse_matrix(descr ? descr : arena_strdup(&defs_arena, ""), cmdname);
+				return;
+			}
+			add_command(descr ? descr : arena_strdup(&defs_arena, ""), cmdname);
+			parse_actionlist();
 			has_actionlist = true;
 			continue;
 		}
+		where(at, &line, &pos);
 		fprintf(stderr, "%s(): Invalid char '%c' on line %zu, pos %zu\n",
 		        __func__, c, line, pos);
 		exit(1);
 	}
 
-	if (EOF == c)
-	{
-		if (feof(file))
-			fprintf(stderr, "%s(): EOF while reading command '%s'\n",
-			        __func__, descr);
-		else
-			perror(__func__);
-		exit(1);
-	}
-
-	command_done();
+	fprintf(stderr, "%s(): EOF while reading command '%s'\n", __func__, descr ? descr : "");
+	exit(1);
 }
 
-static void parse_actionlist(FILE *file)
+static void parse_actionlist(void)
 {
-	int  c;
-	char actname[48] = { 0 };
-	int  len;
+	struct Span actname;
 
 	/* We are inside the braces '{...}' of a command. We expect a list of actions or a closing
 	 * brace '}' which ends the action list.
@@ -350,107 +914,73 @@ static void parse_actionlist(FILE *file)
 	 * Ignore spaces and comments.
 	 */
 
-	while (EOF != (c = read_char(file)))
+	for (;;)
 	{
-		if ('}' == c)
-		{
-			unread_char(file, c);
+		skip_space();
+		if (peek() == EOF || peek() == '}')
 			return;
-		}
-
-		if (strchr(WHITESPACE, c))
-		{
-			continue;
-		}
 
-		if ('#' == c)
-		{
-			ignore_comment(file);
-			continue;
-		}
-
-		unread_char(file, c);
-
-		len = read_keyword(file, actname, sizeof actname);
-		if (len == 0)
-		{
-			fprintf(stderr, "%s(): Panic, empty action name around line %zu, pos %zu\n",
-			        __func__, line, pos);
-			exit(1);
-		}
-		add_action(actname, len);
-		parse_action(file, actname);
+		actname = scan_keyword();
+		add_action(actname);
+		parse_action(actname);
 		action_done();
 	}
 }
 
-static void parse_action(FILE *file, const char *actname)
+static void parse_action(struct Span actname)
 {
-	int c;
+	int    c;
+	size_t line, pos;
 
-	while (EOF != (c = read_char(file)))
+	skip_space();
+	if (EOF == (c = peek()))
 	{
-		if (strchr(WHITESPACE, c))
-			continue;
-
-		if ('#' == c)
-		{
-			ignore_comment(file);
-			continue;
-		}
-
-		if ('{' == c)
-		{
-			parse_action_args(file);
-			return;
-		}
-
-		fprintf(stderr, "%s(): Invalid char '%c' on line %zu, pos %zu, expected action arguments\n",
-		        __func__, c, line, pos);
+		fprintf(stderr, "%s(): EOF while reading action '%.*s'\n", __func__,
+		        (int)actname.len, actname.ptr);
 		exit(1);
 	}
 
-	if (EOF == c)
+	if ('{' == c)
 	{
-		if (!feof(file))
-			perror(__func__);
-		else
-			fprintf(stderr, "%s(): EOF while reading action '%s'\n",
-			        __func__, actname);
-		exit(1);
+		src++;
+		parse_action_args();
+		return;
 	}
+
+	where(src, &line, &pos);
+	fprintf(stderr, "%s(): Invalid char '%c' on line %zu, pos %zu, expected action arguments\n",
+	        __func__, c, line, pos);
+	exit(1);
 }
 
-static void parse_action_args(FILE *file)
+static void parse_action_args(void)
 {
-	int  c;
-	char arg[48] = { 0 }, val[48] = { 0 };
-	bool have_arg = false;
+	int         c;
+	struct Span arg = { "", 0 }, val = { "", 0 };
+	bool        have_arg = false;
+	size_t      line, pos;
 
-	while (EOF != (c = read_char(file)))
+	for (;;)
 	{
-		if (strchr(WHITESPACE, c))
-			continue;
-
-		if ('#' == c)
+		skip_space();
+		if (EOF == (c = peek()))
 		{
-			ignore_comment(file);
-			continue;
+			fprintf(stderr, "%s(): EOF while reading action arguments\n", __func__);
+			exit(1);
 		}
 
 		if (',' == c || '}' == c)
 		{
+			src++;
 			if (have_arg)
 			{
 				add_argument(arg, val);
-				arg[0] = val[0] = 0;
-				have_arg        = false;
+				arg.len = val.len = 0;
+				have_arg          = false;
 			}
 
 			if ('}' == c)
-			{
 				break;
-			}
 			continue;
 		}
 
@@ -458,207 +988,287 @@ static void parse_action_args(FILE *file)
 		{
 			if (':' == c)
 			{
+				where(src, &line, &pos);
 				fprintf(stderr, "%s(): stray ':' on line %zu, pos %zu\n",
 				        __func__, line, pos);
 				exit(1);
 			}
-			unread_char(file, c);
-			if (read_text(.file = file, .buffer = arg, .size = sizeof arg,
-			              .no_eof = true, .endswith = ":,}" WHITESPACE,
-			              .invalid = "{(", .keep_ending_char = true))
-			{
-				have_arg = true;
-			}
+			arg      = scan_until(CC_NAMEEND, "argument name");
+			val      = (struct Span){ "", 0 };
+			have_arg = arg.len > 0;
 		}
 		else
 		{
+			src++;
 			if (':' == c)
 			{
-				read_text(.file = file, .buffer = val, .size = sizeof val,
-				          .no_eof = true, .endswith = ",}" WHITESPACE,
-				          .invalid = "{(:", .keep_ending_char = true);
+				skip_space();
+				val = scan_until(CC_VALEND, "argument value");
 			}
 		}
 	}
 }
 
-static int read_text_(struct read_text_args *args)
+/********************************************************
+ * 	scanner
+ *******************************************************/
+
+static void init_cclass(void)
 {
-	int  c;
-	int  len = 0, limbo_len = 0;
-	char limbo_space[112] = { 0 };
+	static const char keyword[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_-";
+	static const char kwend[]   = "({,;:\"'`#" WHITESPACE;
+
+	memset(cclass, 0, sizeof cclass);
+
+	for (const char *s = WHITESPACE; *s; s++)
+		cclass[(unsigned char)*s] |= CC_SPACE | CC_NAMEEND | CC_VALEND;
+	for (const char *s = keyword; *s; s++)
+		cclass[(unsigned char)*s] |= CC_KEYWORD;
+	for (const char *s = kwend; *s; s++)
+		cclass[(unsigned char)*s] |= CC_KWEND;
+	for (const char *s = ":,}#"; *s; s++)
+		cclass[(unsigned char)*s] |= CC_NAMEEND;
+	for (const char *s = ",}#"; *s; s++)
+		cclass[(unsigned char)*s] |= CC_VALEND;
+	for (const char *s = ",]}#" WHITESPACE; *s; s++)
+		cclass[(unsigned char)*s] |= CC_LISTEND;
+	cclass['{'] |= CC_INVALID;
+	cclass['('] |= CC_INVALID;
+	cclass['\r'] |= CC_NEWLINE;
+	cclass['\n'] |= CC_NEWLINE;
+}
 
-	assert(args->size > 0);
+static int peek(void)
+{
+	return src < src_end ? (unsigned char)*src : EOF;
+}
 
-	while (len < args->size - 1 && EOF != (c = read_char(args->file)))
-	{
-		if (len == 0 && strchr(WHITESPACE, c))
-			continue;
+/* skip white space and comments */
 
-		if (len == 0 && '#' == c)
+static void skip_space(void)
+{
+	while (src < src_end)
+	{
+		if (cclass[(unsigned char)*src] & CC_SPACE)
+			src++;
+		else if ('#' == *src)
 		{
-			ignore_comment(args->file);
-			continue;
+			const char *nl = memchr(src, '\n', src_end - src);
+			src            = nl ? nl : src_end;
 		}
-
-		if (len >= args->minlen && strchr(args->endswith, c))
-		{
-			if (args->keep_ending_char)
-				unread_char(args->file, c);
+		else
 			break;
-		}
+	}
+}
 
-		if ('#' == c)
-		{
-			if (args->allow_comments_within)
-			{
-				ignore_comment(args->file);
-				continue;
-			}
-			unread_char(args->file, c);
-			break;
-		}
+static struct Span scan_keyword(void)
+{
+	struct Span kw = { src, 0 };
+	size_t      line, pos;
 
-		if (args->valid && !strchr(args->valid, c))
-		{
-			fprintf(stderr, "%s(): invalid character '%c' on line %zu, pos %zu\n",
-			        __func__, c, line, pos);
-			exit(1);
-		}
+	while (src < src_end && (cclass[(unsigned char)*src] & CC_KEYWORD))
+		src++;
+	kw.len = src - kw.ptr;
+
+	if (src < src_end && !(cclass[(unsigned char)*src] & CC_KWEND))
+	{
+		where(src, &line, &pos);
+		fprintf(stderr, "%s(): invalid character '%c' on line %zu, pos %zu\n",
+		        __func__, *src, line, pos);
+		exit(1);
+	}
+	if (kw.len == 0)
+	{
+		where(src, &line, &pos);
+		fprintf(stderr, "%s(): Invalid keyword on line %zu, pos %zu\n", __func__, line, pos);
+		exit(1);
+	}
+	return kw;
+}
 
-		if (args->invalid && strchr(args->invalid, c))
+/* argument names and values: everything up to a char of endclass */
+
+static struct Span scan_until(unsigned char endclass, const char *what)
+{
+	struct Span span = { src, 0 };
+	size_t      line, pos;
+
+	while (src < src_end && !(cclass[(unsigned char)*src] & endclass))
+	{
+		if (cclass[(unsigned char)*src] & CC_INVALID)
 		{
+			where(src, &line, &pos);
 			fprintf(stderr, "%s(): invalid character '%c' on line %zu, pos %zu\n",
-			        __func__, c, line, pos);
+			        __func__, *src, line, pos);
 			exit(1);
 		}
+		src++;
+	}
+	span.len = src - span.ptr;
 
-		if (strchr(WHITESPACE, c))
-		{
-			if (args->newline_to_space && strchr("\r\n", c))
-			{
-				while (EOF != (c = read_char(args->file)))
-				{
-					if (strchr(WHITESPACE, c))
-						continue;
-					unread_char(args->file, c);
-					break;
-				}
-				c = ' ';
-			}
+	if (src == src_end)
+	{
+		fprintf(stderr, "%s(): EOF while reading %s: '%.*s'\n", __func__, what,
+		        (int)span.len, span.ptr);
+		exit(1);
+	}
+	return span;
+}
 
-			if ((size_t)limbo_len + 1 >= sizeof limbo_space - 1)
-			{
-				fprintf(stderr, "%s(): ran out of limbo space on line %zu\n",
-				        __func__, line);
-				exit(1);
-			}
-			limbo_space[limbo_len++] = c;
+/* Description, up to the closing ')'. Comments are allowed, line breaks
+ * (with the white space following them) become a single space, leading
+ * and trailing white space is dropped. Returns the NUL-terminated copy
+ * in the definitions arena.
+ */
+
+static char *scan_descr(void)
+{
+	const char *start = src;
+	char       *out;
+	size_t      len = 0, keep = 0;
+	size_t      line, pos;
+
+	while (src < src_end && ')' != *src)
+	{
+		if ('#' == *src)
+		{
+			const char *nl = memchr(src, '\n', src_end - src);
+			src            = nl ? nl : src_end;
 			continue;
 		}
-
-		if (limbo_len > 0)
+		if ('{' == *src || '}' == *src || '(' == *src)
 		{
-			if (len + limbo_len > args->size - 2)
-			{
-				fprintf(stderr, "%s(): buffer too short to fit limbo space on line %zu\n",
-				        __func__, line);
-				exit(1);
-			}
-			strcat(args->buffer, limbo_space);
-			len += limbo_len;
-			memset(limbo_space, 0, sizeof limbo_space);
-			limbo_len = 0;
+			where(src, &line, &pos);
+			fprintf(stderr, "%s(): invalid character '%c' on line %zu, pos %zu\n",
+			        __func__, *src, line, pos);
+			exit(1);
 		}
-		args->buffer[len++] = c;
+		src++;
 	}
-	args->buffer[len] = 0;
-
-	if (len == args->size - 1)
+	if (src == src_end)
 	{
-		fprintf(stderr, "%s(): buffer too short on line %zu\n", __func__, line);
+		fprintf(stderr, "%s(): EOF while reading description: '%.*s'\n", __func__,
+		        (int)(src - start), start);
 		exit(1);
 	}
 
-	if (EOF == c)
+	/* the result is never longer than the source */
+	out = arena_alloc(&defs_arena, src - start + 1, 0);
+
+	for (const char *p = start; p < src; p++)
 	{
-		if (!feof(args->file))
+		if ('#' == *p)
 		{
-			perror(__func__);
-			exit(1);
+			while (p + 1 < src && '\n' != p[1])
+				p++;
+			continue;
 		}
-		if (args->no_eof)
+		if (cclass[(unsigned char)*p] & CC_SPACE)
 		{
-			fprintf(stderr, "%s(): EOF while reading text: '%s'\n",
-			        __func__, args->buffer);
-			exit(1);
+			if (len == 0)
+				continue;
+			if (cclass[(unsigned char)*p] & CC_NEWLINE)
+			{
+				while (p + 1 < src && (cclass[(unsigned char)p[1]] & CC_SPACE))
+					p++;
+				out[len++] = ' ';
+			}
+			else
+				out[len++] = *p;
+			continue;
 		}
+		out[len++] = *p;
+		keep       = len;
 	}
+	out[keep] = '\0';
+	src++; /* ')' */
 
-	return len;
+	return out;
 }
 
-static int read_keyword(FILE *file, char *buffer, int size)
-{
-	static const char valid[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_-";
+/* line and position (1-based) of p, for error messages */
 
-	int len = read_text(.file = file, .buffer = buffer, .size = size,
-	                    .endswith = "({,;:\"'`#" WHITESPACE, .minlen = 1,
-	                    .valid = valid, .keep_ending_char = true,
-	                    .allow_comments_within = false);
+static void where(const char *p, size_t *line, size_t *pos)
+{
+	const char *linestart = src_begin;
 
-	if (len == 0 && !feof(file))
+	*line = 1;
+	for (const char *s = src_begin; s < p; s++)
 	{
-		fprintf(stderr, "%s(): Invalid keyword on line %zu, pos %zu\n", __func__, line, pos + 1);
-		exit(1);
+		if ('\n' == *s)
+		{
+			(*line)++;
+			linestart = s + 1;
+		}
 	}
-	return len;
+	*pos = p - linestart + 1;
 }
 
-static void ignore_comment(FILE *file)
+/* Map the test definition file. If that's not possible (e.g. a pipe),
+ * read it into a malloc'ed buffer instead.
+ */
+
+static bool map_input(FILE *file, size_t *size, bool *mapped)
 {
-	int c;
+	struct stat st;
+	char       *buf = NULL, *tmp;
+	size_t      alloc = 0, n;
+	void       *map;
 
-	while (EOF != (c = read_char(file)))
+	if (!fstat(fileno(file), &st) && S_ISREG(st.st_mode) && st.st_size > 0)
 	{
-		if (c == '\n')
+		map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+		if (map != MAP_FAILED)
 		{
-			unread_char(file, c);
-			return;
+			src_begin = map;
+			*size     = (size_t)st.st_size;
+			*mapped   = true;
+			return true;
 		}
 	}
-}
-
-static int read_char(FILE *file)
-{
-	int c;
 
-	c = getc(file);
-	if ('\n' == c)
+	*size = 0;
+	do
 	{
-		line++;
-		prevpos = pos;
-		pos     = 0;
-	}
-	else
+		if (alloc - *size < 4096)
+		{
+			alloc = alloc ? 2 * alloc : 65536;
+			if (!(tmp = realloc(buf, alloc)))
+			{
+				perror(__func__);
+				free(buf);
+				return false;
+			}
+			buf = tmp;
+		}
+		n = fread(buf + *size, 1, alloc - *size, file);
+		*size += n;
+	} while (n > 0);
+
+	if (ferror(file))
 	{
-		pos++;
+		perror(__func__);
+		free(buf);
+		return false;
 	}
 
-	return c;
+	src_begin = buf;
+	*mapped   = false;
+	return true;
 }
 
-static void unread_char(FILE *file, int c)
+static bool span_is(struct Span span, const char *str)
 {
-	if ('\n' == c)
-	{
-		line--;
-		pos = prevpos;
-	}
-	else
-	{
-		pos--;
-	}
+	return strlen(str) == span.len && !memcmp(span.ptr, str, span.len);
+}
+
+/* length of the parameter name starting at p */
+
+static size_t param_len(const char *p)
+{
+	size_t n = 0;
 
-	ungetc(c, file);
+	while (p[n] && (isalnum((unsigned char)p[n]) || '_' == p[n]))
+		n++;
+	return n;
 }
@@ -17,18 +17,28 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+struct ActionDef;
+struct Arena;
+
 struct Argument
 {
 	struct Argument *next;
-	char            *argname;
-	char            *argvalue;
+	const char      *argname;
+	const char      *argvalue;
+	/* the value resolved by plan_compile(), see plan.h */
+	int              id;    /* OptDef.id of the option */
+	int              word;  /* OPT_WORD: index in OptDef.words */
+	double           num;   /* OPT_INT, OPT_NUM */
+	const void      *value; /* OPT_PARSED */
 };
 
 struct Action
 {
-	struct Action   *next;
-	char            *actname;
-	struct Argument *arglist;
+	struct Action          *next;
+	char                   *actname;
+	struct Argument        *arglist;
+	const struct ActionDef *def;       /* set by plan_compile() */
+	bool                    templated; /* arguments refer to template parameters */
 };
 
 enum CommandType
@@ -37,12 +47,26 @@ enum CommandType
 	COMMAND_SETTINGS,
 };
 
+/* Template parameter of a test generated by a matrix. The generated
+ * tests share the template's action list, each has its own bindings.
+ */
+struct Binding
+{
+	const char *name;
+	const char *value;
+};
+
 struct Command
 {
-	struct Command  *next;
-	enum CommandType type;
-	char            *descr;
-	struct Action   *actionlist;
+	struct Command       *next;
+	enum CommandType      type;
+	char                 *descr;
+	struct Action        *actionlist;
+	const struct Binding *bindings;
+	int                   nbindings;
+	const struct Action  *sweep;     /* action with a file pattern, set by plan_compile() */
+	struct Argument     **boundargs; /* per templated action: its arguments with the
+	                                  * bindings substituted, set by plan_compile() */
 };
 
 enum TestPrintStyle
@@ -51,6 +75,10 @@ enum TestPrintStyle
 	PRINTSTYLE_PRETTY,
 };
 
-struct Command *parse_test_definitions(FILE *file);
+struct Command *parse_test_definitions(FILE *file, const char *cachepath);
 void            print_test_definitions(enum TestPrintStyle style);
 void            free_cmdlist(void);
+char            *expand_params(struct Arena *arena, const char *str,
+                               const struct Binding *bindings, int nbindings);
+struct Argument *bind_arguments(struct Arena *arena, const struct Action *action,
+                                const struct Command *cmd);
@@ -17,15 +17,22 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <stdbool.h>
 #include <assert.h>
 #include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
 
 #include <png.h>
 #include <bmplib.h>
@@ -34,46 +41,582 @@
 #include "imgstack.h"
 #include "testparser.h"
 #include "conf.h"
+#include "compare.h"
+#include "channels.h"
+#include "palette.h"
+#include "kernels.h"
+#include "imgstats.h"
+#include "hash.h"
+#include "manifest.h"
+#include "refcache.h"
+#include "bufpool.h"
+#include "allocate.h"
+#include "plan.h"
+#include "dirscan.h"
 
 const unsigned char checkmark[] = { 0x20, 0xE2, 0x9C, 0x93, 0 };
 
-static bool            perform(struct Action *action);
-static bool            perform_loadraw(struct Argument *args);
-static bool            perform_loadbmp(struct Argument *args);
-static bool            perform_loadpng(struct Argument *args);
-static bool            perform_savebmp(struct Argument *args);
-static bool            perform_swap(void);
-static bool            perform_duplicate(void);
-static bool            perform_compare(struct Argument *args);
-static bool            perform_rawcompare(struct Argument *args);
-static bool            perform_delete(void);
-static bool            perform_convertgamma(struct Argument *args);
-static bool            perform_flatten(void);
-static bool            perform_exposure(struct Argument *args);
-static bool            perform_convertformat(struct Argument *args);
-static bool            perform_invertpalette(void);
+enum BufferMode /* in the order of the loadbmp buffer: values */
+{
+	BUFFER_INTERNAL, /* bmplib allocates the buffer */
+	BUFFER_ALIGNED,  /* fresh aligned_alloc() buffer */
+	BUFFER_POOLED,   /* from the buffer pool */
+};
+
+struct LoadTiming
+{
+	struct timespec start;
+	long            minflt;
+};
+
+struct ResultRead
+{
+	BMPRESULT loadinfo;
+	BMPRESULT arrayinfo;
+	int       arraynum;
+	bool      arraynum_explicit;
+	BMPRESULT loadicc;
+	BMPRESULT set64bit;
+	BMPRESULT setformat;
+	int       numcolors;
+	bool      numcolors_explicit;
+	BMPRESULT loadpalette;
+	BMPRESULT loadimage;
+};
+
+/* loadbmp/savebmp options, initialized from the suite's settings */
+
+struct LoadOptions
+{
+	bool              line_by_line;
+	bool              index;
+	bool              set_undef;
+	BMPUNDEFINED      undefmode;
+	bool              set_conv64;
+	BMPCONV64         conv64;
+	bool              set_format;
+	BMPFORMAT         format;
+	bool              insane;
+	bool              loadicc;
+	bool              icc_loadonly;
+	int               array_idx;
+	bool              set_huff_t4black;
+	int               huff_t4black;
+	enum BufferMode   buffer_mode;
+	struct ResultRead results;
+};
+
+struct SaveOptions
+{
+	bool       line_by_line;
+	int        bufferbits;
+	bool       set_format;
+	BMPFORMAT  format;
+	bool       set_rle;
+	BMPRLETYPE rle;
+	bool       set_intent;
+	BMPINTENT  intent;
+	bool       set_outbits;
+	int        outbits[4];
+	bool       set_64bit;
+	bool       allow_huff;
+	bool       allow_2bit;
+	bool       allow_rle24;
+	bool       set_huff_fgidx;
+	int        huff_fgidx;
+	bool       set_huff_t4black;
+	int        huff_t4black;
+	bool       icc_embed;
+	bool       loadraw_after_save;
+};
+
+/* Suite-wide defaults from settings blocks, resolved once before any
+ * test is run (see apply_settings()).
+ */
+struct Settings
+{
+	struct LoadOptions load;
+	struct SaveOptions save;
+	bool               timing;     /* report times regardless of -v */
+	int                iterations; /* run each test this many times */
+	bool               refcache;
+};
+
+/* Option values converted by the parse_*() functions below, when the plan
+ * is compiled.
+ */
+
+enum ReadStep
+{
+	READ_LOADINFO,
+	READ_ARRAYINFO,
+	READ_ARRAYNUM,
+	READ_LOADICC,
+	READ_SET64BIT,
+	READ_SETFORMAT,
+	READ_NUMCOLORS,
+	READ_LOADPALETTE,
+	READ_LOADIMAGE,
+};
+
+struct ExpectRead /* loadbmp expect: */
+{
+	enum ReadStep step;
+	BMPRESULT     result;
+	int           num; /* READ_ARRAYNUM, READ_NUMCOLORS */
+};
+
+struct OutBits /* savebmp outbits: */
+{
+	int bits[4]; /* r, g, b, a; -1 if not given */
+};
+
+#define MAX_RAWBYTES 100
+
+struct HexBytes /* rawcompare bytes: */
+{
+	int     n;
+	uint8_t bytes[];
+};
+
+struct ChannelValues /* stats expect-min/max/mean: */
+{
+	int    n;
+	double v[4];
+};
+
+struct TileSize /* tile size: */
+{
+	int w;
+	int h;
+};
+
+/* the dir argument of loadbmp, loadpng and loadraw */
+enum Dir
+{
+	DIR_BMPSUITE,
+	DIR_SAMPLE,
+	DIR_TMP,
+	DIR_REF,
+};
+
+static bool            parse_expected_read_result(const char *str, struct Argument *arg,
+                                                  struct Arena *arena);
+static bool            parse_outbits(const char *str, struct Argument *arg, struct Arena *arena);
+static bool            parse_dimension(const char *str, struct Argument *arg, struct Arena *arena);
+static bool            parse_nonnegative(const char *str, struct Argument *arg,
+                                         struct Arena *arena);
+static bool            parse_positive(const char *str, struct Argument *arg, struct Arena *arena);
+static bool            parse_count(const char *str, struct Argument *arg, struct Arena *arena);
+static bool            parse_hex_bytes(const char *str, struct Argument *arg, struct Arena *arena);
+static bool            parse_channel_values(const char *str, struct Argument *arg,
+                                            struct Arena *arena);
+static bool            parse_xxh64(const char *str, struct Argument *arg, struct Arena *arena);
+static bool            parse_tile_size(const char *str, struct Argument *arg, struct Arena *arena);
+static bool            parse_channel_map(const char *str, struct Argument *arg,
+                                         struct Arena *arena);
+static bool            parse_palette_order(const char *str, struct Argument *arg,
+                                           struct Arena *arena);
+static bool            perform_loadraw(const struct Argument *args);
+static bool            perform_loadbmp(const struct Argument *args);
+static void            loadbmp_option(struct LoadOptions *opt, const struct Argument *arg);
+static void            timing_start(struct LoadTiming *t);
+static void            timing_report(const struct LoadTiming *t, const char *mode);
+static bool            perform_loadpng(const struct Argument *args);
+static bool            perform_savebmp(const struct Argument *args);
+static void            savebmp_option(struct SaveOptions *opt, const struct Argument *arg);
+static bool            settings_loadbmp(const struct Argument *args);
+static bool            settings_savebmp(const struct Argument *args);
+static bool            settings_timing(const struct Argument *args);
+static bool            settings_cache(const struct Argument *args);
+static bool            apply_settings(const struct Command *cmdlist);
+static bool            perform_swap(const struct Argument *args);
+static bool            perform_duplicate(const struct Argument *args);
+static bool            perform_crop(const struct Argument *args);
+static bool            perform_tile(const struct Argument *args);
+static bool            perform_compare(const struct Argument *args);
+static bool            perform_rawcompare(const struct Argument *args);
+static bool            perform_stats(const struct Argument *args);
+static bool            perform_expect_hash(const struct Argument *args);
+static bool            perform_delete(const struct Argument *args);
+static bool            perform_convertgamma(const struct Argument *args);
+static bool            perform_flatten(const struct Argument *args);
+static bool            perform_exposure(const struct Argument *args);
+static bool            perform_convertformat(const struct Argument *args);
+static bool            perform_invertpalette(const struct Argument *args);
+static bool            perform_remappalette(const struct Argument *args);
 static void            convert_format(BMPFORMAT format, int bits);
-static void            set_exposure(double fstops);
+static void            set_exposure(double fstops, bool clip);
 static struct Image   *pngfile_read(FILE *file);
 static void            trim_trailing_slash(char *str);
-static bool            perform_addalpha(void);
-static inline uint16_t float_to_s2_13(double d);
-static inline double   s2_13_to_double(uint16_t s2_13);
+static const char     *dir_path(enum Dir dir);
+static int             dir_fd(enum Dir dir);
+static FILE           *open_in_dir(enum Dir dir, const char *fname);
+static void            close_dirs(void);
+static bool            perform_addalpha(const struct Argument *args);
+static bool            perform_channels(const struct Argument *args);
 bool                   bmpresult_from_str(const char *str, BMPRESULT *res);
 const char* bmpresult_as_str(BMPRESULT result);
-bool        rendering_intent_from_str(const char *str, BMPINTENT *intent);
-static bool run_test(struct Command *cmd, int testnum);
+const char *format_as_str(BMPFORMAT format);
+static bool run_test(struct Command *cmd, int testnum, const char *match, const char *descr);
+static bool run_actions(struct Command *cmd, const char *match, bool first);
+static void run_sweep(struct Command *cmd, int testnum, int *good, int *bad);
+static void count_result(bool failed, int *good, int *bad);
 
 static struct Conf *conf;
 static FILE        *rawfile = NULL;
+static const char  *current_test    = NULL;
+static bool         manifest_loaded = false;
+static struct Arena scratch         = { 0 }; /* per-test scratch memory, reset after each test */
+
+static struct Settings settings = {
+	.load       = { .format       = BMP_FORMAT_INT,
+	                .array_idx    = -1,
+	                .huff_t4black = 1,
+	                .buffer_mode  = BUFFER_INTERNAL,
+	                .results      = { .loadinfo    = BMP_RESULT_OK,
+	                                  .arrayinfo   = BMP_RESULT_OK,
+	                                  .loadicc     = BMP_RESULT_OK,
+	                                  .set64bit    = BMP_RESULT_OK,
+	                                  .setformat   = BMP_RESULT_OK,
+	                                  .loadpalette = BMP_RESULT_OK,
+	                                  .loadimage   = BMP_RESULT_OK,
+	                              },
+	              },
+	.save       = { .intent = BMP_INTENT_NONE, .huff_fgidx = 1, .huff_t4black = 1 },
+	.iterations = 1,
+	.refcache   = true,
+};
+
+/* Arguments of all actions, checked and resolved by plan_compile() before
+ * any test is run. See plan.h.
+ *
+ * The actions switch on arg->id, the ids below. The settings sections use
+ * the ids of the action they set defaults for. An OPT_WORD value is passed
+ * as its index in the list of words, so the lists are in the order of the
+ * enums and tables they index (and yes/no options list "no" first).
+ */
+
+#define DIRS    "bmpsuite|sample|tmp|ref"           /* enum Dir  */
+#define FORMATS "int|float|s2.13"                   /* formats[] */
+#define INTENTS "NONE|BUSINESS|GRAPHICS|IMAGES|ABS" /* intents[] */
+#define METRICS "ssim|deltaE2000"                   /* metrics[] */
+
+static const BMPFORMAT formats[] = { BMP_FORMAT_INT, BMP_FORMAT_FLOAT, BMP_FORMAT_S2_13 };
+static const BMPINTENT intents[] = { BMP_INTENT_NONE, BMP_INTENT_BUSINESS, BMP_INTENT_GRAPHICS,
+	                             BMP_INTENT_IMAGES, BMP_INTENT_ABS_COLORIMETRIC };
+static const enum CompareMetric metrics[] = { METRIC_SSIM, METRIC_DELTAE2000 };
+
+enum
+{
+	POS_DIR,
+	POS_FILE,
+};
+
+enum
+{
+	LOAD_LINE,
+	LOAD_RGB,
+	LOAD_UNDEF,
+	LOAD_CONV64,
+	LOAD_FORMAT,
+	LOAD_INSANE,
+	LOAD_EXPECT,
+	LOAD_ICCPROFILE,
+	LOAD_ARRAY,
+	LOAD_HUFF_T4BLACK,
+	LOAD_BUFFER,
+};
+
+enum
+{
+	SAVE_BUFFERBITS,
+	SAVE_LINE,
+	SAVE_FORMAT,
+	SAVE_RLE,
+	SAVE_ALLOW,
+	SAVE_LOADRAW,
+	SAVE_HUFF_FGIDX,
+	SAVE_HUFF_T4BLACK,
+	SAVE_OUTBITS,
+	SAVE_64BIT,
+	SAVE_ICCPROFILE,
+	SAVE_INTENT,
+};
+
+enum
+{
+	CMP_FUZZ,
+	CMP_EPSILON,
+	CMP_REL_EPSILON,
+	CMP_STATS,
+	CMP_DIFFIMAGE,
+	CMP_AMPLIFY,
+	CMP_METRIC,
+	CMP_THRESHOLD,
+	CMP_MAX_MISMATCH,
+	CMP_MIN_PSNR,
+};
+
+enum
+{
+	RAW_OFFSET,
+	RAW_SIZE,
+	RAW_BYTES,
+};
+
+/* the expect-* ids are indices in perform_stats() */
+enum
+{
+	STATS_EXPECT_MIN,
+	STATS_EXPECT_MAX,
+	STATS_EXPECT_MEAN,
+	STATS_TOLERANCE,
+	STATS_HISTOGRAM,
+};
+
+enum
+{
+	HASH_XXH64,
+	HASH_NAME,
+};
+
+enum
+{
+	CROP_X,
+	CROP_Y,
+	CROP_W,
+	CROP_H,
+};
+
+enum
+{
+	TILE_INDEX,
+	TILE_SIZE,
+};
+
+/* actions with only one or two options */
+enum
+{
+	CHANNELS_MAP,
+	GAMMA_FROM,
+	GAMMA_TO,
+	CONVERT_FORMAT,
+	CONVERT_BITS,
+	REMAP_ORDER,
+	FLATTEN_ALPHA,
+	FLATTEN_BITS,
+	EXPOSURE_FSTOPS,
+	EXPOSURE_CLIP,
+	TIMING_REPORT,
+	TIMING_ITERATIONS,
+	CACHE_REFCACHE,
+};
+
+static const struct OptDef pos_dir_file[] = {
+	{ "dir", OPT_WORD, DIRS, POS_DIR, NULL },
+	{ "file", OPT_STR, NULL, POS_FILE, NULL },
+};
+
+static const struct OptDef pos_dir_pattern[] = {
+	{ "dir", OPT_WORD, DIRS, POS_DIR, NULL },
+	{ "file", OPT_PATH, NULL, POS_FILE, NULL },
+};
+
+static const struct OptDef loadbmp_opts[] = {
+	{ "line", OPT_WORD, "whole|line", LOAD_LINE, NULL },
+	{ "rgb", OPT_WORD, "rgb|index", LOAD_RGB, NULL },
+	{ "undef", OPT_WORD, "alpha|leave", LOAD_UNDEF, NULL },
+	{ "conv64", OPT_WORD, "srgb|linear", LOAD_CONV64, NULL },
+	{ "format", OPT_WORD, FORMATS, LOAD_FORMAT, NULL },
+	{ "insane", OPT_WORD, "yes", LOAD_INSANE, NULL },
+	{ "expect", OPT_PARSED, NULL, LOAD_EXPECT, parse_expected_read_result },
+	{ "iccprofile", OPT_WORD, "apply|loadonly", LOAD_ICCPROFILE, NULL },
+	{ "array", OPT_INT, NULL, LOAD_ARRAY, NULL },
+	{ "huff-t4black", OPT_INT, NULL, LOAD_HUFF_T4BLACK, NULL },
+	{ "buffer", OPT_WORD, "internal|aligned|pooled", LOAD_BUFFER, NULL },
+	{ NULL }
+};
+
+static const struct OptDef savebmp_opts[] = {
+	{ "bufferbits", OPT_WORD, "8|16|32", SAVE_BUFFERBITS, NULL },
+	{ "line", OPT_WORD, "whole|line", SAVE_LINE, NULL },
+	{ "format", OPT_WORD, FORMATS, SAVE_FORMAT, NULL },
+	{ "rle", OPT_WORD, "auto|rle8|none", SAVE_RLE, NULL },
+	{ "allow", OPT_WORD, "huff|2bit|rle24", SAVE_ALLOW, NULL },
+	{ "loadraw", OPT_FLAG, NULL, SAVE_LOADRAW, NULL },
+	{ "huff-fgidx", OPT_INT, NULL, SAVE_HUFF_FGIDX, NULL },
+	{ "huff-t4black", OPT_INT, NULL, SAVE_HUFF_T4BLACK, NULL },
+	{ "outbits", OPT_PARSED, NULL, SAVE_OUTBITS, parse_outbits },
+	{ "64bit", OPT_WORD, "no|yes", SAVE_64BIT, NULL },
+	{ "iccprofile", OPT_WORD, "embed", SAVE_ICCPROFILE, NULL },
+	{ "intent", OPT_WORD, INTENTS, SAVE_INTENT, NULL },
+	{ NULL }
+};
+
+static const struct OptDef compare_opts[] = {
+	{ "fuzz", OPT_PARSED, NULL, CMP_FUZZ, parse_dimension },
+	{ "epsilon", OPT_PARSED, NULL, CMP_EPSILON, parse_nonnegative },
+	{ "rel-epsilon", OPT_PARSED, NULL, CMP_REL_EPSILON, parse_nonnegative },
+	{ "stats", OPT_WORD, "no|yes", CMP_STATS, NULL },
+	{ "diffimage", OPT_STR, NULL, CMP_DIFFIMAGE, NULL },
+	{ "amplify", OPT_PARSED, NULL, CMP_AMPLIFY, parse_positive },
+	{ "metric", OPT_WORD, METRICS, CMP_METRIC, NULL },
+	{ "threshold", OPT_PARSED, NULL, CMP_THRESHOLD, parse_nonnegative },
+	{ "max-mismatch", OPT_PARSED, NULL, CMP_MAX_MISMATCH, parse_count },
+	{ "min-psnr", OPT_NUM, NULL, CMP_MIN_PSNR, NULL },
+	{ NULL }
+};
+
+static const struct OptDef rawcompare_opts[] = {
+	{ "offset", OPT_PARSED, NULL, RAW_OFFSET, parse_dimension },
+	{ "size", OPT_PARSED, NULL, RAW_SIZE, parse_dimension },
+	{ "bytes", OPT_PARSED, NULL, RAW_BYTES, parse_hex_bytes },
+	{ NULL }
+};
+
+static const struct OptDef stats_opts[] = {
+	{ "expect-min", OPT_PARSED, NULL, STATS_EXPECT_MIN, parse_channel_values },
+	{ "expect-max", OPT_PARSED, NULL, STATS_EXPECT_MAX, parse_channel_values },
+	{ "expect-mean", OPT_PARSED, NULL, STATS_EXPECT_MEAN, parse_channel_values },
+	{ "tolerance", OPT_PARSED, NULL, STATS_TOLERANCE, parse_nonnegative },
+	{ "histogram", OPT_STR, NULL, STATS_HISTOGRAM, NULL },
+	{ NULL }
+};
+
+static const struct OptDef expect_hash_opts[] = {
+	{ "xxh64", OPT_PARSED, NULL, HASH_XXH64, parse_xxh64 },
+	{ "name", OPT_STR, NULL, HASH_NAME, NULL },
+	{ NULL }
+};
+
+static const struct OptDef crop_opts[] = {
+	{ "x", OPT_PARSED, NULL, CROP_X, parse_dimension },
+	{ "y", OPT_PARSED, NULL, CROP_Y, parse_dimension },
+	{ "w", OPT_PARSED, NULL, CROP_W, parse_dimension },
+	{ "h", OPT_PARSED, NULL, CROP_H, parse_dimension },
+	{ NULL }
+};
+
+static const struct OptDef tile_opts[] = {
+	{ "index", OPT_PARSED, NULL, TILE_INDEX, parse_dimension },
+	{ "size", OPT_PARSED, NULL, TILE_SIZE, parse_tile_size },
+	{ NULL }
+};
+
+static const struct OptDef channels_opts[] = {
+	{ "map", OPT_PARSED, NULL, CHANNELS_MAP, parse_channel_map },
+	{ NULL }
+};
+
+static const struct OptDef convertgamma_opts[] = {
+	{ "from", OPT_WORD, "srgb|linear", GAMMA_FROM, NULL },
+	{ "to", OPT_WORD, "srgb|linear", GAMMA_TO, NULL },
+	{ NULL }
+};
+
+static const struct OptDef convertformat_opts[] = {
+	{ "format", OPT_WORD, FORMATS, CONVERT_FORMAT, NULL },
+	{ "bits", OPT_WORD, "8|16|32", CONVERT_BITS, NULL },
+	{ NULL }
+};
+
+static const struct OptDef remappalette_opts[] = {
+	{ "order", OPT_PARSED, NULL, REMAP_ORDER, parse_palette_order },
+	{ NULL }
+};
+
+static const struct OptDef flatten_opts[] = {
+	{ "alpha", OPT_WORD, "drop|keep", FLATTEN_ALPHA, NULL },
+	{ "bits", OPT_WORD, "8|16|float", FLATTEN_BITS, NULL },
+	{ NULL }
+};
+
+static const struct OptDef exposure_opts[] = {
+	{ "fstops", OPT_NUM, NULL, EXPOSURE_FSTOPS, NULL },
+	{ "clip", OPT_WORD, "no|yes", EXPOSURE_CLIP, NULL },
+	{ NULL }
+};
+static const struct ActionDef actiondefs[] = {
+	{ "loadbmp", perform_loadbmp, pos_dir_pattern, 2, loadbmp_opts },
+	{ "loadraw", perform_loadraw, pos_dir_file, 2, NULL },
+	{ "loadpng", perform_loadpng, pos_dir_pattern, 2, NULL },
+	{ "savebmp", perform_savebmp, pos_dir_file + 1, 1, savebmp_opts },
+	{ "swap", perform_swap, NULL, 0, NULL },
+	{ "duplicate", perform_duplicate, NULL, 0, NULL },
+	{ "crop", perform_crop, NULL, 0, crop_opts },
+	{ "tile", perform_tile, NULL, 0, tile_opts },
+	{ "compare", perform_compare, NULL, 0, compare_opts },
+	{ "rawcompare", perform_rawcompare, NULL, 0, rawcompare_opts },
+	{ "stats", perform_stats, NULL, 0, stats_opts },
+	{ "expect-hash", perform_expect_hash, NULL, 0, expect_hash_opts },
+	{ "delete", perform_delete, NULL, 0, NULL },
+	{ "addalpha", perform_addalpha, NULL, 0, NULL },
+	{ "channels", perform_channels, NULL, 0, channels_opts },
+	{ "convertgamma", perform_convertgamma, NULL, 0, convertgamma_opts },
+	{ "convertformat", perform_convertformat, NULL, 0, convertformat_opts },
+	{ "invertpalette", perform_invertpalette, NULL, 0, NULL },
+	{ "remappalette", perform_remappalette, NULL, 0, remappalette_opts },
+	{ "flatten", perform_flatten, NULL, 0, flatten_opts },
+	{ "exposure", perform_exposure, NULL, 0, exposure_opts },
+};
+
+/* Sections of a settings block. The loadbmp and savebmp sections take
+ * the options which make sense as defaults for all tests.
+ */
+
+static const struct OptDef settings_loadbmp_opts[] = {
+	{ "line", OPT_WORD, "whole|line", LOAD_LINE, NULL },
+	{ "rgb", OPT_WORD, "rgb|index", LOAD_RGB, NULL },
+	{ "undef", OPT_WORD, "alpha|leave", LOAD_UNDEF, NULL },
+	{ "conv64", OPT_WORD, "srgb|linear", LOAD_CONV64, NULL },
+	{ "format", OPT_WORD, FORMATS, LOAD_FORMAT, NULL },
+	{ "insane", OPT_WORD, "yes", LOAD_INSANE, NULL },
+	{ "huff-t4black", OPT_INT, NULL, LOAD_HUFF_T4BLACK, NULL },
+	{ "buffer", OPT_WORD, "internal|aligned|pooled", LOAD_BUFFER, NULL },
+	{ NULL }
+};
+
+static const struct OptDef settings_savebmp_opts[] = {
+	{ "bufferbits", OPT_WORD, "8|16|32", SAVE_BUFFERBITS, NULL },
+	{ "line", OPT_WORD, "whole|line", SAVE_LINE, NULL },
+	{ "format", OPT_WORD, FORMATS, SAVE_FORMAT, NULL },
+	{ "rle", OPT_WORD, "auto|rle8|none", SAVE_RLE, NULL },
+	{ "allow", OPT_WORD, "huff|2bit|rle24", SAVE_ALLOW, NULL },
+	{ "huff-fgidx", OPT_INT, NULL, SAVE_HUFF_FGIDX, NULL },
+	{ "huff-t4black", OPT_INT, NULL, SAVE_HUFF_T4BLACK, NULL },
+	{ "outbits", OPT_PARSED, NULL, SAVE_OUTBITS, parse_outbits },
+	{ "64bit", OPT_WORD, "no|yes", SAVE_64BIT, NULL },
+	{ "intent", OPT_WORD, INTENTS, SAVE_INTENT, NULL },
+	{ NULL }
+};
+
+static const struct OptDef timing_opts[] = {
+	{ "report", OPT_WORD, "no|yes", TIMING_REPORT, NULL },
+	{ "iterations", OPT_PARSED, NULL, TIMING_ITERATIONS, parse_dimension },
+	{ NULL }
+};
+
+static const struct OptDef cache_opts[] = {
+	{ "refcache", OPT_WORD, "no|yes", CACHE_REFCACHE, NULL },
+	{ NULL }
+};
+
+static const struct ActionDef settingdefs[] = {
+	{ "loadbmp", settings_loadbmp, NULL, 0, settings_loadbmp_opts },
+	{ "savebmp", settings_savebmp, NULL, 0, settings_savebmp_opts },
+	{ "timing", settings_timing, NULL, 0, timing_opts },
+	{ "cache", settings_cache, NULL, 0, cache_opts },
+};
 
 int main(int argc, char *argv[])
 {
 	int             testnum = 0;
-	int             bad = 0, good = 0;
+	int             bad = 0, good = 0, errors;
 	bool            only_selected_tests;
 	struct Command *cmdlist;
 	FILE           *file;
+	char            cachepath[1024];
 
 	if (!(conf = conf_parse_cmdline(argc, argv)))
 	{
@@ -93,6 +636,7 @@ int main(int argc, char *argv[])
 	trim_trailing_slash(conf->sampledir);
 	trim_trailing_slash(conf->refdir);
 	trim_trailing_slash(conf->tmpdir);
+	trim_trailing_slash(conf->refcache);
 
 	if (conf->verbose > 0)
 	{
@@ -115,7 +659,21 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	cmdlist = parse_test_definitions(file);
+	if (!conf->noplancache)
+	{
+		/* the cache goes into the working directory, not next to
+		 * the (versioned) definitions file */
+		const char *base = strrchr(conf->testfile, '/');
+
+		base = base ? base + 1 : conf->testfile;
+		if ((int)sizeof cachepath <= snprintf(cachepath, sizeof cachepath, "%s.plancache",
+		                                      base))
+		{
+			printf("plan cache path too long\n");
+			return 1;
+		}
+	}
+	cmdlist = parse_test_definitions(file, conf->noplancache ? NULL : cachepath);
 	fclose(file);
 
 	if (conf->pretty)
@@ -130,6 +688,17 @@ int main(int argc, char *argv[])
 		return 0;
 	}
 
+	if ((errors = plan_compile(cmdlist, actiondefs, ARRAY_SIZE(actiondefs), settingdefs,
+	                           ARRAY_SIZE(settingdefs))))
+	{
+		printf("%d error%s in test definitions, no tests run.\n", errors,
+		       errors == 1 ? "" : "s");
+		return 1;
+	}
+
+	if (!apply_settings(cmdlist))
+		return 1;
+
 	for (struct Command *cmd = cmdlist; cmd; cmd = cmd->next)
 	{
 		if (cmd->type == COMMAND_TEST)
@@ -158,23 +727,23 @@ int main(int argc, char *argv[])
 					continue;
 			}
 
-			bool failed = run_test(cmd, testnum);
-			if (failed)
-			{
-				bad++;
-				if (conf->verbose > 0)
-					printf("****failed\n");
-			}
+			if (cmd->sweep)
+				run_sweep(cmd, testnum, &good, &bad);
 			else
-			{
-				good++;
-				if (conf->verbose > 0)
-					printf("passed%s\n", checkmark);
-			}
+				count_result(run_test(cmd, testnum, NULL, cmd->descr), &good, &bad);
 		}
 	}
 
+	plan_free();
 	free_cmdlist();
+	close_dirs();
+
+	if (manifest_loaded)
+	{
+		if (conf->bless && !manifest_save(conf->manifest))
+			bad++;
+		manifest_free();
+	}
 
 	if (rawfile)
 	{
@@ -192,33 +761,151 @@ int main(int argc, char *argv[])
 		putchar('\n');
 	}
 
+	if (conf->verbose > 1)
+	{
+		struct BufpoolStats pool;
+
+		bufpool_get_stats(&pool);
+		printf("\nbuffer pool: %" PRIu64 " allocations, %" PRIu64 " reused, peak %.1f MiB\n",
+		       pool.allocs, pool.reused, (double)pool.peak / (1 << 20));
+	}
+
 	if (conf->verbose > -1)
 		printf("\nBad : %d\nGood: %d\n %s\n", bad, good,
 		       bad ? " ***!!!***" : (char *)checkmark);
 	imgstack_destroy();
+	arena_free(&scratch);
 	conf_free(conf);
 	return bad;
 }
 
-static bool run_test(struct Command *cmd, int testnum)
+/* Run the tests once for each file matching its pattern. Each file
+ * counts as a test of its own.
+ */
+static void run_sweep(struct Command *cmd, int testnum, int *good, int *bad)
 {
-	bool failed = false;
+	struct Arena           names   = { 0 };
+	struct ArenaMark       mark    = arena_mark(&scratch);
+	struct DirMatches      matches = { 0 };
+	const struct Argument *args;
+	int                    dirfd;
+
+	args = plan_arguments(cmd, cmd->sweep, NULL, &scratch);
+
+	if ((dirfd = dir_fd(args->word)) == -1 ||
+	    !dirscan_match(dirfd, args->next->argname, &names, &matches))
+	{
+		printf("%s: %s/%s: %s\n", cmd->sweep->actname, dir_path(args->word),
+		       args->next->argname, strerror(errno));
+		count_result(true, good, bad);
+	}
+	else if (!matches.n)
+	{
+		printf("%s: no files match '%s'\n", cmd->sweep->actname, args->next->argname);
+		count_result(true, good, bad);
+	}
+
+	for (size_t i = 0; i < matches.n; i++)
+	{
+		struct ArenaMark namemark = arena_mark(&names);
+		const char      *match    = matches.names[i];
+		char            *descr;
+		bool             failed;
+
+		if (*cmd->descr)
+		{
+			descr = arena_alloc(&names, strlen(cmd->descr) + strlen(match) + 4, 0);
+			sprintf(descr, "%s (%s)", cmd->descr, match);
+		}
+		else
+			descr = (char *)match;
+
+		failed = run_test(cmd, testnum, match, descr);
+		if (failed && conf->verbose == 0)
+			printf("Test %02d: %s ****failed\n", testnum, descr);
+		count_result(failed, good, bad);
+		arena_reset(&names, &namemark);
+	}
 
-	imgstack_clear();
+	dirscan_free(&matches);
+	arena_free(&names);
+	arena_reset(&scratch, &mark);
+}
+
+static void count_result(bool failed, int *good, int *bad)
+{
+	if (failed)
+	{
+		(*bad)++;
+		if (conf->verbose > 0)
+			printf("****failed\n");
+	}
+	else
+	{
+		(*good)++;
+		if (conf->verbose > 0)
+			printf("passed%s\n", checkmark);
+	}
+}
+
+static bool run_test(struct Command *cmd, int testnum, const char *match, const char *descr)
+{
+	bool             failed = false;
+	struct ArenaMark mark   = arena_mark(&scratch);
+	struct timespec  start, end;
+	double           ms, best = 0.0, total = 0.0;
+	int              run;
+
+	current_test = descr;
 
 	if (conf->verbose > 0)
 	{
-		printf("\n===== Test %02d: %s\n", testnum, cmd->descr);
+		printf("\n===== Test %02d: %s\n", testnum, descr);
+	}
+
+	for (run = 0; run < settings.iterations && !failed; run++)
+	{
+		imgstack_clear();
+		if (!run)
+			bufpool_trim();
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		failed = !run_actions(cmd, match, run == 0);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		arena_reset(&scratch, &mark);
+
+		ms    = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+		best  = run ? fmin(best, ms) : ms;
+		total += ms;
+	}
+
+	if (settings.timing && !failed)
+	{
+		if (run > 1)
+			printf("Test %02d: %s: mean %.3f ms, best %.3f ms (%d runs)\n", testnum, descr,
+			       total / run, best, run);
+		else
+			printf("Test %02d: %s: %.3f ms\n", testnum, descr, total);
 	}
 
+	return failed;
+}
+
+/* One run of the test's actions. Arguments are only printed on the first
+ * run if the test is repeated.
+ */
+static bool run_actions(struct Command *cmd, const char *match, bool first)
+{
 	for (struct Action *action = cmd->actionlist; action; action = action->next)
 	{
-		if (conf->verbose > 1)
+		const struct Argument *args = plan_arguments(cmd, action, match, &scratch);
+
+		if (conf->verbose > 1 && first)
 		{
 			printf("--'%s'\n", action->actname);
 			if (conf->verbose > 2)
 			{
-				for (struct Argument *arg = action->arglist;
+				for (const struct Argument *arg = args;
 				     arg; arg             = arg->next)
 				{
 					if (arg->argvalue && *arg->argvalue)
@@ -229,52 +916,79 @@ static bool run_test(struct Command *cmd, int testnum)
 				}
 			}
 		}
-		if (!perform(action))
+		if (!action->def->perform(args))
+			return false;
+	}
+	return true;
+}
+
+/* Settings blocks apply to the whole suite, wherever they are in the
+ * file. They are resolved in file order, so later values win.
+ */
+static bool apply_settings(const struct Command *cmdlist)
+{
+	for (const struct Command *cmd = cmdlist; cmd; cmd = cmd->next)
+	{
+		if (cmd->type != COMMAND_SETTINGS)
+			continue;
+
+		for (const struct Action *section = cmd->actionlist; section;
+		     section = section->next)
 		{
-			failed = true;
-			break;
+			if (!section->def->perform(section->arglist))
+				return false;
 		}
 	}
+	return true;
+}
 
-	return failed;
+static bool settings_loadbmp(const struct Argument *args)
+{
+	for (; args; args = args->next)
+		loadbmp_option(&settings.load, args);
+	return true;
 }
 
-static bool perform(struct Action *action)
-{
-	if (!strcmp("loadbmp", action->actname))
-		return perform_loadbmp(action->arglist);
-	else if (!strcmp("loadraw", action->actname))
-		return perform_loadraw(action->arglist);
-	else if (!strcmp("loadpng", action->actname))
-		return perform_loadpng(action->arglist);
-	else if (!strcmp("savebmp", action->actname))
-		return perform_savebmp(action->arglist);
-	else if (!strcmp("swap", action->actname))
-		return perform_swap();
-	else if (!strcmp("duplicate", action->actname))
-		return perform_duplicate();
-	else if (!strcmp("compare", action->actname))
-		return perform_compare(action->arglist);
-	else if (!strcmp("rawcompare", action->actname))
-		return perform_rawcompare(action->arglist);
-	else if (!strcmp("delete", action->actname))
-		return perform_delete();
-	else if (!strcmp("addalpha", action->actname))
-		return perform_addalpha();
-	else if (!strcmp("convertgamma", action->actname))
-		return perform_convertgamma(action->arglist);
-	else if (!strcmp("convertformat", action->actname))
-		return perform_convertformat(action->arglist);
-	else if (!strcmp("invertpalette", action->actname))
-		return perform_invertpalette();
-	else if (!strcmp("flatten", action->actname))
-		return perform_flatten();
-	else if (!strcmp("exposure", action->actname))
-		return perform_exposure(action->arglist);
-	else
-		printf("Unkown command: %s\n", action->actname);
+static bool settings_savebmp(const struct Argument *args)
+{
+	for (; args; args = args->next)
+		savebmp_option(&settings.save, args);
+	return true;
+}
 
-	return false;
+static bool settings_timing(const struct Argument *args)
+{
+	settings.timing = true;
+
+	for (; args; args = args->next)
+	{
+		switch (args->id)
+		{
+		case TIMING_REPORT:
+			settings.timing = args->word;
+			break;
+
+		case TIMING_ITERATIONS:
+			if (args->num < 1)
+			{
+				printf("settings: timing: iterations must be at least 1\n");
+				return false;
+			}
+			settings.iterations = (int)args->num;
+			break;
+		}
+	}
+	return true;
+}
+
+static bool settings_cache(const struct Argument *args)
+{
+	for (; args; args = args->next)
+	{
+		if (args->id == CACHE_REFCACHE)
+			settings.refcache = args->word;
+	}
+	return true;
 }
 
 static bool loadraw(const char *filespec)
@@ -293,10 +1007,10 @@ static bool loadraw(const char *filespec)
 	return true;
 }
 
-static bool perform_loadraw(struct Argument *args)
+static bool perform_loadraw(const struct Argument *args)
 {
-	const char *dir = NULL, *fname = NULL;
-	const char *dirpath;
+	const char *fname;
+	enum Dir    dir;
 	char        path[1024];
 
 	if (rawfile)
@@ -305,368 +1019,117 @@ static bool perform_loadraw(struct Argument *args)
 		rawfile = NULL;
 	}
 
-	if (args)
-	{
-		dir  = args->argname;
-		args = args->next;
-		if (args)
-		{
-			fname = args->argname;
-			args  = args->next;
-		}
-	}
+	/* both are there, plan_compile() checked them */
+	dir   = args->word;
+	fname = args->next->argname;
 
-	if (!(fname && *fname))
+	if ((int)sizeof path < snprintf(path, sizeof path, "%s/%s", dir_path(dir), fname))
 	{
-		printf("loadbmp: invalid filespec\n");
-		return false;
-	}
-
-	if (!strcmp(dir, "bmpsuite"))
-		dirpath = conf->bmpsuitedir;
-	else if (!strcmp(dir, "sample"))
-		dirpath = conf->sampledir;
-	else if (!strcmp(dir, "tmp"))
-		dirpath = conf->tmpdir;
-	else if (!strcmp(dir, "ref"))
-		dirpath = conf->refdir;
-	else
-	{
-		printf("loadraw: Invalid dir '%s'\n", dir);
-		return false;
-	}
-
-	if ((int)sizeof path < snprintf(path, sizeof path, "%s/%s", dirpath, fname))
-	{
-		printf("loadraw: path too small!");
-		exit(1);
+		printf("loadraw: path too small!");
+		exit(1);
 	}
 
 	return loadraw(path);
 }
 
 
-struct ResultRead
-{
-	BMPRESULT loadinfo;
-	BMPRESULT arrayinfo;
-	int       arraynum;
-	bool      arraynum_explicit;
-	BMPRESULT loadicc;
-	BMPRESULT set64bit;
-	BMPRESULT setformat;
-	int       numcolors;
-	bool      numcolors_explicit;
-	BMPRESULT loadpalette;
-	BMPRESULT loadimage;
-};
-
-bool parse_expected_read_result(struct ResultRead *results, char *optvalue)
+/* loadbmp expect: <step>=<result>, e.g. loadinfo=BMP_RESULT_INSANE, or
+ * arraynum=<n> / numcolors=<n>. Applied by expect_read_result().
+ */
+static bool parse_expected_read_result(const char *str, struct Argument *arg,
+                                       struct Arena *arena)
 {
-	char *eq, *name, *value, *endptr = NULL;
-
-	name = optvalue;
-	eq = strchr(name, '=');
-	if (!eq)
-	{
-		printf("loadbmp: expect-option w/o value '%s'\n", optvalue);
-		return false;
-	}
-	*eq = 0;
-	value = eq + 1;
-	if (!*value)
-	{
-		printf("loadbmp: empty value for expect optin %s\n", name);
+	static const char *steps[] = { "loadinfo", "arrayinfo", "arraynum", "loadicc", "set64bit",
+		                       "setformat", "numcolors", "loadpalette", "loadimage" };
+	struct ExpectRead *expect;
+	const char        *value = strchr(str, '=');
+	char              *endptr;
+	size_t             len;
+	long               num;
+
+	if (!(value && value[1]))
 		return false;
-	}
+	len = (size_t)(value++ - str);
 
-	if (!strcmp(name, "loadinfo"))
-	{
-		if (!bmpresult_from_str(value, &results->loadinfo))
-		{
-			printf("loadbmp: invalid expected loadinfo result '%s'.", value);
-			return false;
-		}
-	}
-	else if (!strcmp(name, "arrayinfo"))
+	expect = arena_alloc(arena, sizeof *expect, ARENA_ALIGN | ARENA_ZERO);
+	for (size_t i = 0; i < ARRAY_SIZE(steps); i++)
 	{
-		if (!bmpresult_from_str(value, &results->arrayinfo))
+		if (strlen(steps[i]) != len || memcmp(steps[i], str, len))
+			continue;
+
+		expect->step = (enum ReadStep)i;
+		arg->value   = expect;
+
+		if (expect->step == READ_ARRAYNUM || expect->step == READ_NUMCOLORS)
 		{
-			printf("loadbmp: invalid expected arrayinfo result '%s'.", value);
-			return false;
+			num         = strtol(value, &endptr, 10);
+			expect->num = (int)num;
+			return !*endptr && num >= 0 && num <= INT_MAX;
 		}
+		return bmpresult_from_str(value, &expect->result);
 	}
-	else if (!strcmp(name, "arraynum"))
+	return false;
+}
+
+static void expect_read_result(struct ResultRead *results, const struct ExpectRead *expect)
+{
+	switch (expect->step)
 	{
-		results->arraynum = strtol(value, &endptr, 10);
-		if (endptr && *endptr != '\0')
-		{
-			printf("loadbmp: invalid arranum value %s\n", value);
-			return false;
-		}
+	case READ_LOADINFO:
+		results->loadinfo = expect->result;
+		break;
+	case READ_ARRAYINFO:
+		results->arrayinfo = expect->result;
+		break;
+	case READ_ARRAYNUM:
+		results->arraynum          = expect->num;
 		results->arraynum_explicit = true;
-	}
-	else if (!strcmp(name, "loadicc"))
-	{
-		if (!bmpresult_from_str(value, &results->loadicc))
-		{
-			printf("loadbmp: invalid expected loadicc result '%s'.", value);
-			return false;
-		}
-	}
-	else if (!strcmp(name, "set64bit"))
-	{
-		if (!bmpresult_from_str(value, &results->set64bit))
-		{
-			printf("loadbmp: invalid expected set64bit result '%s'.", value);
-			return false;
-		}
-	}
-	else if (!strcmp(name, "setformat"))
-	{
-		if (!bmpresult_from_str(value, &results->setformat))
-		{
-			printf("loadbmp: invalid expected setformat result '%s'.", value);
-			return false;
-		}
-	}
-	else if (!strcmp(name, "numcolors"))
-	{
-		results->numcolors = strtol(value, &endptr, 10);
-		if (endptr && *endptr != '\0')
-		{
-			printf("loadbmp: invalid numcolors value %s\n", value);
-			return false;
-		}
+		break;
+	case READ_LOADICC:
+		results->loadicc = expect->result;
+		break;
+	case READ_SET64BIT:
+		results->set64bit = expect->result;
+		break;
+	case READ_SETFORMAT:
+		results->setformat = expect->result;
+		break;
+	case READ_NUMCOLORS:
+		results->numcolors          = expect->num;
 		results->numcolors_explicit = true;
+		break;
+	case READ_LOADPALETTE:
+		results->loadpalette = expect->result;
+		break;
+	case READ_LOADIMAGE:
+		results->loadimage = expect->result;
+		break;
 	}
-	else if (!strcmp(name, "loadpalette"))
-	{
-		if (!bmpresult_from_str(value, &results->loadpalette))
-		{
-			printf("loadbmp: invalid expected loadpalette result '%s'.", value);
-			return false;
-		}
-	}
-	else if (!strcmp(name, "loadimage"))
-	{
-		if (!bmpresult_from_str(value, &results->loadimage))
-		{
-			printf("loadbmp: invalid expected loadimage result '%s'.", value);
-			return false;
-		}
-	}
-	else {
-		printf("loadbmp: invalid expected result option '%s'\n", name);
-		return false;
-	}
-	return true;
-
 }
 
-static bool perform_loadbmp(struct Argument *args)
+static bool perform_loadbmp(const struct Argument *args)
 {
 	bool          success = false;
-	const char   *dir = NULL, *fname = NULL;
-	const char   *dirpath;
-	char         *optname, *optvalue;
-	char          path[1024];
+	const char   *fname;
+	enum Dir      dir;
 	FILE         *file = NULL;
 	struct Image *img  = NULL;
 	BMPHANDLE     h    = NULL;
 	BMPHANDLE     harr = NULL;
 	BMPRESULT     res;
-	bool          set_undef = false;
-	BMPUNDEFINED  undefmode;
-	bool          set_format = false;
-	BMPFORMAT     format     = BMP_FORMAT_INT;
-	bool          set_conv64 = false;
-	BMPCONV64     conv64;
-	bool          set_huff_t4black = false;
-	int           huff_t4black     = 1;
-	bool          insane           = false;
-	bool          line_by_line     = false;
-	bool          index            = false;
-	bool          loadicc          = false;
-	bool          icc_loadonly     = false;
 	BMPORIENT     orientation;
-	int           array_idx = -1;
-	struct ResultRead results = { .loadinfo    = BMP_RESULT_OK,
-	                              .arrayinfo   = BMP_RESULT_OK,
-	                              .loadicc     = BMP_RESULT_OK,
-	                              .set64bit    = BMP_RESULT_OK,
-	                              .setformat   = BMP_RESULT_OK,
-	                              .loadpalette = BMP_RESULT_OK,
-	                              .loadimage   = BMP_RESULT_OK,
-	                              .arraynum    = 0,
-	                              .numcolors   = 0,
-	                          };
-
-	if (args)
-	{
-		dir  = args->argname;
-		args = args->next;
-	}
-	if (args)
-	{
-		fname = args->argname;
-		args  = args->next;
-	}
-
-	if (!(fname && *fname))
-	{
-		printf("loadbmp: invalid filespec\n");
-		goto abort;
-	}
-
-	if (!strcmp(dir, "bmpsuite"))
-		dirpath = conf->bmpsuitedir;
-	else if (!strcmp(dir, "sample"))
-		dirpath = conf->sampledir;
-	else if (!strcmp(dir, "tmp"))
-		dirpath = conf->tmpdir;
-	else if (!strcmp(dir, "ref"))
-		dirpath = conf->refdir;
-	else
-	{
-		printf("loadbmp: Invalid dir '%s'\n", dir);
-		goto abort;
-	}
-
-	if ((int)sizeof path < snprintf(path, sizeof path, "%s/%s", dirpath, fname))
-	{
-		printf("loadbmp: path too small!");
-		exit(1);
-	}
+	struct LoadTiming  timing;
+	struct LoadOptions opt = settings.load;
 
-	while (args && args->argname)
-	{
-		optname  = args->argname;
-		optvalue = args->argvalue;
-		if (!optvalue)
-			optvalue = "";
+	/* both are there, plan_compile() checked them */
+	dir   = args->word;
+	fname = args->next->argname;
 
-		if (!strcmp(optname, "line"))
-		{
-			if (!strcmp(optvalue, "whole"))
-				line_by_line = false;
-			else if (!strcmp(optvalue, "line"))
-				line_by_line = true;
-			else
-			{
-				printf("loadbmp: invalid line mode '%s'\n", optvalue);
-				goto abort;
-			}
-		}
-		else if (!strcmp(optname, "rgb"))
-		{
-			if (!strcmp(optvalue, "rgb"))
-				index = false;
-			else if (!strcmp(optvalue, "index"))
-				index = true;
-			else
-			{
-				printf("loadbmp: invalid rgb mode '%s'\n", optvalue);
-				goto abort;
-			}
-		}
-		else if (!strcmp(optname, "undef"))
-		{
-			set_undef = true;
-			if (!strcmp(optvalue, "alpha"))
-				undefmode = BMP_UNDEFINED_TO_ALPHA;
-			else if (!strcmp(optvalue, "leave"))
-				undefmode = BMP_UNDEFINED_LEAVE;
-			else
-			{
-				printf("loadbmp: invalid undef mode '%s'\n", optvalue);
-				goto abort;
-			}
-		}
-		else if (!strcmp(optname, "conv64"))
-		{
-			set_conv64 = true;
-			if (!strcmp(optvalue, "srgb"))
-				conv64 = BMP_CONV64_SRGB;
-			else if (!strcmp(optvalue, "linear"))
-				conv64 = BMP_CONV64_LINEAR;
-			else
-			{
-				printf("loadbmp: invalid conv64 mode '%s'\n", optvalue);
-				goto abort;
-			}
-		}
-		else if (!strcmp(optname, "format"))
-		{
-			set_format = true;
-			if (!strcmp(optvalue, "int"))
-				format = BMP_FORMAT_INT;
-			else if (!strcmp(optvalue, "float"))
-				format = BMP_FORMAT_FLOAT;
-			else if (!strcmp(optvalue, "s2.13"))
-				format = BMP_FORMAT_S2_13;
-			else
-			{
-				printf("loadbmp: invalid number format '%s'\n", optvalue);
-				goto abort;
-			}
-		}
-		else if (!strcmp(optname, "insane"))
-		{
-			if (!strcmp(optvalue, "yes"))
-				insane = true;
-			else
-			{
-				printf("loadbmp: invalid insanity value. must be 'yes'");
-				goto abort;
-			}
-		}
-		else if (!strcmp(optname, "expect"))
-		{
-			if (!parse_expected_read_result(&results, optvalue))
-			{
-				goto abort;
-			}
-		}
-		else if (!strcmp(optname, "iccprofile"))
-		{
-			if (!strcmp(optvalue, "loadonly"))
-			{
-				icc_loadonly = true;
-			}
-			else if (!strcmp(optvalue, "apply"))
-			{
-				icc_loadonly = false;
-			}
-			else
-			{
-				printf("loadbmp: invalid option '%s' for iccprofile.", optvalue);
-				goto abort;
-			}
-			loadicc = true;
-		}
-		else if (!strcmp(optname, "array"))
-		{
-			array_idx = atoi(optvalue);
-		}
-		else if (!strcmp(optname, "huff-t4black"))
-		{
-			huff_t4black     = !!atoi(optvalue);
-			set_huff_t4black = true;
-		}
-		else
-		{
-			printf("loadbmp: unknown option '%s'\n", optname);
-			goto abort;
-		}
-		args = args->next;
-	}
+	for (args = args->next->next; args; args = args->next)
+		loadbmp_option(&opt, args);
 
-	if (!(file = fopen(path, "rb")))
-	{
-		perror(path);
+	if (!(file = open_in_dir(dir, fname)))
 		goto abort;
-	}
 
 	if (!(h = bmpread_new(file)))
 	{
@@ -674,14 +1137,14 @@ static bool perform_loadbmp(struct Argument *args)
 		goto abort;
 	}
 
-	if (set_huff_t4black)
-		bmp_set_huffman_t4black_value(h, huff_t4black);
+	if (opt.set_huff_t4black)
+		bmp_set_huffman_t4black_value(h, opt.huff_t4black);
 
 	res = bmpread_load_info(h);
-	if (res != results.loadinfo)
+	if (res != opt.results.loadinfo)
 	{
 		printf("Unexpected result from bmpread_load_info():\n"
-			       "Expected: %s, have: %s\n", bmpresult_as_str(results.loadinfo), bmpresult_as_str(res));
+			       "Expected: %s, have: %s\n", bmpresult_as_str(opt.results.loadinfo), bmpresult_as_str(res));
 		if (res != BMP_RESULT_OK)
 				printf("(%s)\n", bmp_errmsg(h));
 		goto abort;
@@ -689,7 +1152,7 @@ static bool perform_loadbmp(struct Argument *args)
 
 	if (res == BMP_RESULT_INSANE)
 	{
-		if (insane)
+		if (opt.insane)
 		{
 			bmpread_set_insanity_limit(h, bmpread_buffersize(h));
 			res = bmpread_load_info(h);
@@ -706,13 +1169,13 @@ static bool perform_loadbmp(struct Argument *args)
 		}
 	}
 
-	if (res == BMP_RESULT_ARRAY && array_idx < 0)
+	if (res == BMP_RESULT_ARRAY && opt.array_idx < 0)
 	{
 		printf("File is a bitmap array, but no index given\n");
 		goto abort;
 	}
 
-	if (res != BMP_RESULT_ARRAY && array_idx >= 0)
+	if (res != BMP_RESULT_ARRAY && opt.array_idx >= 0)
 	{
 		printf("Expected bitmap array\n");
 		goto abort;
@@ -724,22 +1187,22 @@ static bool perform_loadbmp(struct Argument *args)
 		goto abort;
 	}
 
-	if (array_idx > -1)
+	if (opt.array_idx > -1)
 	{
 		int n = bmpread_array_num(h);
 
 		if (conf->verbose > 2)
 			printf("Bitmap array: %d images\n", n);
 
-		if (results.arraynum_explicit && n != results.arraynum)
+		if (opt.results.arraynum_explicit && n != opt.results.arraynum)
 		{
-			printf("BMP array, expected %d images, have %d images\n", results.arraynum, n);
+			printf("BMP array, expected %d images, have %d images\n", opt.results.arraynum, n);
 			goto abort;
 		}
 
-		if (array_idx >= n)
+		if (opt.array_idx >= n)
 		{
-			printf("Invalid array index %d. (max is %d)\n", array_idx, n);
+			printf("Invalid array index %d. (max is %d)\n", opt.array_idx, n);
 			goto abort;
 		}
 		struct BmpArrayInfo ai;
@@ -747,11 +1210,11 @@ static bool perform_loadbmp(struct Argument *args)
 		harr = h;
 		h    = NULL;
 
-		res = bmpread_array_info(harr, &ai, array_idx);
-		if (res != results.arrayinfo)
+		res = bmpread_array_info(harr, &ai, opt.array_idx);
+		if (res != opt.results.arrayinfo)
 		{
 			printf("array_info: expected result %s, have %s\n",
-			                                 bmpresult_as_str(results.arrayinfo),
+			                                 bmpresult_as_str(opt.results.arrayinfo),
 			                                 bmpresult_as_str(res));
 			printf("%s\n", bmp_errmsg(harr));
 			goto abort;
@@ -765,8 +1228,8 @@ static bool perform_loadbmp(struct Argument *args)
 		h = ai.handle;
 	}
 
-	if (set_undef)
-		bmpread_set_undefined(h, undefmode);
+	if (opt.set_undef)
+		bmpread_set_undefined(h, opt.undefmode);
 
 	if (!(img = malloc(sizeof *img)))
 	{
@@ -778,7 +1241,7 @@ static bool perform_loadbmp(struct Argument *args)
 	img->xdpi = bmpread_resolution_xdpi(h);
 	img->ydpi = bmpread_resolution_ydpi(h);
 
-	if (loadicc && icc_loadonly)
+	if (opt.loadicc && opt.icc_loadonly)
 	{
 
 		img->iccprofile_size = bmpread_iccprofile_size(h);
@@ -788,10 +1251,10 @@ static bool perform_loadbmp(struct Argument *args)
 			goto abort;
 		}
 		res = bmpread_load_iccprofile(h, &img->iccprofile);
-		if (res != results.loadicc)
+		if (res != opt.results.loadicc)
 		{
 			printf("load iccprofile: expected result %s, have %s\n",
-			                                          bmpresult_as_str(results.loadicc),
+			                                          bmpresult_as_str(opt.results.loadicc),
 			                                          bmpresult_as_str(res));
 			printf("%s\n", bmp_errmsg(h));
 			goto abort;
@@ -806,13 +1269,13 @@ static bool perform_loadbmp(struct Argument *args)
 			                                          (unsigned long)img->iccprofile_size);
 	}
 
-	if (set_conv64)
+	if (opt.set_conv64)
 	{
-		res = bmpread_set_64bit_conv(h, conv64);
-		if (res != results.set64bit)
+		res = bmpread_set_64bit_conv(h, opt.conv64);
+		if (res != opt.results.set64bit)
 		{
 			printf("set64bit: expected result %s have %s\n",
-			                                          bmpresult_as_str(results.set64bit),
+			                                          bmpresult_as_str(opt.results.set64bit),
 			                                          bmpresult_as_str(res));
 			printf("%s\n", bmp_errmsg(h));
 			goto abort;
@@ -823,13 +1286,13 @@ static bool perform_loadbmp(struct Argument *args)
 			goto abort;
 		}
 	}
-	if (set_format)
+	if (opt.set_format)
 	{
-		res = bmp_set_number_format(h, format);
-		if (res != results.setformat)
+		res = bmp_set_number_format(h, opt.format);
+		if (res != opt.results.setformat)
 		{
 			printf("set format: expected result %s, have %s\n",
-			                                          bmpresult_as_str(results.setformat),
+			                                          bmpresult_as_str(opt.results.setformat),
 			                                          bmpresult_as_str(res));
 			printf("%s\n", bmp_errmsg(h));
 			goto abort;
@@ -840,25 +1303,25 @@ static bool perform_loadbmp(struct Argument *args)
 			goto abort;
 		}
 	}
-	img->format = format;
+	img->format = opt.format;
 
-	if (index)
+	if (opt.index)
 	{
 		fflush(stdout);
 		img->numcolors = bmpread_num_palette_colors(h);
-		if (results.numcolors_explicit && img->numcolors != results.numcolors)
+		if (opt.results.numcolors_explicit && img->numcolors != opt.results.numcolors)
 		{
 			printf("num_palette_colors: expected %d colors, have %d\n",
-			                                          results.numcolors, (int)img->numcolors);
+			                                          opt.results.numcolors, (int)img->numcolors);
 			goto abort;
 		}
 		if (img->numcolors > 0)
 		{
 			res = bmpread_load_palette(h, &img->palette);
-			if (res != results.loadpalette)
+			if (res != opt.results.loadpalette)
 			{
 				printf("load palette: expected result %s, have %s\n",
-			                                          bmpresult_as_str(results.loadpalette),
+			                                          bmpresult_as_str(opt.results.loadpalette),
 			                                          bmpresult_as_str(res));
 				printf("%s\n", bmp_errmsg(h));
 				goto abort;
@@ -875,27 +1338,26 @@ static bool perform_loadbmp(struct Argument *args)
 	img->height         = bmpread_height(h);
 	img->channels       = bmpread_channels(h);
 	img->bitsperchannel = bmpread_bitsperchannel(h);
-	img->buffersize     = bmpread_buffersize(h);
 	orientation         = bmpread_orientation(h);
 
-	if (line_by_line)
+	if (opt.line_by_line)
 	{
-		if (!(img->buffer = malloc(img->buffersize)))
+		if (!img_alloc_buffer(img))
 		{
 			perror("buffer");
 			goto abort;
 		}
+		timing_start(&timing);
 		unsigned char *line;
 		for (int y = 0; y < img->height; y++)
 		{
 			int real_y = orientation == BMP_ORIENT_TOPDOWN ? y : img->height - y - 1;
-			line = img->buffer + (uint64_t)real_y * img->width * img->channels *
-			                         img->bitsperchannel / 8;
+			line = img->buffer + (uint64_t)real_y * img->stride;
 			res = bmpread_load_line(h, &line);
-			if (res != results.loadimage)
+			if (res != opt.results.loadimage)
 			{
 				printf("load line: expected result %s, have %s\n",
-			                                          bmpresult_as_str(results.loadimage),
+			                                          bmpresult_as_str(opt.results.loadimage),
 			                                          bmpresult_as_str(res));
 				printf("%s\n", bmp_errmsg(h));
 				goto abort;
@@ -906,14 +1368,44 @@ static bool perform_loadbmp(struct Argument *args)
 				goto abort;
 			}
 		}
+		timing_report(&timing, "line");
 	}
 	else
 	{
+		/* bmplib fills the buffer with packed rows. It allocates
+		 * the buffer itself unless we pass one in.
+		 */
+		size_t         size = bmpread_buffersize(h);
+		unsigned char *buffer;
+
+		if (opt.buffer_mode == BUFFER_POOLED)
+		{
+			if (!(buffer = img_aligned_alloc(size)))
+			{
+				perror("loadbmp buffer");
+				goto abort;
+			}
+			img_replace_buffer(img, buffer, size);
+		}
+		else if (opt.buffer_mode == BUFFER_ALIGNED)
+		{
+			size_t alloc = (size + IMG_ROW_ALIGN - 1) & ~(size_t)(IMG_ROW_ALIGN - 1);
+
+			if (!(img->buffer = aligned_alloc(IMG_ROW_ALIGN, alloc)))
+			{
+				perror("loadbmp buffer");
+				goto abort;
+			}
+		}
+		img->buffersize = size;
+		img->stride     = img_rowbytes(img);
+
+		timing_start(&timing);
 		res = bmpread_load_image(h, &img->buffer);
-		if (res != results.loadimage)
+		if (res != opt.results.loadimage)
 		{
 			printf("load image: expected result %s, have %s\n",
-			                                          bmpresult_as_str(results.loadimage),
+			                                          bmpresult_as_str(opt.results.loadimage),
 			                                          bmpresult_as_str(res));
 			printf("%s\n", bmp_errmsg(h));
 			goto abort;
@@ -923,10 +1415,13 @@ static bool perform_loadbmp(struct Argument *args)
 			success = true;
 			goto abort;
 		}
+		timing_report(&timing, opt.buffer_mode == BUFFER_POOLED    ? "pooled"
+		                       : opt.buffer_mode == BUFFER_ALIGNED ? "aligned"
+		                                                       : "internal");
 	}
 
 	if (conf->verbose > 2)
-		printf("     Image %s loaded\n", path);
+		printf("     Image %s/%s loaded\n", dir_path(dir), fname);
 
 	bmp_free(h);
 	h = NULL;
@@ -954,48 +1449,105 @@ abort:
 	return success;
 }
 
-static bool perform_savebmp(struct Argument *args)
+static void loadbmp_option(struct LoadOptions *opt, const struct Argument *arg)
+{
+	static const BMPUNDEFINED undefmodes[] = { BMP_UNDEFINED_TO_ALPHA, BMP_UNDEFINED_LEAVE };
+	static const BMPCONV64    conv64s[]    = { BMP_CONV64_SRGB, BMP_CONV64_LINEAR };
+
+	switch (arg->id)
+	{
+	case LOAD_LINE:
+		opt->line_by_line = arg->word;
+		break;
+
+	case LOAD_RGB:
+		opt->index = arg->word;
+		break;
+
+	case LOAD_UNDEF:
+		opt->set_undef = true;
+		opt->undefmode = undefmodes[arg->word];
+		break;
+
+	case LOAD_CONV64:
+		opt->set_conv64 = true;
+		opt->conv64     = conv64s[arg->word];
+		break;
+
+	case LOAD_FORMAT:
+		opt->set_format = true;
+		opt->format     = formats[arg->word];
+		break;
+
+	case LOAD_INSANE:
+		opt->insane = true;
+		break;
+
+	case LOAD_EXPECT:
+		expect_read_result(&opt->results, arg->value);
+		break;
+
+	case LOAD_ICCPROFILE:
+		opt->loadicc      = true;
+		opt->icc_loadonly = arg->word;
+		break;
+
+	case LOAD_ARRAY:
+		opt->array_idx = (int)arg->num;
+		break;
+
+	case LOAD_HUFF_T4BLACK:
+		opt->huff_t4black     = arg->num != 0.0;
+		opt->set_huff_t4black = true;
+		break;
+
+	case LOAD_BUFFER:
+		opt->buffer_mode = (enum BufferMode)arg->word;
+		break;
+	}
+}
+
+/* decode time and page faults are reported with -vv, to compare
+ * loadbmp's buffer modes.
+ */
+
+static void timing_start(struct LoadTiming *t)
+{
+	struct rusage ru;
+
+	clock_gettime(CLOCK_MONOTONIC, &t->start);
+	getrusage(RUSAGE_SELF, &ru);
+	t->minflt = ru.ru_minflt;
+}
+
+static void timing_report(const struct LoadTiming *t, const char *mode)
+{
+	struct timespec now;
+	struct rusage   ru;
+	double          ms;
+
+	if (conf->verbose < 2)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	getrusage(RUSAGE_SELF, &ru);
+	ms = (now.tv_sec - t->start.tv_sec) * 1e3 + (now.tv_nsec - t->start.tv_nsec) / 1e6;
+	printf("     decoded in %.3f ms, %ld page faults (buffer: %s)\n", ms,
+	       ru.ru_minflt - t->minflt, mode);
+}
+
+static bool perform_savebmp(const struct Argument *args)
 {
-	const char   *fname = NULL;
+	const char   *fname;
 	const char   *dirpath;
-	char         *optname, *optvalue;
 	char          path[1024];
 	FILE         *file       = NULL;
 	struct Image *img        = NULL;
 	BMPHANDLE     h          = NULL;
-	bool          set_format = false;
-	BMPFORMAT     format;
-	bool          set_rle = false;
-	BMPRLETYPE    rle;
-	bool          set_intent         = false;
-	BMPINTENT     intent             = BMP_INTENT_NONE;
-	int           bufferbits         = 0;
-	bool          set_outbits        = false;
-	int           outbits[4]         = { 0, 0, 0, 0 };
-	bool          set_64bit          = false;
-	bool          allow_huff         = false;
-	bool          allow_2bit         = false;
-	bool          allow_rle24        = false;
-	bool          set_huff_fgidx     = false;
-	int           huff_fgidx         = 1;
-	bool          set_huff_t4black   = false;
-	int           huff_t4black       = 1;
-	bool          icc_embed          = false;
-	bool          loadraw_after_save = false;
-	bool          line_by_line       = false;
-
-	if (args)
-	{
-		fname = args->argname;
-		args  = args->next;
-	}
-
-	if (!(fname && *fname))
-	{
-		printf("savebmp: invalid filespec\n");
-		goto abort;
-	}
+	struct SaveOptions opt = settings.save;
 
+	/* the file name is there, plan_compile() checked it */
+	fname   = args->argname;
 	dirpath = conf->tmpdir;
 
 	if ((int)sizeof path < snprintf(path, sizeof path, "%s/%s", dirpath, fname))
@@ -1004,214 +1556,57 @@ static bool perform_savebmp(struct Argument *args)
 		exit(1);
 	}
 
-	while (args && args->argname)
+	for (args = args->next; args; args = args->next)
+		savebmp_option(&opt, args);
+
+	if (!(img = imgstack_get(0)))
+		exit(1);
+
+	if (!(file = fopen(path, "wb")))
+	{
+		perror(path);
+		goto abort;
+	}
+
+	if (!(h = bmpwrite_new(file)))
 	{
-		optname  = args->argname;
-		optvalue = args->argvalue;
-		if (!optvalue)
-			optvalue = "";
+		printf("Couldn't get bmpwrite handle\n");
+		goto abort;
+	}
 
-		if (!strcmp(optname, "bufferbits"))
+	if (opt.set_64bit)
+	{
+		if (bmpwrite_set_64bit(h))
 		{
-			bufferbits = atol(optvalue);
-			switch (bufferbits)
-			{
-			case 8:
-			case 16:
-			case 32:
-				/* ok */
-				break;
-
-			default:
-				printf("savebmp: invalid bufferbits (%d)\n", bufferbits);
-				goto abort;
-			}
+			printf("setting 64bit: %s\n", bmp_errmsg(h));
+			goto abort;
 		}
-		else if (!strcmp(optname, "line"))
+	}
+
+	if (opt.set_outbits)
+	{
+		if (bmpwrite_set_output_bits(h, opt.outbits[0], opt.outbits[1],
+		                             opt.outbits[2], opt.outbits[3]))
 		{
-			if (!strcmp(optvalue, "whole"))
-				line_by_line = false;
-			else if (!strcmp(optvalue, "line"))
-				line_by_line = true;
-			else
-			{
-				printf("savebmp: invalid line mode '%s'\n", optvalue);
-				goto abort;
-			}
+			printf("setting 64bit: %s\n", bmp_errmsg(h));
+			goto abort;
 		}
-		else if (!strcmp(optname, "format"))
-		{
-			set_format = true;
-			if (!strcmp(optvalue, "int"))
-				format = BMP_FORMAT_INT;
-			else if (!strcmp(optvalue, "float"))
-				format = BMP_FORMAT_FLOAT;
-			else if (!strcmp(optvalue, "s2.13"))
-				format = BMP_FORMAT_S2_13;
-			else
-			{
-				printf("savebmp: invalid number format '%s'\n", optvalue);
-				goto abort;
-			}
-		}
-		else if (!strcmp(optname, "rle"))
-		{
-			set_rle = true;
-			if (!strcmp(optvalue, "auto"))
-				rle = BMP_RLE_AUTO;
-			else if (!strcmp(optvalue, "rle8"))
-				rle = BMP_RLE_RLE8;
-			else if (!strcmp(optvalue, "none"))
-				rle = BMP_RLE_NONE;
-			else
-			{
-				printf("savebmp: invalid rle option '%s'\n", optvalue);
-				goto abort;
-			}
-		}
-		else if (!strcmp(optname, "allow"))
-		{
-			if (!strcmp(optvalue, "huff"))
-				allow_huff = true;
-			else if (!strcmp(optvalue, "2bit"))
-				allow_2bit = true;
-			else if (!strcmp(optvalue, "rle24"))
-				allow_rle24 = true;
-			else
-			{
-				printf("savebmp: invalid allow option '%s'\n", optvalue);
-				goto abort;
-			}
-		}
-		else if (!strcmp(optname, "loadraw"))
-		{
-			loadraw_after_save = true;
-		}
-		else if (!strcmp(optname, "huff-fgidx"))
-		{
-
-			huff_fgidx     = !!atoi(optvalue);
-			set_huff_fgidx = true;
-		}
-		else if (!strcmp(optname, "huff-t4black"))
-		{
-
-			huff_t4black     = !!atoi(optvalue);
-			set_huff_t4black = true;
-		}
-		else if (!strcmp(optname, "outbits"))
-		{
-			set_outbits = true;
-			int   col;
-			char *str;
-			while (*optvalue)
-			{
-				switch (*optvalue)
-				{
-				case 'r': col = 0; break;
-				case 'g': col = 1; break;
-				case 'b': col = 2; break;
-				case 'a': col = 3; break;
-				default:
-					printf("savebmp: invalid outbits '%s'\n", optvalue);
-					goto abort;
-				}
-				outbits[col] = strtol(++optvalue, &str, 10);
-				if (str <= optvalue)
-				{
-					printf("hmmmmmmm....\n");
-					break;
-				}
-				optvalue = str;
-			}
-		}
-		else if (!strcmp(optname, "64bit"))
-		{
-			if (!strcmp(optvalue, "yes"))
-				set_64bit = true;
-			else if (!strcmp(optvalue, "no"))
-				set_64bit = false;
-			else
-			{
-				printf("savebmp: invalid 64bit option '%s'\n", optvalue);
-				goto abort;
-			}
-		}
-		else if (!strcmp(optname, "iccprofile"))
-		{
-			if (!strcmp(optvalue, "embed"))
-				icc_embed = true;
-			else
-			{
-				printf("savebmp: invalid iccprofile option '%s'\n", optvalue);
-				goto abort;
-			}
-		}
-		else if (!strcmp(optname, "intent"))
-		{
-			if (!rendering_intent_from_str(optvalue, &intent))
-			{
-				printf("savebmp: invalid intent '%s'.", optvalue);
-				goto abort;
-			}
-			set_intent = true;
-		}
-		else
-		{
-			printf("savebmp: unknown option %s\n", optname);
-			goto abort;
-		}
-		args = args->next;
-	}
-
-	if (!(img = imgstack_get(0)))
-		exit(1);
-
-	if (!(file = fopen(path, "wb")))
-	{
-		perror(path);
-		goto abort;
 	}
 
-	if (!(h = bmpwrite_new(file)))
-	{
-		printf("Couldn't get bmpwrite handle\n");
-		goto abort;
-	}
-
-	if (set_64bit)
-	{
-		if (bmpwrite_set_64bit(h))
-		{
-			printf("setting 64bit: %s\n", bmp_errmsg(h));
-			goto abort;
-		}
-	}
-
-	if (set_outbits)
-	{
-		if (bmpwrite_set_output_bits(h, outbits[0], outbits[1],
-		                             outbits[2], outbits[3]))
-		{
-			printf("setting 64bit: %s\n", bmp_errmsg(h));
-			goto abort;
-		}
-	}
-
-	if (allow_2bit)
+	if (opt.allow_2bit)
 		bmpwrite_allow_2bit(h);
 
-	if (allow_huff)
+	if (opt.allow_huff)
 		bmpwrite_allow_huffman(h);
 
-	if (allow_rle24)
+	if (opt.allow_rle24)
 		bmpwrite_allow_rle24(h);
 
-	if (set_huff_fgidx)
-		bmpwrite_set_huffman_img_fg_idx(h, huff_fgidx);
+	if (opt.set_huff_fgidx)
+		bmpwrite_set_huffman_img_fg_idx(h, opt.huff_fgidx);
 
-	if (set_huff_t4black)
-		bmp_set_huffman_t4black_value(h, huff_t4black);
+	if (opt.set_huff_t4black)
+		bmp_set_huffman_t4black_value(h, opt.huff_t4black);
 
 	if (img->palette)
 	{
@@ -1221,16 +1616,16 @@ static bool perform_savebmp(struct Argument *args)
 			goto abort;
 		}
 	}
-	if (set_rle)
+	if (opt.set_rle)
 	{
-		if (bmpwrite_set_rle(h, rle))
+		if (bmpwrite_set_rle(h, opt.rle))
 		{
 			printf("setting rle: %s\n", bmp_errmsg(h));
 			goto abort;
 		}
 	}
 
-	if (icc_embed)
+	if (opt.icc_embed)
 	{
 		if (img->iccprofile_size <= 0)
 		{
@@ -1244,22 +1639,22 @@ static bool perform_savebmp(struct Argument *args)
 		}
 	}
 
-	if (set_intent)
+	if (opt.set_intent)
 	{
-		if (bmpwrite_set_rendering_intent(h, intent))
+		if (bmpwrite_set_rendering_intent(h, opt.intent))
 		{
 			printf("Setting intent: %s\n", bmp_errmsg(h));
 			goto abort;
 		}
 	}
-	if (set_format && format != img->format)
+	if (opt.set_format && opt.format != img->format)
 	{
-		if (format == BMP_FORMAT_INT && !bufferbits)
+		if (opt.format == BMP_FORMAT_INT && !opt.bufferbits)
 		{
 			printf("cannot set output INT w/o specifying bits\n");
 			exit(1);
 		}
-		convert_format(format, bufferbits);
+		convert_format(opt.format, opt.bufferbits);
 	}
 
 	if (img->format)
@@ -1276,14 +1671,12 @@ static bool perform_savebmp(struct Argument *args)
 		bmpwrite_set_resolution(h, img->xdpi, img->ydpi);
 	}
 
-	if (line_by_line)
+	if (opt.line_by_line)
 	{
 		for (int y = 0; y < img->height; y++)
 		{
 			int            real_y = img->height - y - 1;
-			unsigned char *line   = img->buffer +
-			                      (uint64_t)real_y * img->width * img->channels *
-			                          img->bitsperchannel / 8;
+			unsigned char *line   = img->buffer + (uint64_t)real_y * img->stride;
 			if (bmpwrite_save_line(h, line))
 			{
 				printf("%s\n", bmp_errmsg(h));
@@ -1293,7 +1686,20 @@ static bool perform_savebmp(struct Argument *args)
 	}
 	else
 	{
-		if (bmpwrite_save_image(h, img->buffer))
+		unsigned char *packed = img->buffer;
+		size_t         rowbytes = img_rowbytes(img);
+
+		/* bmplib expects packed rows */
+		if (img->stride != rowbytes)
+		{
+			packed = arena_alloc(&scratch, rowbytes * img->height, ARENA_ALIGN);
+			for (int y = 0; y < img->height; y++)
+			{
+				memcpy(packed + (size_t)y * rowbytes,
+				       img->buffer + (size_t)y * img->stride, rowbytes);
+			}
+		}
+		if (bmpwrite_save_image(h, packed))
 		{
 			printf("%s\n", bmp_errmsg(h));
 			goto abort;
@@ -1303,7 +1709,7 @@ static bool perform_savebmp(struct Argument *args)
 	bmp_free(h);
 	fclose(file);
 
-	if (loadraw_after_save)
+	if (opt.loadraw_after_save)
 		return loadraw(path);
 
 	return true;
@@ -1317,6 +1723,121 @@ abort:
 	return false;
 }
 
+static void savebmp_option(struct SaveOptions *opt, const struct Argument *arg)
+{
+	static const BMPRLETYPE rletypes[] = { BMP_RLE_AUTO, BMP_RLE_RLE8, BMP_RLE_NONE };
+	const struct OutBits   *outbits;
+
+	switch (arg->id)
+	{
+	case SAVE_BUFFERBITS:
+		opt->bufferbits = 8 << arg->word; /* 8, 16, 32 */
+		break;
+
+	case SAVE_LINE:
+		opt->line_by_line = arg->word;
+		break;
+
+	case SAVE_FORMAT:
+		opt->set_format = true;
+		opt->format     = formats[arg->word];
+		break;
+
+	case SAVE_RLE:
+		opt->set_rle = true;
+		opt->rle     = rletypes[arg->word];
+		break;
+
+	case SAVE_ALLOW:
+		switch (arg->word)
+		{
+		case 0: /* huff */
+			opt->allow_huff = true;
+			break;
+		case 1: /* 2bit */
+			opt->allow_2bit = true;
+			break;
+		case 2: /* rle24 */
+			opt->allow_rle24 = true;
+			break;
+		}
+		break;
+
+	case SAVE_LOADRAW:
+		opt->loadraw_after_save = true;
+		break;
+
+	case SAVE_HUFF_FGIDX:
+		opt->huff_fgidx     = arg->num != 0.0;
+		opt->set_huff_fgidx = true;
+		break;
+
+	case SAVE_HUFF_T4BLACK:
+		opt->huff_t4black     = arg->num != 0.0;
+		opt->set_huff_t4black = true;
+		break;
+
+	case SAVE_OUTBITS:
+		outbits          = arg->value;
+		opt->set_outbits = true;
+		for (int c = 0; c < 4; c++)
+		{
+			if (outbits->bits[c] != -1)
+				opt->outbits[c] = outbits->bits[c];
+		}
+		break;
+
+	case SAVE_64BIT:
+		opt->set_64bit = arg->word;
+		break;
+
+	case SAVE_ICCPROFILE:
+		opt->icc_embed = true;
+		break;
+
+	case SAVE_INTENT:
+		opt->set_intent = true;
+		opt->intent     = intents[arg->word];
+		break;
+	}
+}
+
+/* savebmp outbits: bits per channel, e.g. "r5g6b5" or "r8g8b8a8" */
+static bool parse_outbits(const char *str, struct Argument *arg, struct Arena *arena)
+{
+	struct OutBits *outbits;
+	char           *endptr;
+	long            bits;
+	int             col;
+
+	if (!*str)
+		return false;
+
+	outbits = arena_alloc(arena, sizeof *outbits, ARENA_ALIGN);
+	for (col = 0; col < 4; col++)
+		outbits->bits[col] = -1;
+	arg->value = outbits;
+
+	while (*str)
+	{
+		switch (*str++)
+		{
+		case 'r': col = 0; break;
+		case 'g': col = 1; break;
+		case 'b': col = 2; break;
+		case 'a': col = 3; break;
+		default:
+			return false;
+		}
+		bits = strtol(str, &endptr, 10);
+		if (endptr == str || bits < 0 || bits > 32)
+			return false;
+		outbits->bits[col] = (int)bits;
+		str                = endptr;
+	}
+	return true;
+}
+
 static int hexval(const char *str)
 {
 	int hex = 0;
@@ -1337,33 +1858,52 @@ static int hexval(const char *str)
 	return hex;
 }
 
-static bool perform_rawcompare(struct Argument *args)
+/* rawcompare bytes: up to MAX_RAWBYTES bytes as hex digits */
+static bool parse_hex_bytes(const char *str, struct Argument *arg, struct Arena *arena)
 {
-	const int   maxbytes  = 100;
-	const char *offsetstr = NULL, *sizestr = NULL, *hexstr = NULL;
-	long        offset;
-	int         size, byte;
-	uint8_t     bytes[maxbytes];
+	struct HexBytes *hex;
+	size_t           len = strlen(str);
+	int              byte;
 
-	for (struct Argument *arg = args; arg; arg = arg->next)
-	{
-		char *optname  = arg->argname;
-		char *optvalue = arg->argvalue;
+	if (!len || len % 2 || len > 2 * MAX_RAWBYTES)
+		return false;
 
-		assert (optname != NULL);
+	hex    = arena_alloc(arena, sizeof *hex + len / 2, ARENA_ALIGN);
+	hex->n = (int)(len / 2);
+	for (int i = 0; i < hex->n; i++)
+	{
+		if ((byte = hexval(&str[2 * i])) == -1)
+			return false;
+		hex->bytes[i] = (uint8_t)byte;
+	}
+	arg->value = hex;
+	return true;
+}
 
-		if (!optvalue)
-			optvalue = "";
+static bool perform_rawcompare(const struct Argument *args)
+{
+	const struct HexBytes *hex    = NULL;
+	long                   offset = 0;
+	int                    size   = 0;
+	uint8_t                bytes[MAX_RAWBYTES];
 
-		if (!strcmp(optname, "offset"))
-			offsetstr = optvalue;
-		else if (!strcmp(optname, "size"))
-			sizestr = optvalue;
-		else if (!strcmp(optname, "bytes"))
-			hexstr = optvalue;
+	for (const struct Argument *arg = args; arg; arg = arg->next)
+	{
+		switch (arg->id)
+		{
+		case RAW_OFFSET:
+			offset = (long)arg->num;
+			break;
+		case RAW_SIZE:
+			size = (int)arg->num;
+			break;
+		case RAW_BYTES:
+			hex = arg->value;
+			break;
+		}
 	}
 
-	if (!(hexstr && *hexstr))
+	if (!hex)
 	{
 		printf("rawcompare: invalid arguments\n");
 		return false;
@@ -1375,26 +1915,9 @@ static bool perform_rawcompare(struct Argument *args)
 		return false;
 	}
 
-	offset = atol(offsetstr);
-	size   = atoi(sizestr);
-
-	if (size < 1 || size > maxbytes)
-	{
-		printf("rawcompare: invalid size (%d, max is %d).\n", size, maxbytes);
-		return false;
-	}
-
-	size_t hexlen = strlen(hexstr);
-	if (hexlen != (size_t)size * 2)
+	if (size != hex->n)
 	{
-		printf("rawcompare: invalid length of hex string (is %zu, should be %d).\n",
-		       hexlen, size * 2);
-		return false;
-	}
-
-	if (offset < 0)
-	{
-		printf("rawcompare: invalid offset (%ld)\n", offset);
+		printf("rawcompare: size is %d, but there are %d bytes\n", size, hex->n);
 		return false;
 	}
 
@@ -1414,17 +1937,11 @@ static bool perform_rawcompare(struct Argument *args)
 
 	for (int i = 0; i < size; i++)
 	{
-		byte = hexval(&hexstr[2 * i]);
-		if (byte == -1)
-		{
-			printf("rawcompare: invalid hex value\n");
-			return false;
-		}
-		if (byte != bytes[i])
+		if (hex->bytes[i] != bytes[i])
 		{
 			printf("rawcompare: mismatch on byte %d: Is 0x%02x (%d), should be 0x%02x (%d)\n",
 			       i, (unsigned)bytes[i], (int)bytes[i],
-			       (unsigned)byte, (int)byte);
+			       (unsigned)hex->bytes[i], (int)hex->bytes[i]);
 			return false;
 		}
 	}
@@ -1432,18 +1949,22 @@ static bool perform_rawcompare(struct Argument *args)
 	return true;
 }
 
-static bool perform_swap(void)
+static bool perform_swap(const struct Argument *args)
 {
+	(void)args;
+
 	if (!imgstack_swap())
 		exit(1);
 
 	return true;
 }
 
-static bool perform_duplicate(void)
+static bool perform_duplicate(const struct Argument *args)
 {
 	struct Image *img, *newimg = NULL;
 
+	(void)args;
+
 	if (!(img = imgstack_get(0)))
 		exit(1);
 
@@ -1454,7 +1975,14 @@ static bool perform_duplicate(void)
 	}
 	memset(newimg, 0, sizeof *newimg);
 
-	if (!(newimg->buffer = malloc(img->buffersize)))
+	newimg->width          = img->width;
+	newimg->height         = img->height;
+	newimg->channels       = img->channels;
+	newimg->bitsperchannel = img->bitsperchannel;
+	newimg->format         = img->format;
+	newimg->orientation    = img->orientation;
+
+	if (!img_alloc_buffer(newimg))
 	{
 		perror("malloc");
 		goto abort;
@@ -1482,844 +2010,935 @@ static bool perform_duplicate(void)
 		newimg->iccprofile_size = img->iccprofile_size;
 	}
 
-	memcpy(newimg->buffer, img->buffer, img->buffersize);
-
-	newimg->buffersize     = img->buffersize;
-	newimg->width          = img->width;
-	newimg->height         = img->height;
-	newimg->channels       = img->channels;
-	newimg->bitsperchannel = img->bitsperchannel;
-	newimg->format         = img->format;
-	newimg->orientation    = img->orientation;
+	for (int y = 0; y < img->height; y++)
+	{
+		memcpy(newimg->buffer + (size_t)y * newimg->stride,
+		       img->buffer + (size_t)y * img->stride, img_rowbytes(img));
+	}
 
 	if (!imgstack_push(newimg))
 		goto abort;
 
 	return true;
 abort:
-	if (newimg)
-	{
-		if (newimg->buffer)
-			free(newimg->buffer);
-		if (newimg->palette)
-			free(newimg->palette);
-		free(newimg);
-	}
+	img_free(newimg);
 	return false;
 }
 
-static bool perform_addalpha(void)
+/* integer 0..INT_MAX, e.g. a size or an index */
+static bool parse_dimension(const char *str, struct Argument *arg, struct Arena *arena)
 {
-	struct Image  *img;
-	size_t         new_size, offnew, offold;
-	unsigned char *tmp;
-	int            bytesperchannel;
+	char *endptr;
+	long  l;
 
-	if (!(img = imgstack_get(0)))
-		exit(1);
+	(void)arena;
 
-	if (!(img->channels == 3))
-	{
-		printf("Can add alpha channel only to RGB image\n");
-		return false;
-	}
+	l        = strtol(str, &endptr, 10);
+	arg->num = (double)l;
+	return *str && !*endptr && l >= 0 && l <= INT_MAX;
+}
 
-	bytesperchannel = img->bitsperchannel / 8;
-	new_size = (uint64_t)img->width * img->height * 4 * bytesperchannel;
+/* real number >= 0 */
+static bool parse_nonnegative(const char *str, struct Argument *arg, struct Arena *arena)
+{
+	char *endptr;
 
-	if (!(tmp = realloc(img->buffer, new_size)))
-	{
-		perror("add alpha");
+	(void)arena;
+
+	arg->num = strtod(str, &endptr);
+	return *str && !*endptr && arg->num >= 0.0;
+}
+
+/* real number > 0 */
+static bool parse_positive(const char *str, struct Argument *arg, struct Arena *arena)
+{
+	return parse_nonnegative(str, arg, arena) && arg->num > 0.0;
+}
+
+/* tile size: <w>x<h>, or just one number for square tiles */
+static bool parse_tile_size(const char *str, struct Argument *arg, struct Arena *arena)
+{
+	struct TileSize *size;
+	char            *endptr;
+	long             w, h;
+
+	w = strtol(str, &endptr, 10);
+	if (endptr == str)
 		return false;
+	if (*endptr == 'x')
+	{
+		str = endptr + 1;
+		h   = strtol(str, &endptr, 10);
+		if (endptr == str)
+			return false;
 	}
-	img->buffer     = tmp;
-	img->buffersize = new_size;
-	img->channels   = 4;
+	else
+		h = w;
 
-	offnew = img->width * img->height * 4;
-	offold = img->width * img->height * 3;
+	if (*endptr || w < 1 || w > INT_MAX || h < 1 || h > INT_MAX)
+		return false;
 
-	while (offold > 0)
-	{
-		offnew -= 4;
-		offold -= 3;
+	size       = arena_alloc(arena, sizeof *size, ARENA_ALIGN);
+	size->w    = (int)w;
+	size->h    = (int)h;
+	arg->value = size;
+	return true;
+}
 
-		for (int c = 2; c >= 0; c--)
+/* crop and tile don't copy any pixels, they push a view into the
+ * buffer of the current image. See img_view() in imgstack.c.
+ */
+
+static bool perform_crop(const struct Argument *args)
+{
+	struct Image *img, *view;
+	int           x = 0, y = 0, w = -1, h = -1;
+
+	for (; args; args = args->next)
+	{
+		switch (args->id)
 		{
-			switch (bytesperchannel)
-			{
-			case 1:
-				((uint8_t *)img->buffer)[offnew + c] =
-				                    ((uint8_t *)img->buffer)[offold + c];
-				break;
-
-			case 2:
-				((uint16_t *)img->buffer)[offnew + c] =
-				                    ((uint16_t *)img->buffer)[offold + c];
-				break;
-
-			case 4:
-				((uint32_t *)img->buffer)[offnew + c] =
-				                    ((uint32_t *)img->buffer)[offold + c];
-				break;
-
-			default:
-				printf("wahhh\n");
-				exit(1);
-			}
+		case CROP_X:
+			x = (int)args->num;
+			break;
+		case CROP_Y:
+			y = (int)args->num;
+			break;
+		case CROP_W:
+			w = (int)args->num;
+			break;
+		case CROP_H:
+			h = (int)args->num;
+			break;
 		}
+	}
 
-		switch (img->format)
+	if (!(img = imgstack_get(0)))
+		exit(1);
+
+	if (w == -1)
+		w = img->width - x;
+	if (h == -1)
+		h = img->height - y;
+
+	if (!(view = img_view(img, x, y, w, h)))
+		return false;
+
+	if (!imgstack_push(view))
+		exit(1);
+
+	return true;
+}
+
+static bool perform_tile(const struct Argument *args)
+{
+	struct Image          *img, *view;
+	const struct TileSize *size  = NULL;
+	int                    index = -1;
+	int                    cols, rows, x, y;
+
+	for (; args; args = args->next)
+	{
+		switch (args->id)
 		{
-		case BMP_FORMAT_FLOAT:
-			((float *)img->buffer)[offnew + 3] = 1.0;
+		case TILE_INDEX:
+			index = (int)args->num;
 			break;
-
-		case BMP_FORMAT_S2_13:
-			((int16_t *)img->buffer)[offnew + 3] = 8192;
+		case TILE_SIZE:
+			size = args->value;
 			break;
+		}
+	}
 
-		case BMP_FORMAT_INT:
-			switch (bytesperchannel)
-			{
-			case 1:
-				img->buffer[offnew + 3] = 0xff;
-				break;
+	if (index < 0 || !size)
+	{
+		printf("tile: need index and size\n");
+		return false;
+	}
 
-			case 2:
-				((uint16_t *)img->buffer)[offnew + 3] = 0xffff;
-				break;
+	if (!(img = imgstack_get(0)))
+		exit(1);
 
-			case 4:
-				((uint32_t *)img->buffer)[offnew + 3] = 0xffffffff;
-				break;
-			}
-		}
+	/* tiles are numbered row by row, the ones at the right
+	 * and bottom edges may be smaller than size.
+	 */
+	cols = (img->width + size->w - 1) / size->w;
+	rows = (img->height + size->h - 1) / size->h;
+	if (index >= cols * rows)
+	{
+		printf("tile: index %d out of range, %dx%d image has %d tiles of %dx%d\n", index,
+		       img->width, img->height, cols * rows, size->w, size->h);
+		return false;
 	}
+
+	x = (index % cols) * size->w;
+	y = (index / cols) * size->h;
+
+	if (!(view = img_view(img, x, y, MIN(size->w, img->width - x),
+	                      MIN(size->h, img->height - y))))
+		return false;
+
+	if (!imgstack_push(view))
+		exit(1);
+
 	return true;
 }
 
-static bool perform_flatten(void)
+static bool perform_addalpha(const struct Argument *args)
 {
-	struct Image  *img;
-	size_t         new_size, offnew, offold;
-	unsigned char *tmp;
+	static const struct ChannelSpec rgb1 = { 4, { 'r', 'g', 'b', '1' } };
+	static const struct ChannelSpec y1   = { 2, { 'y', '1' } };
+	struct Image                   *img;
+	struct ChannelMap               map;
+
+	(void)args;
 
 	if (!(img = imgstack_get(0)))
 		exit(1);
 
-	if (!(img->palette && img->channels == 1 && img->bitsperchannel == 8))
+	if (!(img->channels == 3 || img->channels == 1))
 	{
-		printf("Cannot flatten RGB image\n");
+		printf("Can add alpha channel only to RGB or gray image\n");
 		return false;
 	}
 
-	img->channels = 3;
-	new_size      = img->width * img->height * img->channels;
-	if (!(tmp = realloc(img->buffer, new_size)))
+	if (!channel_map_resolve(img->channels == 3 ? &rgb1 : &y1, img->channels, &map))
+		return false;
+
+	return channel_map_apply(img, &map);
+}
+
+static bool parse_channel_map(const char *str, struct Argument *arg, struct Arena *arena)
+{
+	struct ChannelSpec *spec = arena_alloc(arena, sizeof *spec, ARENA_ALIGN);
+
+	arg->value = spec;
+	return channel_spec_parse(str, spec);
+}
+
+static bool perform_channels(const struct Argument *args)
+{
+	struct Image             *img;
+	struct ChannelMap         map;
+	const struct ChannelSpec *spec = NULL;
+
+	for (; args; args = args->next)
+	{
+		if (args->id == CHANNELS_MAP)
+			spec = args->value;
+	}
+
+	if (!spec)
 	{
-		perror("flatten");
+		printf("channels: need map\n");
 		return false;
 	}
-	img->buffer     = tmp;
-	img->buffersize = new_size;
 
-	offnew = new_size;
-	offold = img->width * img->height;
-	while (offold > 0)
+	if (!(img = imgstack_get(0)))
+		exit(1);
+
+	if (!channel_map_resolve(spec, img->channels, &map))
+		return false;
+
+	return channel_map_apply(img, &map);
+}
+
+static bool perform_flatten(const struct Argument *args)
+{
+	static const BMPFORMAT flatformats[] = { BMP_FORMAT_INT, BMP_FORMAT_INT, BMP_FORMAT_FLOAT };
+	static const int       flatbits[]    = { 8, 16, 32 };
+	struct Image          *img;
+	struct FlattenOpts     opts = { .alpha = false, .format = BMP_FORMAT_INT, .bits = 8 };
+
+	for (; args; args = args->next)
 	{
-		offnew -= 3;
-		offold -= 1;
-		for (int c = 2; c >= 0; c--)
+		switch (args->id)
 		{
-			img->buffer[offnew + c] = img->palette[4 * img->buffer[offold] + c];
+		case FLATTEN_ALPHA:
+			opts.alpha = args->word;
+			break;
+		case FLATTEN_BITS:
+			opts.format = flatformats[args->word];
+			opts.bits   = flatbits[args->word];
+			break;
 		}
 	}
 
-	free(img->palette);
-	img->palette   = NULL;
-	img->numcolors = 0;
-	return true;
+	if (!(img = imgstack_get(0)))
+		exit(1);
+
+	return palette_flatten(img, &opts);
 }
 
-static bool perform_exposure(struct Argument *args)
+static bool perform_exposure(const struct Argument *args)
 {
-	char  *opt, *optval;
 	double fstops = 0.0;
+	bool   clip   = false;
 
-	while (args && args->argname)
+	for (; args; args = args->next)
 	{
-		opt    = args->argname;
-		optval = args->argvalue;
-
-		if (!strcmp(opt, "fstops"))
+		switch (args->id)
 		{
-			fstops = atof(optval);
-		}
-		else
-		{
-			if (conf->verbose > -2)
-				printf("exposure: unknown option %s\n", opt);
-			return false;
+		case EXPOSURE_FSTOPS:
+			fstops = args->num;
+			break;
+		case EXPOSURE_CLIP:
+			clip = args->word;
+			break;
 		}
-		args = args->next;
 	}
-	if (fstops != 0.0)
-		set_exposure(fstops);
+	if (fstops != 0.0 || clip)
+		set_exposure(fstops, clip);
 	return true;
 }
 
 static void convert_srgb_to_linear(void);
 static void convert_linear_to_srgb(void);
 
-static bool perform_convertgamma(struct Argument *args)
+static bool perform_convertgamma(const struct Argument *args)
 {
-	const char *from = NULL, *to = NULL;
+	int from = -1, to = -1; /* 0: srgb, 1: linear */
 
-	for (struct Argument *arg = args; arg; arg = arg->next)
+	for (const struct Argument *arg = args; arg; arg = arg->next)
 	{
-		char *optname  = arg->argname;
-		char *optvalue = arg->argvalue;
-
-		assert (optname != NULL);
-
-		if (!strcmp(optname, "from"))
-			from = optvalue;
-		else if (!strcmp(optname, "to"))
-			to = optvalue;
-		else
+		switch (arg->id)
 		{
-			if (conf->verbose > -2)
-				printf("convertgamma: unkown option '%s'\n", optname);
-			return false;
+		case GAMMA_FROM:
+			from = arg->word;
+			break;
+		case GAMMA_TO:
+			to = arg->word;
+			break;
 		}
 	}
 
-	if (!(from && *from && to && *to))
+	if (from == -1 || to == -1)
 	{
 		printf("convertgamma: need from, to\n");
 		return false;
 	}
 
-	if (!strcmp(from, "srgb"))
-	{
-		if (!strcmp(to, "linear"))
-			convert_srgb_to_linear();
-		else if (!strcmp(to, "srgb"))
-			return true;
-		else
-		{
-			printf("Unknown conversion to %s\n", to);
-			return false;
-		}
-	}
-	else if (!strcmp(from, "linear"))
-	{
-		if (!strcmp(to, "srgb"))
-			convert_linear_to_srgb();
-		else if (!strcmp(to, "linear"))
-			return true;
-		else
-		{
-			printf("Unknown conversion to %s\n", to);
-			return false;
-		}
-	}
+	if (from == to)
+		return true;
+
+	if (from == 0)
+		convert_srgb_to_linear();
 	else
-	{
-		printf("Unknown conversion from %s\n", from);
-		return false;
-	}
+		convert_linear_to_srgb();
 	return true;
 }
 
-static double srgb_to_linear(double d);
-static double linear_to_srgb(double d);
-static void   convert_gamma(double (*func)(double));
-
 static void convert_srgb_to_linear(void)
 {
-	convert_gamma(srgb_to_linear);
+	struct Image *img;
+
+	if (!(img = imgstack_get(0)))
+		exit(1);
+
+	if (!kernel_gamma(img, true))
+		exit(1);
 }
 
 static void convert_linear_to_srgb(void)
 {
-	convert_gamma(linear_to_srgb);
-}
+	struct Image *img;
 
-static double srgb_to_linear(double d)
-{
-	if (d <= 0.04045)
-		d = d / 12.92;
-	else
-		d = pow((d + 0.055) / 1.055, 2.4);
-	return d;
-}
+	if (!(img = imgstack_get(0)))
+		exit(1);
 
-static double linear_to_srgb(double d)
-{
-	if (d <= 0.0031308)
-		d *= 12.92;
-	else
-		d = 1.055 * pow(d, 1.0 / 2.4) - 0.055;
-	return d;
+	if (!kernel_gamma(img, false))
+		exit(1);
 }
 
-static void convert_gamma(double (*func)(double))
+static void set_exposure(double fstops, bool clip)
 {
 	struct Image *img;
-	int           channels, colorchannels;
-	size_t        px, npixels;
 
 	if (!(img = imgstack_get(0)))
 		exit(1);
 
-	npixels  = img->width * img->height;
-	channels = img->channels;
-	if (channels == 2)
-		colorchannels = 1;
-	else if (channels == 4)
-		colorchannels = 3;
-	else
-		colorchannels = channels;
+	if (!kernel_exposure(img, pow(2.0, fstops), clip))
+		exit(1);
+}
+
+static bool perform_convertformat(const struct Argument *args)
+{
+	int format = -1;
+	int bits   = 0;
 
-	for (px = 0; px < npixels; px++)
+	for (const struct Argument *arg = args; arg; arg = arg->next)
 	{
-		size_t offs = px * channels;
-		for (int i = 0; i < colorchannels; i++)
+		switch (arg->id)
 		{
-			double d = 0;
-
-			switch (img->format)
-			{
-			case BMP_FORMAT_FLOAT:
-				d = ((float *)img->buffer)[offs + i];
-				break;
-
-			case BMP_FORMAT_S2_13:
-				d = s2_13_to_double(((uint16_t *)img->buffer)[offs + i]);
-				break;
-
-			case BMP_FORMAT_INT:
-				switch (img->bitsperchannel)
-				{
-				case 8:
-					d = ((uint8_t *)img->buffer)[offs + i] / (double)0xffU;
-					break;
-
-				case 16:
-					d = ((uint16_t *)img->buffer)[offs + i] / (double)0xffffU;
-					break;
-
-				case 32:
-					d = ((uint32_t *)img->buffer)[offs + i] / (double)0xffffffffUL;
-					break;
-
-				default:
-					printf("Waaaaaaaaaaaaaaa\n");
-					exit(1);
-				}
-				break;
-			}
-
-			d = (*func)(d);
-
-			switch (img->format)
-			{
-			case BMP_FORMAT_FLOAT:
-				((float *)img->buffer)[offs + i] = (float)d;
-				break;
-
-			case BMP_FORMAT_S2_13:
-				((uint16_t *)img->buffer)[offs + i] = float_to_s2_13(d);
-				break;
-
-			case BMP_FORMAT_INT:
-				switch (img->bitsperchannel)
-				{
-				case 8:
-					((uint8_t *)img->buffer)[offs + i] = d * (double)0xffU + 0.5;
-					break;
-
-				case 16:
-					((uint16_t *)img->buffer)[offs + i] =
-					    d * (double)0xffffU + 0.5;
-					break;
-
-				case 32:
-					((uint32_t *)img->buffer)[offs + i] =
-					    d * (double)0xffffffffUL + 0.5;
-					break;
-
-				}
-				break;
-			}
+		case CONVERT_FORMAT:
+			format = arg->word;
+			break;
+		case CONVERT_BITS:
+			bits = 8 << arg->word; /* 8, 16, 32 */
+			break;
 		}
 	}
+
+	if (format == -1)
+	{
+		if (conf->verbose > -2)
+			printf("convertformat: need format\n");
+		return false;
+	}
+
+	convert_format(formats[format], formats[format] == BMP_FORMAT_INT ? bits : 0);
+	return true;
 }
 
-static void set_exposure(double fstops)
+static void convert_format(BMPFORMAT format, int bits)
 {
 	struct Image *img;
-	int           channels, colorchannels;
-	size_t        px, npixels;
+
+	if (format == BMP_FORMAT_FLOAT)
+		bits = 32;
+	else if (format == BMP_FORMAT_S2_13)
+		bits = 16;
+	else if (!(bits == 8 || bits == 16 || bits == 32))
+	{
+		printf("convert: invalid bit-number: %d\n", bits);
+		exit(1);
+	}
 
 	if (!(img = imgstack_get(0)))
 		exit(1);
 
-	npixels  = img->width * img->height;
-	channels = img->channels;
-	if (channels == 2)
-		colorchannels = 1;
-	else if (channels == 4)
-		colorchannels = 3;
-	else
-		colorchannels = channels;
+	if (img->format == format && img->bitsperchannel == bits)
+		return;
 
-	for (px = 0; px < npixels; px++)
-	{
-		size_t offs = px * channels;
-		for (int c = 0; c < colorchannels; c++)
-		{
-			double d = 0;
+	if (!kernel_convert(img, format, bits))
+		exit(1);
+}
 
-			switch (img->format)
-			{
-			case BMP_FORMAT_FLOAT:
-				d = ((float *)img->buffer)[offs + c];
-				break;
+static bool perform_invertpalette(const struct Argument *args)
+{
+	static const struct RemapOrder reverse = { .order = ORDER_REVERSE };
+	struct Image                  *img;
 
-			case BMP_FORMAT_S2_13:
-				d = s2_13_to_double(((int16_t *)img->buffer)[offs + c]);
-				break;
+	(void)args;
 
-			case BMP_FORMAT_INT:
-				switch (img->bitsperchannel)
-				{
-				case 8:
-					d = (double)((uint8_t *)img->buffer)[offs + c] / ((1 << 8) - 1);
-					break;
+	if (!(img = imgstack_get(0)))
+		exit(1);
 
-				case 16:
-					d = (double)((uint16_t *)img->buffer)[offs + c] / ((1 << 16) - 1);
-					break;
+	return palette_remap(img, &reverse);
+}
 
-				case 32:
-					d = (double)((uint32_t *)img->buffer)[offs + c] / ((1ULL << 32) - 1);
-					break;
-				}
-			}
+static bool parse_palette_order(const char *str, struct Argument *arg, struct Arena *arena)
+{
+	struct RemapOrder *order = arena_alloc(arena, sizeof *order, ARENA_ALIGN);
 
-			d = d * pow(2, fstops);
+	arg->value = order;
+	return palette_order_parse(str, order);
+}
 
-			switch (img->format)
-			{
-			case BMP_FORMAT_FLOAT:
-				((float *)img->buffer)[offs + c] = (float)d;
-				break;
+static bool perform_remappalette(const struct Argument *args)
+{
+	struct Image            *img;
+	const struct RemapOrder *order = NULL;
 
-			case BMP_FORMAT_S2_13:
-				((uint16_t *)img->buffer)[offs + c] = float_to_s2_13(d);
-				break;
+	for (; args; args = args->next)
+	{
+		if (args->id == REMAP_ORDER)
+			order = args->value;
+	}
 
-			case BMP_FORMAT_INT:
-				switch (img->bitsperchannel)
-				{
-				case 8:
-					((uint8_t *)img->buffer)[offs + c] = (uint8_t)(d * ((1 << 8) - 1) + 0.5);
-					break;
+	if (!order)
+	{
+		printf("remappalette: need order\n");
+		return false;
+	}
 
-				case 16:
-					((uint16_t *)img->buffer)[offs + c] = (uint16_t)(d * ((1 << 16) - 1) + 0.5);
-					break;
+	if (!(img = imgstack_get(0)))
+		exit(1);
 
-				case 32:
-					((uint32_t *)img->buffer)[offs + c] = (uint32_t)(d * ((1ULL << 32) - 1) + 0.5);
-					break;
-				}
-			}
-		}
-	}
+	return palette_remap(img, order);
 }
 
-static bool perform_convertformat(struct Argument *args)
+static bool perform_delete(const struct Argument *args)
 {
-	const char *format = NULL;
-	int         bits = 0;
-
-	for (struct Argument *arg = args; arg; arg = arg->next)
-	{
-		char *optname  = arg->argname;
-		char *optvalue = arg->argvalue;
+	(void)args;
 
-		assert (optname != NULL);
+	imgstack_delete();
+	return true;
+}
 
-		if (!strcmp(optname, "format"))
-		{
-			format = optvalue;
-		}
-		else if (!strcmp(optname, "bits"))
-		{
-			char *endptr = NULL;
-			bits = strtol(optvalue, &endptr, 10);
-			if (endptr && *endptr != '\0')
-			{
-				if (conf->verbose > -2)
-					printf("Invalid bits specification '%s', must be an integer.\n", optvalue);
-				return false;
-			}
-		}
-		else
-		{
-			if (conf->verbose > -2)
-				printf("convertformat: unkown option '%s'\n", optname);
-			return false;
+static bool perform_compare(const struct Argument *args)
+{
+	int                     i;
+	bool                    stats = false;
+	bool                    set_max_mismatch = false, set_min_psnr = false;
+	bool                    set_epsilon = false;
+	unsigned long long      max_mismatch = 0;
+	double                  min_psnr     = 0.0;
+	struct Image           *img[2];
+	struct CompareStats     cmpstats;
+	struct CompareTolerance tol = { .fuzz = 0, .epsilon = 0.0, .relative = 0.0 };
+	BMPFORMAT               cmpformat;
+	int                     cmpbits;
+	const char             *diffname = NULL;
+	char                    diffpath[1024];
+	struct DiffImage        diff = { .path = diffpath, .amplify = 16.0 };
+	enum CompareMetric      metric = METRIC_NONE;
+	struct MetricResult     metricres;
+	double                  threshold     = 0.0;
+	bool                    set_threshold = false;
+
+	for (; args; args = args->next)
+	{
+		switch (args->id)
+		{
+		case CMP_FUZZ:
+			tol.fuzz = (uint64_t)args->num;
+			break;
+		case CMP_EPSILON:
+			tol.epsilon = args->num;
+			set_epsilon = true;
+			break;
+		case CMP_REL_EPSILON:
+			tol.relative = args->num;
+			set_epsilon  = true;
+			break;
+		case CMP_STATS:
+			stats = args->word;
+			break;
+		case CMP_DIFFIMAGE:
+			diffname = args->argvalue;
+			break;
+		case CMP_AMPLIFY:
+			diff.amplify = args->num;
+			break;
+		case CMP_METRIC:
+			metric = metrics[args->word];
+			break;
+		case CMP_THRESHOLD:
+			threshold     = args->num;
+			set_threshold = true;
+			break;
+		case CMP_MAX_MISMATCH:
+			max_mismatch     = *(const unsigned long long *)args->value;
+			set_max_mismatch = true;
+			break;
+		case CMP_MIN_PSNR:
+			min_psnr     = args->num;
+			set_min_psnr = true;
+			break;
 		}
 	}
 
-	if (!(format && *format))
+	if ((set_max_mismatch || set_min_psnr) && !stats)
 	{
-		if (conf->verbose > -2)
-			printf("convertformat: need format\n");
+		printf("compare: max-mismatch and min-psnr require 'stats: yes'\n");
 		return false;
 	}
 
-	if (!strcmp(format, "float"))
+	if (metric != METRIC_NONE && (tol.fuzz || set_epsilon || stats || diffname))
 	{
-		convert_format(BMP_FORMAT_FLOAT, 0);
+		printf("compare: metric can't be combined with fuzz, epsilon, stats, or diffimage\n");
+		return false;
 	}
-	else if (!strcmp(format, "s2.13"))
+
+	if (set_threshold && metric == METRIC_NONE)
 	{
-		convert_format(BMP_FORMAT_S2_13, 0);
+		printf("compare: threshold requires a metric\n");
+		return false;
 	}
-	else if (!strcmp(format, "int"))
+
+	for (i = 0; i < 2; i++)
 	{
-		convert_format(BMP_FORMAT_INT, bits);
+		img[i] = imgstack_get(i);
+		if (!img[i])
+			exit(1);
 	}
-	else
+
+	if (!(img[0]->width == img[1]->width && img[0]->height == img[1]->height &&
+	      img[0]->channels == img[1]->channels))
 	{
-		if (conf->verbose > -2)
-			printf("Unknown conversion to %s\n", format);
+		printf("compare: dimensions don't match: %dx%dx%d vs %dx%dx%d\n",
+		       img[0]->width, img[0]->height, img[0]->channels,
+		       img[1]->width, img[1]->height, img[1]->channels);
 		return false;
 	}
-	return true;
-}
 
-static void convert_format(BMPFORMAT format, int bits)
-{
-	struct Image *img;
-	size_t        newsize, nvals;
-	uint8_t      *tmp;
+	for (i = 0; i < 2; i++)
+	{
+		switch (img[i]->bitsperchannel)
+		{
+		case 8:
+		case 16:
+		case 32:
+			break;
 
-	if (format == BMP_FORMAT_FLOAT)
-		bits = 32;
-	else if (format == BMP_FORMAT_S2_13)
-		bits = 16;
-	else if (!(bits == 8 || bits == 16 || bits == 32))
+		default:
+			printf("Invalid bitsperchannel (%d) for comparison",
+			       img[i]->bitsperchannel);
+			return false;
+		}
+	}
+
+	if (metric != METRIC_NONE)
 	{
-		printf("convert: invalid bit-number: %d\n", bits);
-		exit(1);
+		bool failed;
+
+		if (!compare_metric(img[0], img[1], metric, &metricres))
+			return false;
+
+		if (metric == METRIC_SSIM)
+		{
+			if (!set_threshold)
+				threshold = 0.99;
+			failed = metricres.mean < threshold;
+			if (failed || conf->verbose > 1)
+				printf("compare: mean SSIM %.6f (lowest %.6f), threshold %g\n",
+				       metricres.mean, metricres.worst, threshold);
+		}
+		else
+		{
+			if (!set_threshold)
+				threshold = 1.0;
+			failed = metricres.mean > threshold;
+			if (failed || conf->verbose > 1)
+				printf("compare: mean deltaE2000 %.4f (highest %.4f), threshold %g\n",
+				       metricres.mean, metricres.worst, threshold);
+		}
+		return !failed;
 	}
 
-	if (!(img = imgstack_get(0)))
-		exit(1);
+	compare_common_format(img[0], img[1], &cmpformat, &cmpbits);
 
-	if (img->format == format && img->bitsperchannel == bits)
-		return;
+	if ((img[0]->format != img[1]->format ||
+	     img[0]->bitsperchannel != img[1]->bitsperchannel) && conf->verbose > 1)
+	{
+		printf("compare: comparing %s/%d and %s/%d as %s/%d\n",
+		       format_as_str(img[0]->format), img[0]->bitsperchannel,
+		       format_as_str(img[1]->format), img[1]->bitsperchannel,
+		       format_as_str(cmpformat), cmpbits);
+	}
 
-	nvals   = (size_t)img->width * img->height * img->channels;
-	newsize = nvals * bits / 8;
+	if (set_epsilon && cmpformat == BMP_FORMAT_INT)
+	{
+		printf("compare: epsilon and rel-epsilon only apply to float and s2.13 images\n");
+		return false;
+	}
 
-	if (newsize > img->buffersize)
+	if (diffname)
 	{
-		if (!(tmp = realloc(img->buffer, newsize)))
+		if ((int)sizeof diffpath <
+		    snprintf(diffpath, sizeof diffpath, "%s/%s", conf->tmpdir, diffname))
 		{
-			perror("realloc buffer for conv");
+			printf("compare: path too small!");
 			exit(1);
 		}
-		img->buffer     = tmp;
-		img->buffersize = newsize;
 	}
 
-	for (size_t i = 0; i < nvals; i++)
-	{
-		double d    = 0;
-		size_t offs = img->bitsperchannel >= bits ? i : (nvals - i - 1);
+	if (!(stats || diffname))
+		return compare_find_mismatch(img[0], img[1], &tol);
 
-		switch (img->format)
-		{
-		case BMP_FORMAT_FLOAT: d = ((float *)img->buffer)[offs]; break;
-		case BMP_FORMAT_S2_13:
-			d = s2_13_to_double(((int16_t *)img->buffer)[offs]);
-			break;
+	if (!compare_stats(img[0], img[1], &tol, &cmpstats, diffname ? &diff : NULL))
+		return false;
 
-		case BMP_FORMAT_INT:
-			switch (img->bitsperchannel)
-			{
-			case 8:
-				d = ((uint8_t *)img->buffer)[offs] / (double)0xffU;
-				break;
+	bool failed = false;
+	if (set_max_mismatch && cmpstats.mismatches > max_mismatch)
+		failed = true;
+	if (set_min_psnr && cmpstats.psnr < min_psnr)
+		failed = true;
+	if (!(set_max_mismatch || set_min_psnr) && cmpstats.mismatches > 0)
+		failed = true;
 
-			case 16:
-				d = ((uint16_t *)img->buffer)[offs] / (double)0xffffU;
-				break;
+	if (failed || conf->verbose > 1)
+		compare_print_stats(&cmpstats);
 
-			case 32:
-				d = ((uint32_t *)img->buffer)[offs] / (double)0xffffffffUL;
-				break;
+	return !failed;
+}
 
-			default:
-				printf("Waaaaaaaaaaaaaaa\n");
-				exit(1);
-			}
-		}
+/* compare max-mismatch: any number >= 0 */
+static bool parse_count(const char *str, struct Argument *arg, struct Arena *arena)
+{
+	unsigned long long *count = arena_alloc(arena, sizeof *count, ARENA_ALIGN);
+	char               *endptr;
 
-		switch (format)
-		{
-		case BMP_FORMAT_FLOAT:
-			((float *)img->buffer)[offs] = (float)d;
-			break;
+	*count     = strtoull(str, &endptr, 10);
+	arg->value = count;
+	return *str && *str != '-' && !*endptr;
+}
+
+/* stats expect-min/max/mean: one value for all channels, or one per
+ * channel separated by '/'
+ */
+static bool parse_channel_values(const char *str, struct Argument *arg, struct Arena *arena)
+{
+	struct ChannelValues *values = arena_alloc(arena, sizeof *values, ARENA_ALIGN);
+	const char           *p      = str;
+	char                 *endptr;
 
-		case BMP_FORMAT_S2_13:
-			((uint16_t *)img->buffer)[offs] = float_to_s2_13(d);
+	values->n  = 0;
+	arg->value = values;
+	while (values->n < 4)
+	{
+		values->v[values->n] = strtod(p, &endptr);
+		if (endptr == p || !(*endptr == '/' || *endptr == '\0'))
 			break;
+		values->n++;
+		if (!*endptr)
+			return true;
+		p = endptr + 1;
+	}
+	return false;
+}
 
-		case BMP_FORMAT_INT:
-			switch (bits)
-			{
-			case 8:
-				((uint8_t *)img->buffer)[offs] = (uint8_t)(d * (double)0xffU + 0.5);
-				break;
+static bool perform_stats(const struct Argument *args)
+{
+	struct Image   *img;
+	struct ImgStats stats;
+	const char     *histname = NULL;
+	char            histpath[1024];
+	double          expect[3][4];
+	int             nexpect[3]    = { 0 };
+	const char     *expectname[3] = { "expect-min", "expect-max", "expect-mean" };
+	double          tolerance     = -1.0;
+	bool            failed        = false;
 
-			case 16:
-				((uint16_t *)img->buffer)[offs] = (uint16_t)(d * (double)0xffffU + 0.5);
-				break;
+	for (; args; args = args->next)
+	{
+		switch (args->id)
+		{
+		case STATS_EXPECT_MIN:
+		case STATS_EXPECT_MAX:
+		case STATS_EXPECT_MEAN:
+		{
+			const struct ChannelValues *values = args->value;
 
-			case 32:
-				((uint32_t *)img->buffer)[offs] = (uint32_t)(d * (double)0xffffffffUL + 0.5);
-				break;
-			}
+			nexpect[args->id] = values->n;
+			memcpy(expect[args->id], values->v, sizeof values->v);
+			break;
+		}
+		case STATS_TOLERANCE:
+			tolerance = args->num;
+			break;
+		case STATS_HISTOGRAM:
+			histname = args->argvalue;
+			break;
 		}
 	}
 
-	if (newsize < img->buffersize)
+	if (!(img = imgstack_get(0)))
+		exit(1);
+
+	for (int i = 0; i < 3; i++)
 	{
-		tmp = realloc(img->buffer, newsize);
-		if (tmp)
+		if (nexpect[i] > 1 && nexpect[i] != img->channels)
 		{
-			img->buffer     = tmp;
-			img->buffersize = newsize;
+			printf("stats: %s has %d values, image has %d channels\n", expectname[i],
+			       nexpect[i], img->channels);
+			return false;
 		}
 	}
-	img->bitsperchannel = bits;
-	img->format         = format;
-}
 
-static bool perform_invertpalette(void)
-{
-	struct Image *img;
-
-	if (!(img = imgstack_get(0)))
-		exit(1);
-
-	if (!(img->palette && img->numcolors > 1))
+	if (tolerance < 0.0)
 	{
-		printf("invert-palette: image is not indexed\n");
-		exit(1);
+		/* default: 1% of the nominal range */
+		if (img->format == BMP_FORMAT_INT)
+			tolerance = 0.01 * (pow(2.0, img->bitsperchannel) - 1.0);
+		else
+			tolerance = 0.01;
 	}
 
-	for (int i = 0; i < img->numcolors / 2; i++)
+	if (!imgstats_compute(img, &stats, !!histname))
+		return false;
+
+	if (histname)
 	{
-		for (int j = 0; j < 4; j++)
+		if ((int)sizeof histpath <
+		    snprintf(histpath, sizeof histpath, "%s/%s", conf->tmpdir, histname))
 		{
-			int tmp;
-			tmp = img->palette[4 * i + j];
-			img->palette[4 * i + j] =
-			    img->palette[4 * (img->numcolors - i - 1) + j];
-			img->palette[4 * (img->numcolors - i - 1) + j] = tmp;
+			printf("stats: path too small!");
+			exit(1);
 		}
+		if (!imgstats_write_histogram(&stats, histpath))
+			failed = true;
 	}
 
-	for (size_t i = 0; i < (size_t)img->width * img->height; i++)
+	for (int c = 0; c < stats.channels; c++)
 	{
-		img->buffer[i] = img->numcolors - img->buffer[i] - 1;
+		double emin  = expect[0][nexpect[0] > 1 ? c : 0];
+		double emax  = expect[1][nexpect[1] > 1 ? c : 0];
+		double emean = expect[2][nexpect[2] > 1 ? c : 0];
+
+		if (nexpect[0] && stats.min[c] < emin)
+		{
+			printf("stats: channel %d: min %g, expected at least %g\n", c,
+			       stats.min[c], emin);
+			failed = true;
+		}
+		if (nexpect[1] && stats.max[c] > emax)
+		{
+			printf("stats: channel %d: max %g, expected at most %g\n", c,
+			       stats.max[c], emax);
+			failed = true;
+		}
+		if (nexpect[2] && !(fabs(stats.mean[c] - emean) <= tolerance))
+		{
+			printf("stats: channel %d: mean %g, expected %g +/- %g\n", c,
+			       stats.mean[c], emean, tolerance);
+			failed = true;
+		}
 	}
 
-	return true;
+	if (failed || conf->verbose > 1)
+		imgstats_print(&stats);
+
+	imgstats_free(&stats);
+	return !failed;
 }
 
-static bool perform_delete(void)
+/* expect-hash xxh64: up to 16 hex digits */
+static bool parse_xxh64(const char *str, struct Argument *arg, struct Arena *arena)
 {
-	imgstack_delete();
-	return true;
+	uint64_t *hash = arena_alloc(arena, sizeof *hash, ARENA_ALIGN);
+	char     *endptr;
+
+	*hash      = strtoull(str, &endptr, 16);
+	arg->value = hash;
+	return *str && *str != '-' && strlen(str) <= 16 && !*endptr;
 }
 
-static bool perform_compare(struct Argument *args)
+static bool perform_expect_hash(const struct Argument *args)
 {
-	int           i, fuzz = 0;
-	size_t        off, size;
-	struct Image *img[2];
-	const char   *opt, *optval;
+	struct Image *img;
+	const char   *key = NULL;
+	uint64_t      hash, expected = 0;
+	bool          have_literal = false;
 
-	while (args && args->argname)
+	for (; args; args = args->next)
 	{
-		opt    = args->argname;
-		optval = args->argvalue;
-
-		if (!strcmp(opt, "fuzz"))
-		{
-			fuzz = atol(optval);
-		}
-		else
+		switch (args->id)
 		{
-			printf("Warning: unknown option '%s' for compare\n", opt);
+		case HASH_XXH64:
+			expected     = *(const uint64_t *)args->value;
+			have_literal = true;
+			break;
+		case HASH_NAME:
+			key = args->argvalue;
+			break;
 		}
-		args = args->next;
-	}
-
-	for (i = 0; i < 2; i++)
-	{
-		img[i] = imgstack_get(i);
-		if (!img[i])
-			exit(1);
 	}
 
-	if (!(img[0]->width == img[1]->width && img[0]->height == img[1]->height &&
-	      img[0]->channels == img[1]->channels &&
-	      img[0]->bitsperchannel == img[1]->bitsperchannel))
+	if (have_literal && key)
 	{
-		printf("compare: dimensions don't match: %dx%dx%d@%d vs %dx%dx%d@%d\n",
-		       img[0]->width, img[0]->height, img[0]->channels,
-		       img[0]->bitsperchannel, img[1]->width, img[1]->height,
-		       img[1]->channels, img[1]->bitsperchannel);
+		printf("expect-hash: cannot have both xxh64 and name\n");
 		return false;
 	}
 
-	if (img[0]->format != img[1]->format && conf->verbose > -2)
-	{
-		printf("compare: Warning! Images have different pixel formats!\n");
-	}
+	if (!(img = imgstack_get(0)))
+		exit(1);
 
-	size = (size_t)img[0]->width * img[0]->height * img[0]->channels;
+	hash = image_hash(img);
 
-	for (off = 0; off < size; off++)
+	if (have_literal)
 	{
-		switch (img[0]->bitsperchannel)
+		if (conf->bless)
 		{
-		case 8:
-			if (fuzz < abs(((uint8_t *)img[0]->buffer)[off] -
-			               ((uint8_t *)img[1]->buffer)[off]))
-			{
-				printf(
-				    "compare: pixels don't match (%u vs %u @ %u,%u)\n",
-				    (unsigned)((uint8_t *)img[0]->buffer)[off],
-				    (unsigned)((uint8_t *)img[1]->buffer)[off],
-				    (unsigned)((off / img[0]->channels) % img[0]->width),
-				    (unsigned)((off / img[0]->channels) / img[0]->width));
-				return false;
-			}
-			break;
-
-		case 16:
-			if (fuzz < abs(((uint16_t *)img[0]->buffer)[off] -
-			               ((uint16_t *)img[1]->buffer)[off]))
-			{
-				printf(
-				    "compare: pixels don't match (%u vs %u @ %u,%u)\n",
-				    (unsigned)((uint16_t *)img[0]->buffer)[off],
-				    (unsigned)((uint16_t *)img[1]->buffer)[off],
-				    (unsigned)((off / img[0]->channels) % img[0]->width),
-				    (unsigned)((off / img[0]->channels) / img[0]->width));
-				return false;
-			}
-			break;
-
-		case 32:
-			if (fuzz < llabs((long long)(((uint32_t *)img[0]->buffer)[off]) -
-			                 (long long)(((uint32_t *)img[1]->buffer)[off])))
-			{
-				printf(
-				    "compare: pixels don't match (%u vs %u @ %u,%u)\n",
-				    (unsigned)((uint32_t *)img[0]->buffer)[off],
-				    (unsigned)((uint32_t *)img[1]->buffer)[off],
-				    (unsigned)((off / img[0]->channels) % img[0]->width),
-				    (unsigned)((off / img[0]->channels) / img[0]->width));
-				return false;
-			}
-			break;
-
-		default:
-			printf("Invalid bitsperchannel (%d) for comparison",
-			       img[0]->bitsperchannel);
+			/* literal hashes live in the test file, nothing to record */
+			if (hash != expected)
+				printf("expect-hash: update test definition to xxh64: %016" PRIx64 "\n", hash);
+			return true;
+		}
+		if (hash != expected)
+		{
+			printf("expect-hash: got %016" PRIx64 ", expected %016" PRIx64 "\n", hash,
+			       expected);
 			return false;
 		}
+		return true;
 	}
-	return true;
-}
 
-static bool perform_loadpng(struct Argument *args)
-{
-	const char   *dir = NULL, *fname = NULL;
-	const char   *dirpath;
-	char          path[1024];
-	FILE         *file = NULL;
-	struct Image *img  = NULL;
-
-	if (args)
-	{
-		dir  = args->argname;
-		args = args->next;
-	}
-	if (args)
+	if (!key)
+		key = current_test;
+	if (!(key && *key))
 	{
-		fname = args->argname;
-		args  = args->next;
+		printf("expect-hash: test has no description, need name\n");
+		return false;
 	}
 
-	if (!(fname && *fname))
+	if (!manifest_loaded)
 	{
-		printf("loadpng: invalid filespec\n");
-		goto abort;
+		if (!manifest_load(conf->manifest))
+			exit(1);
+		manifest_loaded = true;
 	}
 
-	if (!strcmp(dir, "bmpsuite"))
-	{
-		dirpath = conf->bmpsuitedir;
-	}
-	else if (!strcmp(dir, "sample"))
+	if (conf->bless)
 	{
-		dirpath = conf->sampledir;
+		if (conf->verbose > 1)
+			printf("expect-hash: '%s' = %016" PRIx64 "\n", key, hash);
+		return manifest_set(key, hash);
 	}
-	else if (!strcmp(dir, "tmp"))
+
+	if (!manifest_lookup(key, &expected))
 	{
-		dirpath = conf->tmpdir;
+		printf("expect-hash: no manifest entry for '%s' in %s (run with --bless)\n", key,
+		       conf->manifest);
+		return false;
 	}
-	else if (!strcmp(dir, "ref"))
+	if (hash != expected)
 	{
-		dirpath = conf->refdir;
+		printf("expect-hash: '%s': got %016" PRIx64 ", expected %016" PRIx64 "\n", key,
+		       hash, expected);
+		return false;
 	}
-	else
-	{
-		printf("loadpng: Invalid dir '%s'", dir);
+	return true;
+}
+
+static bool perform_loadpng(const struct Argument *args)
+{
+	const char   *fname;
+	enum Dir      dir;
+	FILE         *file = NULL;
+	struct Image *img  = NULL;
+	uint64_t      key  = 0;
+	bool          use_cache;
+
+	/* both are there, plan_compile() checked them */
+	dir   = args->word;
+	fname = args->next->argname;
+
+	if (!(file = open_in_dir(dir, fname)))
 		goto abort;
-	}
 
-	if ((int)sizeof path < snprintf(path, sizeof path, "%s/%s", dirpath, fname))
+	/* decoded reference PNGs are cached, keyed by the PNG's hash */
+	use_cache = dir == DIR_REF && strcmp(conf->refcache, "off") && settings.refcache;
+	if (use_cache)
 	{
-		printf("path too small!");
-		exit(1);
+		if (!xxh64_file(file, &key))
+		{
+			fprintf(stderr, "%s/%s: %s\n", dir_path(dir), fname, strerror(errno));
+			goto abort;
+		}
+		if ((img = refcache_load(conf->refcache, key)))
+		{
+			if (conf->verbose > 1)
+				printf("loadpng: %s from cache\n", fname);
+			fclose(file);
+			file = NULL;
+		}
+		else
+			rewind(file);
 	}
 
-	if (!(file = fopen(path, "rb")))
+	if (!img)
 	{
-		perror(path);
-		goto abort;
-	}
+		if (!(img = pngfile_read(file)))
+			goto abort;
 
-	if (!(img = pngfile_read(file)))
-		goto abort;
+		fclose(file);
+		file = NULL;
 
-	fclose(file);
+		if (use_cache && !refcache_store(conf->refcache, key, img) && conf->verbose > 0)
+			printf("loadpng: couldn't cache %s\n", fname);
+	}
 
 	img->format = BMP_FORMAT_INT;
 
@@ -2332,7 +2951,7 @@ abort:
 	if (file)
 		fclose(file);
 	if (img)
-		free(img);
+		img_free(img);
 
 	return false;
 }
@@ -2429,15 +3048,9 @@ static struct Image *pngfile_read(FILE *file)
 	img->width          = (int)width;
 	img->height         = (int)height;
 
-	if (!(row_pointers = malloc(height * sizeof *row_pointers)))
-	{
-		perror("Allocating memory for PNG row pointers");
-		goto abort;
-	}
-	memset(row_pointers, 0, height * sizeof *row_pointers);
+	row_pointers = arena_alloc(&scratch, height * sizeof *row_pointers, ARENA_ALIGN);
 
-	img->buffersize = width * height * img->channels * (bit_depth / 8);
-	if (!(img->buffer = malloc(img->buffersize)))
+	if (!img_alloc_buffer(img))
 	{
 		perror("allocate PNG buffer");
 		goto abort;
@@ -2446,7 +3059,7 @@ static struct Image *pngfile_read(FILE *file)
 
 	for (y = 0; y < (int)height; y++)
 	{
-		row_pointers[y] = img->buffer + y * width * img->channels * (bit_depth / 8);
+		row_pointers[y] = img->buffer + (size_t)y * img->stride;
 	}
 
 	png_read_image(png_ptr, row_pointers);
@@ -2455,39 +3068,34 @@ static struct Image *pngfile_read(FILE *file)
 
 	png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
 
-	free(row_pointers);
-
 	if (bit_depth == 16)
 	{
 		int      lobyte, hibyte;
 		uint16_t val;
-		size_t   pixels = width * height * img->channels;
+		size_t   rowbytes = img_rowbytes(img);
 
-		for (size_t off = 0; off / 2 < pixels; off += 2)
+		for (y = 0; y < (int)height; y++)
 		{
-			hibyte = img->buffer[off];
-			lobyte = img->buffer[off + 1];
-			val    = (hibyte << 8) + lobyte;
-			*((uint16_t *)(img->buffer + off)) = val;
+			unsigned char *row = img->buffer + (size_t)y * img->stride;
+
+			for (size_t off = 0; off < rowbytes; off += 2)
+			{
+				hibyte = row[off];
+				lobyte = row[off + 1];
+				val    = (hibyte << 8) + lobyte;
+				*((uint16_t *)(row + off)) = val;
+			}
 		}
 	}
 
 	return img;
 
 abort:
-	if (img)
-	{
-		if (img->buffer)
-			free(img->buffer);
-		free(img);
-	}
+	img_free(img);
 
 	if (png_ptr)
 		png_destroy_read_struct(&png_ptr, info_ptr ? &info_ptr : NULL, NULL);
 
-	if (row_pointers)
-		free(row_pointers);
-
 	return NULL;
 }
 
@@ -2504,25 +3112,63 @@ static void trim_trailing_slash(char *str)
 		str[--len] = 0;
 }
 
-static inline uint16_t float_to_s2_13(double d)
+/* The configured directories are opened once, files in them are opened
+ * relative to the directory's fd.
+ */
+static int dir_fds[] = { -1, -1, -1, -1 }; /* by enum Dir */
+
+static const char *dir_path(enum Dir dir)
 {
-	uint16_t u16;
+	switch (dir)
+	{
+	case DIR_BMPSUITE:
+		return conf->bmpsuitedir;
+	case DIR_SAMPLE:
+		return conf->sampledir;
+	case DIR_TMP:
+		return conf->tmpdir;
+	case DIR_REF:
+		return conf->refdir;
+	}
+	return NULL;
+}
 
-	if (d <= -4.0)
-		u16 = 0x8000;
-	else if (d >= 4.0)
-		u16 = 0x7fff;
-	else
+static int dir_fd(enum Dir dir)
+{
+	if (dir_fds[dir] == -1)
+		dir_fds[dir] = open(dir_path(dir), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	return dir_fds[dir];
+}
+
+static FILE *open_in_dir(enum Dir dir, const char *fname)
+{
+	const char *dirpath = dir_path(dir);
+	FILE       *file;
+	int         dirfd, fd;
+
+	if ((dirfd = dir_fd(dir)) == -1 || (fd = openat(dirfd, fname, O_RDONLY | O_CLOEXEC)) == -1)
+	{
+		fprintf(stderr, "%s/%s: %s\n", dirpath, fname, strerror(errno));
+		return NULL;
+	}
+
+	if (!(file = fdopen(fd, "rb")))
 	{
-		d   = round(d * 8192.0);
-		u16 = (uint16_t)(0xffff & (int32_t)d);
+		fprintf(stderr, "%s/%s: %s\n", dirpath, fname, strerror(errno));
+		close(fd);
+		return NULL;
 	}
-	return u16;
+	return file;
 }
 
-static inline double s2_13_to_double(uint16_t s2_13)
+static void close_dirs(void)
 {
-	return ((int16_t)s2_13) / 8192.0;
+	for (size_t i = 0; i < ARRAY_SIZE(dir_fds); i++)
+	{
+		if (dir_fds[i] != -1)
+			close(dir_fds[i]);
+		dir_fds[i] = -1;
+	}
 }
 
 bool bmpresult_from_str(const char *str, BMPRESULT *res)
@@ -2558,15 +3204,13 @@ const char* bmpresult_as_str(BMPRESULT result)
 	return name;
 }
 
-bool rendering_intent_from_str(const char *str, BMPINTENT *intent)
+const char *format_as_str(BMPFORMAT format)
 {
-	if (!strcmp(str, "NONE"))          *intent = BMP_INTENT_NONE;
-	else if (!strcmp(str, "BUSINESS")) *intent = BMP_INTENT_BUSINESS;
-	else if (!strcmp(str, "GRAPHICS")) *intent = BMP_INTENT_GRAPHICS;
-	else if (!strcmp(str, "IMAGES"))   *intent = BMP_INTENT_IMAGES;
-	else if (!strcmp(str, "ABS"))      *intent = BMP_INTENT_ABS_COLORIMETRIC;
-	else
-		return false;
-
-	return true;
+	switch (format)
+	{
+	case BMP_FORMAT_INT  : return "int";
+	case BMP_FORMAT_FLOAT: return "float";
+	case BMP_FORMAT_S2_13: return "s2.13";
+	}
+	return "(unknown)";
 }